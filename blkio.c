@@ -0,0 +1,281 @@
+// Block I/O backends: io_uring driven through the raw syscalls, and a
+// pread/pwrite fallback with the same queue-then-wait interface.
+#define _GNU_SOURCE
+#include "blkio.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define BLKIO_HAVE_URING 1
+#endif
+#endif
+
+#define URING_ENTRIES 64
+#define MAX_XFER (1u << 30) // bytes per request; io_uring lengths are 32-bit
+
+static void note_error(blkio_t *io, int err) {
+    if (!io->error) io->error = err;
+}
+
+// pread/pwrite backend: the request is done by the time it is "queued"
+static int psync_rw(blkio_t *io, uint8_t *p, size_t len, uint64_t off, int write) {
+    while (len > 0) {
+        ssize_t n = write ? pwrite(io->fd, p, len, (off_t)off) : pread(io->fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            int err = n < 0 ? errno : EIO;
+            note_error(io, err);
+            errno = err;
+            return -1;
+        }
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int psync_fsync(blkio_t *io) {
+    if (fsync(io->fd) != 0) {
+        note_error(io, errno);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef BLKIO_HAVE_URING
+static void uring_teardown(blkio_t *io) {
+    if (io->sqes) munmap(io->sqes, io->sqes_len);
+    if (io->cq_ring && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_len);
+    if (io->sq_ring) munmap(io->sq_ring, io->sq_ring_len);
+    if (io->ring_fd >= 0) close(io->ring_fd);
+    io->sqes = io->cq_ring = io->sq_ring = NULL;
+    io->ring_fd = -1;
+}
+
+// Create the ring and map its SQ, CQ and SQE arrays
+static int uring_setup(blkio_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (io->ring_fd < 0) return -1;
+
+    //IORING_OP_READ and IORING_OP_WRITE came with this feature bit
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_teardown(io);
+        return -1;
+    }
+
+    io->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && io->cq_ring_len > io->sq_ring_len) io->sq_ring_len = io->cq_ring_len;
+
+    void *sq = mmap(NULL, io->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        uring_teardown(io);
+        return -1;
+    }
+    io->sq_ring = sq;
+    if (single) {
+        io->cq_ring = sq;
+    } else {
+        void *cq = mmap(NULL, io->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        io->ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            uring_teardown(io);
+            return -1;
+        }
+        io->cq_ring = cq;
+    }
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_teardown(io);
+        return -1;
+    }
+    io->sqes = sqes;
+
+    uint8_t *sqr = io->sq_ring, *cqr = io->cq_ring;
+    io->sq_head = (unsigned *)(sqr + p.sq_off.head);
+    io->sq_tail = (unsigned *)(sqr + p.sq_off.tail);
+    io->sq_mask = (unsigned *)(sqr + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sqr + p.sq_off.array);
+    io->cq_head = (unsigned *)(cqr + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cqr + p.cq_off.tail);
+    io->cq_mask = (unsigned *)(cqr + p.cq_off.ring_mask);
+    io->cqes = cqr + p.cq_off.cqes;
+    io->sq_entries = p.sq_entries;
+    io->cq_entries = p.cq_entries;
+    return 0;
+}
+
+// Consume every posted completion. user_data holds the expected length,
+// so a short transfer is caught here too.
+static unsigned uring_reap(blkio_t *io) {
+    struct io_uring_cqe *cqes = io->cqes;
+    unsigned head = *io->cq_head;
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; head++, n++) {
+        const struct io_uring_cqe *c = &cqes[head & *io->cq_mask];
+        if (c->res < 0) note_error(io, -c->res);
+        else if ((uint64_t)c->res != c->user_data) note_error(io, EIO);
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    io->inflight -= n;
+    return n;
+}
+
+// Hand all queued SQEs to the kernel and wait for min_complete completions
+static int uring_enter(blkio_t *io, unsigned min_complete) {
+    while (io->queued || min_complete) {
+        int ret = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->queued, min_complete,
+                               min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            note_error(io, errno);
+            return -1;
+        }
+        io->queued -= (unsigned)ret;
+        io->inflight += (unsigned)ret;
+        unsigned reaped = uring_reap(io);
+        min_complete = reaped >= min_complete ? 0 : min_complete - reaped;
+        if (ret == 0 && io->queued && !min_complete) {
+            note_error(io, EBUSY);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Make room for n SQEs that must go to the kernel in the same submission
+// (a linked chain), without overrunning the completion ring
+static int uring_reserve(blkio_t *io, unsigned n) {
+    if (io->queued + n > io->sq_entries && uring_enter(io, 0) != 0) return -1;
+    while (io->queued + io->inflight + n > io->cq_entries)
+        if (uring_enter(io, 1) != 0) return -1;
+    return 0;
+}
+
+static void uring_push(blkio_t *io, uint8_t op, const void *buf, uint32_t len, uint64_t off, uint8_t flags) {
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)io->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = io->fd;
+    sqe->off = off;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = len;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->queued++;
+}
+#endif
+
+int blkio_init(blkio_t *io, int fd, int backend) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->ring_fd = -1;
+    if (backend != BLKIO_AUTO && backend != BLKIO_PSYNC && backend != BLKIO_URING) {
+        errno = EINVAL;
+        return -1;
+    }
+    io->backend = BLKIO_PSYNC;
+#ifdef BLKIO_HAVE_URING
+    if (backend != BLKIO_PSYNC && uring_setup(io) == 0) io->backend = BLKIO_URING;
+#endif
+    return 0;
+}
+
+void blkio_exit(blkio_t *io) {
+#ifdef BLKIO_HAVE_URING
+    if (io->backend == BLKIO_URING) {
+        //Never leave the kernel writing into buffers the caller may free
+        if (io->queued || io->inflight) blkio_wait(io);
+        uring_teardown(io);
+    }
+#endif
+    io->backend = BLKIO_PSYNC;
+}
+
+const char *blkio_backend_name(const blkio_t *io) {
+    return io->backend == BLKIO_URING ? "io_uring" : "pread/pwrite";
+}
+
+static int queue_rw(blkio_t *io, uint8_t *p, size_t len, uint64_t off, int write) {
+    if (io->backend == BLKIO_PSYNC) return psync_rw(io, p, len, off, write);
+#ifdef BLKIO_HAVE_URING
+    while (len > 0) {
+        uint32_t n = len > MAX_XFER ? MAX_XFER : (uint32_t)len;
+        if (uring_reserve(io, 1) != 0) return -1;
+        uring_push(io, write ? IORING_OP_WRITE : IORING_OP_READ, p, n, off, 0);
+        p += n;
+        off += n;
+        len -= n;
+    }
+#endif
+    return 0;
+}
+
+int blkio_read(blkio_t *io, void *buf, size_t len, uint64_t off) {
+    return queue_rw(io, buf, len, off, 0);
+}
+
+int blkio_write(blkio_t *io, const void *buf, size_t len, uint64_t off) {
+    return queue_rw(io, (uint8_t *)buf, len, off, 1);
+}
+
+int blkio_fsync(blkio_t *io) {
+    if (io->backend == BLKIO_PSYNC) return psync_fsync(io);
+#ifdef BLKIO_HAVE_URING
+    if (uring_reserve(io, 1) != 0) return -1;
+    uring_push(io, IORING_OP_FSYNC, NULL, 0, 0, IOSQE_IO_DRAIN);
+#endif
+    return 0;
+}
+
+int blkio_write_ordered(blkio_t *io, const void *buf, size_t len, uint64_t off) {
+    if (len > MAX_XFER) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (io->backend == BLKIO_PSYNC) {
+        if (psync_fsync(io) != 0) return -1;
+        if (psync_rw(io, (uint8_t *)buf, len, off, 1) != 0) return -1;
+        return psync_fsync(io);
+    }
+#ifdef BLKIO_HAVE_URING
+    //A failed link cancels the rest of the chain, so the write never lands
+    //on top of data that did not reach the disk
+    if (uring_reserve(io, 3) != 0) return -1;
+    uring_push(io, IORING_OP_FSYNC, NULL, 0, 0, IOSQE_IO_DRAIN | IOSQE_IO_LINK);
+    uring_push(io, IORING_OP_WRITE, buf, (uint32_t)len, off, IOSQE_IO_LINK);
+    uring_push(io, IORING_OP_FSYNC, NULL, 0, 0, 0);
+#endif
+    return 0;
+}
+
+int blkio_wait(blkio_t *io) {
+#ifdef BLKIO_HAVE_URING
+    if (io->backend == BLKIO_URING) uring_enter(io, io->queued + io->inflight);
+#endif
+    int err = io->error;
+    io->error = 0;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Block I/O backends for the MiniVSFS tools. Reads, writes and fsyncs are
+// queued against one file descriptor and completed by blkio_wait(); with
+// io_uring a whole batch is in flight at once, the pread/pwrite fallback
+// simply performs each request as it is queued.
+#ifndef MINIVSFS_BLKIO_H
+#define MINIVSFS_BLKIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLKIO_AUTO  0   // io_uring when the kernel allows it, else pread/pwrite
+#define BLKIO_PSYNC 1
+#define BLKIO_URING 2
+
+typedef struct {
+    int fd;
+    int backend;                 // BLKIO_PSYNC or BLKIO_URING
+    int error;                   // first errno seen since the last blkio_wait
+    // io_uring state
+    int ring_fd;
+    unsigned sq_entries, cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes, *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned queued;             // filled SQEs not yet handed to the kernel
+    unsigned inflight;           // submitted, completion not yet reaped
+} blkio_t;
+
+// Attach to fd. BLKIO_AUTO and BLKIO_URING fall back to BLKIO_PSYNC when
+// io_uring is unavailable, so this only fails for a bad backend value.
+int blkio_init(blkio_t *io, int fd, int backend);
+void blkio_exit(blkio_t *io);
+const char *blkio_backend_name(const blkio_t *io);
+
+// Queue a transfer. buf must stay valid, and untouched for writes, until
+// blkio_wait() returns. Requests may complete in any order.
+int blkio_read(blkio_t *io, void *buf, size_t len, uint64_t off);
+int blkio_write(blkio_t *io, const void *buf, size_t len, uint64_t off);
+
+// Queue an fsync that starts only after everything queued before it
+int blkio_fsync(blkio_t *io);
+
+// Queue fsync, write, fsync as one linked chain after everything queued
+// before it: the write is only issued once the earlier data is stable and
+// is itself stable when the chain completes. Used for the superblock.
+int blkio_write_ordered(blkio_t *io, const void *buf, size_t len, uint64_t off);
+
+// Submit everything queued and wait for it. Returns 0, or -1 with errno
+// set to the first failure (a short transfer counts as EIO).
+int blkio_wait(blkio_t *io);
+
+#endif
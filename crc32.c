@@ -0,0 +1,223 @@
+// CRC32 engines: byte-at-a-time reference, portable slicing-by-8 and
+// PCLMULQDQ folding on x86, selected at runtime by crc32_init().
+#include "crc32.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t CRC32_TAB[8][256];
+static uint32_t X2N_TAB[32];
+static int use_pclmul;
+
+// Multiply a and b modulo the CRC polynomial (bit-reflected)
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) modulo the CRC polynomial
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = 1u << 31; // x^0
+    while (n) {
+        if (n & 1) p = multmodp(X2N_TAB[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        CRC32_TAB[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = CRC32_TAB[k - 1][i];
+            CRC32_TAB[k][i] = (c >> 8) ^ CRC32_TAB[0][c & 0xFF];
+        }
+    }
+
+    uint32_t p = 1u << 30; // x^1
+    X2N_TAB[0] = p;
+    for (int n = 1; n < 32; n++)
+        X2N_TAB[n] = p = multmodp(p, p);
+
+#ifdef CRC32_HAVE_X86
+    __builtin_cpu_init();
+    use_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+uint32_t crc32_update_bytewise(uint32_t crc, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+    for (size_t i = 0; i < n; i++)
+        c = CRC32_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Raw register form (no pre/post inversion) of slicing-by-8
+static uint32_t slice8_raw(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t lo = c ^ load_le32(p);
+        uint32_t hi = load_le32(p + 4);
+        c = CRC32_TAB[7][lo & 0xFF] ^ CRC32_TAB[6][(lo >> 8) & 0xFF] ^
+            CRC32_TAB[5][(lo >> 16) & 0xFF] ^ CRC32_TAB[4][lo >> 24] ^
+            CRC32_TAB[3][hi & 0xFF] ^ CRC32_TAB[2][(hi >> 8) & 0xFF] ^
+            CRC32_TAB[1][(hi >> 16) & 0xFF] ^ CRC32_TAB[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        c = CRC32_TAB[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+uint32_t crc32_update_slice8(uint32_t crc, const void *data, size_t n) {
+    return ~slice8_raw(~crc, (const uint8_t *)data, n);
+}
+
+#ifdef CRC32_HAVE_X86
+// Fold 64 bytes per iteration with carry-less multiplies, then Barrett
+// reduce to 32 bits. n must be >= 64 and a multiple of 16. Constants are
+// x^(k) mod P for the reflected 0xEDB88320 polynomial.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t pclmul_raw(uint32_t crc, const uint8_t *buf, size_t n) {
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    n -= 64;
+
+    //Four parallel folds of 64 bytes
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        n -= 64;
+    }
+
+    //Fold the four lanes into one 128-bit value
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    //Remaining 16-byte blocks
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        n -= 16;
+    }
+
+    //128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    //Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t crc32_update_pclmul(uint32_t crc, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+#ifdef CRC32_HAVE_X86
+    if (use_pclmul && n >= 64) {
+        size_t chunk = n & ~(size_t)15;
+        c = pclmul_raw(c, p, chunk);
+        p += chunk;
+        n -= chunk;
+    }
+#endif
+    return ~slice8_raw(c, p, n);
+}
+
+int crc32_have_pclmul(void) {
+    return use_pclmul;
+}
+
+const char *crc32_engine_name(void) {
+    return use_pclmul ? "pclmul" : "slice8";
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n) {
+    if (use_pclmul) return crc32_update_pclmul(crc, data, n);
+    return crc32_update_slice8(crc, data, n);
+}
+
+uint32_t crc32(const void *data, size_t n) {
+    return crc32_update(0, data, n);
+}
+
+uint32_t crc32_zeros(uint32_t crc, uint64_t n) {
+    // Appending zero bytes multiplies the CRC register by x^(8n) mod P
+    if (n == 0) return crc;
+    return ~multmodp(x2nmodp(n, 3), ~crc);
+}
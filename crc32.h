@@ -0,0 +1,29 @@
+// CRC32 (polynomial 0xEDB88320) shared by the MiniVSFS tools
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Build the lookup tables and pick the fastest engine for this CPU.
+// Must be called once before any other crc32 function.
+void crc32_init(void);
+
+// CRC32 of a buffer
+uint32_t crc32(const void *data, size_t n);
+
+// Continue a CRC32 over more data; crc32_update(0, p, n) == crc32(p, n)
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n);
+
+// CRC32 of the data already hashed into crc followed by n zero bytes,
+// computed in O(log n) without touching any memory
+uint32_t crc32_zeros(uint32_t crc, uint64_t n);
+
+// Individual engines, exposed for crc32_bench
+uint32_t crc32_update_bytewise(uint32_t crc, const void *data, size_t n);
+uint32_t crc32_update_slice8(uint32_t crc, const void *data, size_t n);
+uint32_t crc32_update_pclmul(uint32_t crc, const void *data, size_t n);
+int crc32_have_pclmul(void);
+const char *crc32_engine_name(void);
+
+#endif
@@ -0,0 +1,93 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra crc32_bench.c crc32.c -o crc32_bench
+// Microbenchmark of the CRC32 engines against the original byte-at-a-time
+// table loop. Also cross-checks that every engine returns the same value.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+typedef uint32_t (*crc_fn)(uint32_t, const void *, size_t);
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, crc_fn fn, const uint8_t *buf, size_t len, size_t iters) {
+    volatile uint32_t sink = 0;
+    double t0 = now_sec();
+#ifdef HAVE_RDTSC
+    uint64_t c0 = __rdtsc();
+#endif
+    for (size_t i = 0; i < iters; i++)
+        sink ^= fn(0, buf, len);
+#ifdef HAVE_RDTSC
+    uint64_t cycles = __rdtsc() - c0;
+#endif
+    double secs = now_sec() - t0;
+    double bytes = (double)len * iters;
+
+    printf("%-10s %8zu B  %9.2f MB/s", name, len, bytes / secs / 1e6);
+#ifdef HAVE_RDTSC
+    printf("  %6.3f bytes/cycle", bytes / (double)cycles);
+#endif
+    printf("\n");
+    (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    size_t total = argc > 1 ? strtoull(argv[1], NULL, 10) : (256u << 20);
+    const size_t sizes[] = { 116, 120, 4092, 65536, 1u << 20 };
+
+    uint8_t *buf = malloc(1u << 20);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < (1u << 20); i++) buf[i] = (uint8_t)rand();
+
+    //Every engine must agree with the reference at every length and alignment
+    for (size_t len = 0; len < 1024; len++) {
+        for (size_t off = 0; off < 8; off++) {
+            uint32_t ref = crc32_update_bytewise(0, buf + off, len);
+            if (crc32_update_slice8(0, buf + off, len) != ref ||
+                crc32_update_pclmul(0, buf + off, len) != ref ||
+                crc32(buf + off, len) != ref) {
+                fprintf(stderr, "Mismatch at len %zu offset %zu\n", len, off);
+                free(buf);
+                return 1;
+            }
+        }
+    }
+    uint8_t padded[100 + 4096] = {0};
+    memcpy(padded, buf, 100);
+    if (crc32_zeros(crc32(buf, 100), 4096) != crc32(padded, sizeof(padded))) {
+        fprintf(stderr, "crc32_zeros mismatch\n");
+        free(buf);
+        return 1;
+    }
+
+    printf("Selected engine: %s\n", crc32_engine_name());
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t iters = total / sizes[i] ? total / sizes[i] : 1;
+        bench("bytewise", crc32_update_bytewise, buf, sizes[i], iters);
+        bench("slice8", crc32_update_slice8, buf, sizes[i], iters);
+        if (crc32_have_pclmul())
+            bench("pclmul", crc32_update_pclmul, buf, sizes[i], iters);
+    }
+
+    free(buf);
+    return 0;
+}
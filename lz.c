@@ -0,0 +1,175 @@
+// LZ4-style compressor: greedy matching against a hash table of 4-byte
+// sequences, skipping ahead faster the longer no match turns up, and a
+// decoder that bounds-checks every read and write.
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_HASH_BITS  12
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5   // a block always ends with at least this many literals
+#define LZ_SKIP_TRIGGER  6   // literals per extra byte of search step
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length of the common prefix of a and b, at most max bytes
+static size_t common_prefix(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t len = 0;
+#if (defined(__GNUC__) || defined(__clang__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    //Eight bytes at a time; the lowest differing byte ends the match
+    while (len + 8 <= max) {
+        uint64_t diff = read64(a + len) ^ read64(b + len);
+        if (diff) return len + (size_t)__builtin_ctzll(diff) / 8;
+        len += 8;
+    }
+#endif
+    while (len < max && a[len] == b[len]) len++;
+    return len;
+}
+
+// Append a length continuation (the part of len past a full nibble)
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Bytes a sequence with `lit` literals and a match takes at most
+static size_t sequence_bound(size_t lit) {
+    return 1 + lit / 255 + 1 + lit + 2;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap, int accel) {
+    const uint8_t *in = src;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    if (accel < 1) accel = 1;
+
+    size_t anchor = 0;
+    if (n > LZ_LAST_LITERALS + LZ_MIN_MATCH) {
+        size_t limit = n - LZ_LAST_LITERALS - LZ_MIN_MATCH; // last position a match may start at
+        size_t match_end = n - LZ_LAST_LITERALS;
+        size_t i = 1;
+        while (i <= limit) {
+            uint32_t seq = read32(in + i);
+            uint32_t h = hash4(seq);
+            size_t cand = table[h];
+            table[h] = (uint32_t)i;
+            if (cand >= i || i - cand > LZ_MAX_OFFSET || read32(in + cand) != seq) {
+                i += (size_t)accel + ((i - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            //Grow the match backwards over literals, then forwards
+            while (i > anchor && cand > 0 && in[i - 1] == in[cand - 1]) {
+                i--;
+                cand--;
+            }
+            size_t len = LZ_MIN_MATCH + common_prefix(in + cand + LZ_MIN_MATCH, in + i + LZ_MIN_MATCH,
+                                                      match_end - i - LZ_MIN_MATCH);
+
+            size_t lit = i - anchor, mlen = len - LZ_MIN_MATCH;
+            if ((size_t)(oend - op) < sequence_bound(lit) + mlen / 255 + 1) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15));
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, in + anchor, lit);
+            op += lit;
+            size_t off = i - cand;
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+
+            i += len;
+            anchor = i;
+            //Remember a position inside the match too, it often repeats
+            if (i - 2 <= limit) table[hash4(read32(in + i - 2))] = (uint32_t)(i - 2);
+        }
+    }
+
+    size_t lit = n - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, in + anchor, lit);
+    op += lit;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// Read a length continuation; -1 when the input ends inside it
+static int64_t get_length(const uint8_t **ip, const uint8_t *iend) {
+    int64_t len = 0;
+    for (;;) {
+        if (*ip >= iend) return -1;
+        uint8_t b = *(*ip)++;
+        len += b;
+        if (b != 255) return len;
+    }
+}
+
+int64_t lz_decompress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = ip + n;
+    uint8_t *op = dst, *oend = op + cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int64_t lit = token >> 4;
+        if (lit == 15) {
+            int64_t more = get_length(&ip, iend);
+            if (more < 0) return -1;
+            lit += more;
+        }
+        //Short literal runs are copied as a fixed 16 bytes when both sides
+        //have room; anything written past the run is overwritten next
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            if (lit > iend - ip || lit > oend - op) return -1;
+            memcpy(op, ip, (size_t)lit);
+        }
+        ip += lit;
+        op += lit;
+        if (ip == iend) break; // last sequence: literals only
+
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        int64_t len = token & 15;
+        if (len == 15) {
+            int64_t more = get_length(&ip, iend);
+            if (more < 0) return -1;
+            len += more;
+        }
+        len += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - (uint8_t *)dst) || len > oend - op) return -1;
+
+        const uint8_t *match = op - off;
+        if (off >= 8 && oend - op >= len + 8) {
+            //Eight bytes per step, which never reads bytes not yet written
+            for (int64_t k = 0; k < len; k += 8) memcpy(op + k, match + k, 8);
+            op += len;
+        } else if (off >= (size_t)len) {
+            memcpy(op, match, (size_t)len);
+            op += len;
+        } else {
+            //Overlapping copy repeats the last `off` bytes
+            while (len-- > 0) *op++ = *match++;
+        }
+    }
+    return op - (uint8_t *)dst;
+}
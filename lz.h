@@ -0,0 +1,24 @@
+// LZ4-style block codec for compressed MiniVSFS files. A compressed block
+// is a series of sequences, each a token byte (literal count in the high
+// nibble, match length - 4 in the low one, 15 meaning further length bytes
+// follow, each adding up to 255), the literals, and a 16-bit little-endian
+// match offset. The last sequence has literals only. Every block decodes
+// on its own.
+#ifndef MINIVSFS_LZ_H
+#define MINIVSFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_ACCEL_DEFAULT 1
+
+// Compress n bytes of src into at most cap bytes of dst. Returns the
+// compressed size, or 0 when the result would not fit in cap. Larger
+// accel values search less and trade ratio for speed.
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap, int accel);
+
+// Decompress a block into at most cap bytes of dst. Returns the size
+// produced, or -1 for input that is malformed or would overflow dst.
+int64_t lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
@@ -0,0 +1,188 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra lz_bench.c lz.c -o lz_bench
+// Ratio against speed of the LZ codec, per chunk size and acceleration,
+// on a given file or on generated text, mixed and random data. Also
+// round-trips every case and feeds the decoder damaged blocks.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "lz.h"
+
+#define CORPUS_MAX (64u << 20)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Words from a small vocabulary, like logs or source text
+static void gen_text(uint8_t *buf, size_t len) {
+    static const char *words[] = {
+        "inode", "block", "extent", "group", "bitmap", "commit", "journal", "the", "of", "and",
+        "free", "data", "write", "read", "error", "ok", "size", "name", "root", "directory",
+    };
+    size_t pos = 0;
+    while (pos < len) {
+        const char *w = words[rand() % 20];
+        for (size_t i = 0; w[i] && pos < len; i++) buf[pos++] = (uint8_t)w[i];
+        if (pos < len) buf[pos++] = rand() % 12 ? ' ' : '\n';
+    }
+}
+
+// Runs of repeated records with random fields, like a binary table
+static void gen_mixed(uint8_t *buf, size_t len) {
+    for (size_t pos = 0; pos < len; pos++) buf[pos] = pos % 32 < 24 ? (uint8_t)(pos % 32) : (uint8_t)rand();
+}
+
+static void gen_random(uint8_t *buf, size_t len) {
+    for (size_t pos = 0; pos < len; pos++) buf[pos] = (uint8_t)rand();
+}
+
+// Compress the corpus chunk by chunk, then decompress it, checking the round
+// trip. Incompressible chunks count at their raw size, as files store them.
+static int bench(const char *name, const uint8_t *buf, size_t len, size_t chunk, int accel, int repeat) {
+    uint8_t *comp = malloc(len + len / chunk + 1);
+    size_t *sizes = malloc((len / chunk + 1) * sizeof(*sizes));
+    uint8_t *out = malloc(chunk);
+    if (!comp || !sizes || !out) {
+        perror("malloc");
+        free(comp);
+        free(sizes);
+        free(out);
+        return 1;
+    }
+
+    size_t nchunks = 0, stored = 0;
+    double t0 = now_sec();
+    for (int r = 0; r < repeat; r++) {
+        nchunks = 0;
+        stored = 0;
+        for (size_t off = 0; off < len; off += chunk) {
+            size_t n = len - off < chunk ? len - off : chunk;
+            size_t c = lz_compress(buf + off, n, comp + stored, n - 1, accel);
+            if (c == 0) {
+                memcpy(comp + stored, buf + off, n);
+                c = n;
+            }
+            sizes[nchunks++] = c;
+            stored += c;
+        }
+    }
+    double tc = now_sec() - t0;
+
+    t0 = now_sec();
+    int status = 0;
+    for (int r = 0; r < repeat && status == 0; r++) {
+        size_t pos = 0;
+        for (size_t i = 0; i < nchunks; i++) {
+            size_t n = len - i * chunk < chunk ? len - i * chunk : chunk;
+            if (sizes[i] == n) {
+                memcpy(out, comp + pos, n);
+            } else if (lz_decompress(comp + pos, sizes[i], out, chunk) != (int64_t)n) {
+                status = 1;
+            }
+            if (status || memcmp(out, buf + i * chunk, n) != 0) {
+                fprintf(stderr, "%s: chunk %zu does not round-trip\n", name, i);
+                status = 1;
+                break;
+            }
+            pos += sizes[i];
+        }
+    }
+    double td = now_sec() - t0;
+
+    if (status == 0) {
+        double bytes = (double)len * repeat;
+        printf("%-8s %7zu KiB  accel %2d  ratio %6.3f  compress %8.1f MB/s  decompress %8.1f MB/s\n",
+               name, chunk >> 10, accel, (double)len / (double)stored, bytes / tc / 1e6, bytes / td / 1e6);
+    }
+    free(comp);
+    free(sizes);
+    free(out);
+    return status;
+}
+
+// The decoder must reject or survive anything: truncated and bit-flipped blocks
+static int damage_test(const uint8_t *buf, size_t len) {
+    size_t n = len < 65536 ? len : 65536;
+    uint8_t *comp = malloc(n + n / 255 + 16), *out = malloc(n);
+    if (!comp || !out) {
+        perror("malloc");
+        free(comp);
+        free(out);
+        return 1;
+    }
+    size_t c = lz_compress(buf, n, comp, n + n / 255 + 16, LZ_ACCEL_DEFAULT);
+    for (size_t cut = 0; cut < c; cut += 1 + c / 512) lz_decompress(comp, cut, out, n);
+    for (int i = 0; i < 2000; i++) {
+        size_t at = (size_t)rand() % c;
+        comp[at] ^= (uint8_t)(1u << (rand() % 8));
+        lz_decompress(comp, c, out, n);
+        comp[at] ^= (uint8_t)(1u << (rand() % 8));
+    }
+    free(comp);
+    free(out);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t *file = NULL;
+    size_t file_len = 0;
+    if (argc > 1) {
+        FILE *f = fopen(argv[1], "rb");
+        if (!f) {
+            perror(argv[1]);
+            return 1;
+        }
+        file = malloc(CORPUS_MAX);
+        if (!file) {
+            perror("malloc");
+            fclose(f);
+            return 1;
+        }
+        file_len = fread(file, 1, CORPUS_MAX, f);
+        fclose(f);
+        if (file_len == 0) {
+            fprintf(stderr, "%s is empty\n", argv[1]);
+            free(file);
+            return 1;
+        }
+    }
+
+    size_t len = 16u << 20;
+    uint8_t *text = malloc(len), *mixed = malloc(len), *rnd = malloc(len);
+    if (!text || !mixed || !rnd) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    gen_text(text, len);
+    gen_mixed(mixed, len);
+    gen_random(rnd, len);
+
+    struct { const char *name; const uint8_t *buf; size_t len; } corpora[] = {
+        { "file", file, file_len }, { "text", text, len }, { "mixed", mixed, len }, { "random", rnd, len },
+    };
+    const size_t chunks[] = { 4096, 16384, 65536, 262144 };
+    const int accels[] = { 1, 2, 4, 8 };
+
+    int status = 0;
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]) && status == 0; c++) {
+        if (!corpora[c].buf) continue;
+        status |= damage_test(corpora[c].buf, corpora[c].len);
+        int repeat = corpora[c].len < (4u << 20) ? 8 : 1;
+        for (size_t k = 0; k < sizeof(chunks) / sizeof(chunks[0]) && status == 0; k++)
+            status |= bench(corpora[c].name, corpora[c].buf, corpora[c].len, chunks[k], LZ_ACCEL_DEFAULT, repeat);
+        for (size_t a = 1; a < sizeof(accels) / sizeof(accels[0]) && status == 0; a++)
+            status |= bench(corpora[c].name, corpora[c].buf, corpora[c].len, 65536, accels[a], repeat);
+    }
+
+    free(file);
+    free(text);
+    free(mixed);
+    free(rnd);
+    return status;
+}
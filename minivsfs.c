@@ -0,0 +1,3989 @@
+// MiniVSFS image library: on-disk format helpers and the fs_image_t handle
+// used by mkfs_adder. See minivsfs.h for the API.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE // copy_file_range, fallocate
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/stat.h>
+#include "minivsfs.h"
+#include "lz.h"
+
+void superblock_crc_finalize(superblock_t *sb) {
+    //Covers the zero-padded superblock block up to its last 4 bytes; the
+    //padding is folded in arithmetically instead of being read
+    sb->checksum = 0;
+    uint32_t s = crc32_zeros(crc32(sb, sizeof(*sb)), BS - 4 - sizeof(*sb));
+    sb->checksum = s;
+}
+
+void inode_crc_finalize(inode_t* ino) {
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+
+// Conversion functions
+void superblock_to_host(superblock_t *sb) {
+    sb->magic = from_le32(sb->magic);
+    sb->version = from_le32(sb->version);
+    sb->block_size = from_le32(sb->block_size);
+    sb->total_blocks = from_le64(sb->total_blocks);
+    sb->inode_count = from_le64(sb->inode_count);
+    sb->inode_bitmap_start = from_le64(sb->inode_bitmap_start);
+    sb->inode_bitmap_blocks = from_le64(sb->inode_bitmap_blocks);
+    sb->data_bitmap_start = from_le64(sb->data_bitmap_start);
+    sb->data_bitmap_blocks = from_le64(sb->data_bitmap_blocks);
+    sb->inode_table_start = from_le64(sb->inode_table_start);
+    sb->inode_table_blocks = from_le64(sb->inode_table_blocks);
+    sb->data_region_start = from_le64(sb->data_region_start);
+    sb->data_region_blocks = from_le64(sb->data_region_blocks);
+    sb->root_inode = from_le64(sb->root_inode);
+    sb->mtime_epoch = from_le64(sb->mtime_epoch);
+    sb->flags = from_le32(sb->flags);
+    sb->checksum = from_le32(sb->checksum);
+    sb->group_desc_start = from_le64(sb->group_desc_start);
+    sb->group_desc_blocks = from_le64(sb->group_desc_blocks);
+    sb->group_count = from_le64(sb->group_count);
+    sb->blocks_per_group = from_le64(sb->blocks_per_group);
+    sb->inodes_per_group = from_le64(sb->inodes_per_group);
+    sb->free_blocks = from_le64(sb->free_blocks);
+    sb->free_inodes = from_le64(sb->free_inodes);
+    sb->dedup_index = from_le64(sb->dedup_index);
+    sb->dedup_entries = from_le64(sb->dedup_entries);
+}
+
+void superblock_to_disk(superblock_t *sb) {
+    sb->magic              = to_le32(sb->magic);
+    sb->version            = to_le32(sb->version);
+    sb->block_size         = to_le32(sb->block_size);
+    sb->total_blocks       = to_le64(sb->total_blocks);
+    sb->inode_count        = to_le64(sb->inode_count);
+    sb->inode_bitmap_start = to_le64(sb->inode_bitmap_start);
+    sb->inode_bitmap_blocks= to_le64(sb->inode_bitmap_blocks);
+    sb->data_bitmap_start  = to_le64(sb->data_bitmap_start);
+    sb->data_bitmap_blocks = to_le64(sb->data_bitmap_blocks);
+    sb->inode_table_start  = to_le64(sb->inode_table_start);
+    sb->inode_table_blocks = to_le64(sb->inode_table_blocks);
+    sb->data_region_start  = to_le64(sb->data_region_start);
+    sb->data_region_blocks = to_le64(sb->data_region_blocks);
+    sb->root_inode         = to_le64(sb->root_inode);
+    sb->mtime_epoch        = to_le64(sb->mtime_epoch);
+    sb->flags              = to_le32(sb->flags);
+    sb->group_desc_start   = to_le64(sb->group_desc_start);
+    sb->group_desc_blocks  = to_le64(sb->group_desc_blocks);
+    sb->group_count        = to_le64(sb->group_count);
+    sb->blocks_per_group   = to_le64(sb->blocks_per_group);
+    sb->inodes_per_group   = to_le64(sb->inodes_per_group);
+    sb->free_blocks        = to_le64(sb->free_blocks);
+    sb->free_inodes        = to_le64(sb->free_inodes);
+    sb->dedup_index        = to_le64(sb->dedup_index);
+    sb->dedup_entries      = to_le64(sb->dedup_entries);
+}
+
+void inode_to_host(inode_t *in) {
+    in->mode = from_le16(in->mode);
+    in->links = from_le16(in->links);
+    in->uid = from_le32(in->uid);
+    in->gid = from_le32(in->gid);
+    in->size_bytes = from_le64(in->size_bytes);
+    in->atime = from_le64(in->atime);
+    in->mtime = from_le64(in->mtime);
+    in->ctime = from_le64(in->ctime);
+    in->reserved_0 = from_le32(in->reserved_0);
+    //Inline data is bytes, not block numbers
+    if (!(in->reserved_0 & INODE_FL_INLINE))
+        for (int i = 0; i < 12; i++) in->direct[i] = from_le32(in->direct[i]);
+    in->reserved_1 = from_le32(in->reserved_1);
+    in->reserved_2 = from_le32(in->reserved_2);
+    in->proj_id = from_le32(in->proj_id);
+    in->uid16_gid16 = from_le32(in->uid16_gid16);
+    in->xattr_ptr = from_le64(in->xattr_ptr);
+    in->inode_crc = from_le64(in->inode_crc);
+}
+
+void inode_to_disk(inode_t *in) {
+    in->mode = to_le16(in->mode);
+    in->links = to_le16(in->links);
+    in->uid = to_le32(in->uid);
+    in->gid = to_le32(in->gid);
+    in->size_bytes = to_le64(in->size_bytes);
+    in->atime = to_le64(in->atime);
+    in->mtime = to_le64(in->mtime);
+    in->ctime = to_le64(in->ctime);
+    if (!(in->reserved_0 & INODE_FL_INLINE))
+        for (int i = 0; i < 12; i++) in->direct[i] = to_le32(in->direct[i]);
+    in->reserved_0 = to_le32(in->reserved_0);
+    in->reserved_1 = to_le32(in->reserved_1);
+    in->reserved_2 = to_le32(in->reserved_2);
+    in->proj_id = to_le32(in->proj_id);
+    in->uid16_gid16 = to_le32(in->uid16_gid16);
+    in->xattr_ptr = to_le64(in->xattr_ptr);
+}
+
+void dirent_to_host(dirent64_t *de) {
+    de->ino = from_le32(de->ino);
+}
+
+void dirent_to_disk(dirent64_t *de) {
+    de->ino = to_le32(de->ino);
+}
+
+void group_desc_to_disk(group_desc_t *gd) {
+    gd->free_blocks = to_le32(gd->free_blocks);
+    gd->free_inodes = to_le32(gd->free_inodes);
+    gd->flags       = to_le32(gd->flags);
+    gd->checksum    = crc32(gd, offsetof(group_desc_t, checksum));
+}
+
+// Convert an extent block to disk order and seal it with its CRC
+void extent_block_finalize(extent_block_t *eb) {
+    uint32_t count = eb->count;
+    for (uint32_t i = 0; i < count; i++) {
+        eb->ext[i].start = to_le32(eb->ext[i].start);
+        eb->ext[i].len = to_le32(eb->ext[i].len);
+    }
+    eb->magic = to_le32(eb->magic);
+    eb->count = to_le32(eb->count);
+    eb->next = to_le32(eb->next);
+    eb->crc = crc32(eb->ext, count * sizeof(extent_t));
+}
+
+// Convert a checksum block to disk order and seal it with its CRC
+void csum_block_finalize(csum_block_t *cb) {
+    uint32_t count = cb->count;
+    for (uint32_t i = 0; i < count; i++) cb->crcs[i] = to_le32(cb->crcs[i]);
+    cb->magic = to_le32(cb->magic);
+    cb->count = to_le32(cb->count);
+    cb->next = to_le32(cb->next);
+    cb->crc = crc32(cb->crcs, count * sizeof(uint32_t));
+}
+
+// Convert a dedup index block to disk order and seal it with its CRC
+void dedup_block_finalize(dedup_block_t *db) {
+    uint32_t count = db->count;
+    for (uint32_t i = 0; i < count; i++) {
+        db->ent[i].hash = to_le64(db->ent[i].hash);
+        db->ent[i].blkno = to_le32(db->ent[i].blkno);
+        db->ent[i].refs = to_le32(db->ent[i].refs);
+    }
+    db->magic = to_le32(db->magic);
+    db->count = to_le32(db->count);
+    db->next = to_le32(db->next);
+    db->crc = crc32(db->ent, count * sizeof(dedup_entry_t));
+}
+
+// Set bit in bitmap
+void set_bit(uint8_t *bitmap, uint64_t bit) {
+    bitmap[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+
+// Clear bit in bitmap
+void clear_bit(uint8_t *bitmap, uint64_t bit) {
+    bitmap[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+}
+
+// Check if bit is set
+int is_bit_set(const uint8_t *bitmap, uint64_t bit) {
+    return (bitmap[bit / 8] & (1u << (bit % 8))) != 0;
+}
+
+// Bit i of the bitmap is bit i of this little-endian word sequence
+static inline uint64_t bitmap_word(const bitmap_t *bm, uint64_t w) {
+    const uint8_t *p = bm->bits + w * 8;
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+           ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+// First bit >= from whose value is `value`, or nbits if there is none
+uint64_t bitmap_scan(const bitmap_t *bm, uint64_t from, int value) {
+    if (from >= bm->nbits) return bm->nbits;
+    uint64_t w = from / 64;
+    uint64_t nwords = (bm->nbits + 63) / 64;
+    uint64_t word = bitmap_word(bm, w);
+    if (!value) word = ~word;
+    word &= ~0ull << (from % 64);
+
+    for (;;) {
+        if (word) {
+            uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(word);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+        if (++w >= nwords) return bm->nbits;
+        word = bitmap_word(bm, w);
+        if (!value) word = ~word;
+    }
+}
+
+// Number of clear bits in [lo, hi)
+uint64_t bitmap_count_free(const bitmap_t *bm, uint64_t lo, uint64_t hi) {
+    uint64_t used = 0;
+    uint64_t bit = lo;
+    while (bit < hi && bit % 64) used += is_bit_set(bm->bits, bit++);
+    for (; bit + 64 <= hi; bit += 64)
+        used += (uint64_t)__builtin_popcountll(bitmap_word(bm, bit / 64));
+    while (bit < hi) used += is_bit_set(bm->bits, bit++);
+    return (hi - lo) - used;
+}
+
+// Allocate up to `want` contiguous bits within [lo, hi), searching from the
+// hint when it falls in the range and then wrapping around. The first run
+// long enough wins; otherwise the longest run seen is taken. Returns the
+// run length (0 when the range is full) and stores its first bit in *start.
+uint64_t bitmap_alloc_run(bitmap_t *bm, uint64_t lo, uint64_t hi, uint64_t want, uint64_t *start) {
+    uint64_t best_start = 0, best_len = 0;
+    uint64_t from = bm->hint >= lo && bm->hint < hi ? bm->hint : lo;
+
+    for (int pass = 0; pass < 2 && best_len < want; pass++) {
+        uint64_t pos = pass == 0 ? from : lo;
+        uint64_t limit = pass == 0 ? hi : from;
+        while (pos < limit) {
+            uint64_t run_start = bitmap_scan(bm, pos, 0);
+            if (run_start >= limit) break;
+            uint64_t run_end = bitmap_scan(bm, run_start, 1);
+            if (run_end > limit) run_end = limit;
+            if (run_end - run_start > best_len) {
+                best_start = run_start;
+                best_len = run_end - run_start;
+                if (best_len >= want) break;
+            }
+            pos = run_end;
+        }
+    }
+
+    if (best_len == 0) return 0;
+    if (best_len > want) best_len = want;
+    for (uint64_t bit = best_start; bit < best_start + best_len; bit++) {
+        set_bit(bm->bits, bit);
+        bm->dirty[bit / BITS_PER_BLOCK] = 1;
+    }
+    bm->nfree -= best_len;
+    bm->hint = best_start + best_len;
+    if (bm->hint >= bm->nbits) bm->hint = 0;
+    *start = best_start;
+    return best_len;
+}
+
+// Allocate a single bit in [lo, hi), -1 when the range is full
+int64_t bitmap_alloc(bitmap_t *bm, uint64_t lo, uint64_t hi) {
+    uint64_t bit;
+    if (bitmap_alloc_run(bm, lo, hi, 1, &bit) == 0) return -1;
+    return (int64_t)bit;
+}
+
+// Release a bit and let the next search start there if it is earlier
+void bitmap_free(bitmap_t *bm, uint64_t bit) {
+    if (!is_bit_set(bm->bits, bit)) return;
+    clear_bit(bm->bits, bit);
+    bm->dirty[bit / BITS_PER_BLOCK] = 1;
+    bm->nfree++;
+    if (bit < bm->hint) bm->hint = bit;
+}
+
+// Slot holding blkno, or the empty slot where it would go
+static cache_entry_t *cache_slot(fs_image_t *fs, uint64_t blkno) {
+    size_t mask = fs->cache_cap - 1;
+    size_t i = (size_t)((blkno * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (fs->cache[i].data && fs->cache[i].blkno != blkno) i = (i + 1) & mask;
+    return &fs->cache[i];
+}
+
+// Cache entry for blkno, creating an empty one (data not yet read) if needed.
+// The table doubles at half load; cached blocks are never evicted. With a
+// mapped image an entry is only a dirty flag over the block's mapped view.
+static cache_entry_t *cache_lookup(fs_image_t *fs, uint64_t blkno, int *created) {
+    *created = 0;
+    if (fs->cache_cap) {
+        cache_entry_t *e = cache_slot(fs, blkno);
+        if (e->data) return e;
+    }
+    if ((fs->cache_count + 1) * 2 > fs->cache_cap) {
+        size_t old_cap = fs->cache_cap;
+        cache_entry_t *old = fs->cache;
+        fs->cache_cap = old_cap ? old_cap * 2 : 64;
+        fs->cache = calloc(fs->cache_cap, sizeof(*fs->cache));
+        if (!fs->cache) {
+            perror("Failed to grow block cache");
+            fs->cache = old;
+            fs->cache_cap = old_cap;
+            return NULL;
+        }
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].data) *cache_slot(fs, old[i].blkno) = old[i];
+        free(old);
+    }
+    cache_entry_t *e = cache_slot(fs, blkno);
+    e->data = fs->map ? fs->map + blkno * BS : malloc(BS);
+    if (!e->data) {
+        perror("Failed to allocate cached block");
+        return NULL;
+    }
+    e->blkno = blkno;
+    e->dirty = 0;
+    fs->cache_count++;
+    *created = 1;
+    return e;
+}
+
+// Queue the read of a block that is not cached yet. It completes at the
+// next blkio_wait(), which must come before the block is used.
+static int cache_prefetch(fs_image_t *fs, uint64_t blkno) {
+    if (blkno >= fs->sb.total_blocks) {
+        fprintf(stderr, "Block %" PRIu64 " is outside the image\n", blkno);
+        return 1;
+    }
+    int created;
+    cache_entry_t *e = cache_lookup(fs, blkno, &created);
+    if (!e) return 1;
+    if (created && !fs->map) blkio_read(&fs->io, e->data, BS, blkno * BS);
+    return 0;
+}
+
+uint8_t *fs_block(fs_image_t *fs, uint64_t blkno) {
+    if (blkno >= fs->sb.total_blocks) {
+        fprintf(stderr, "Block %" PRIu64 " is outside the image\n", blkno);
+        return NULL;
+    }
+    int created;
+    cache_entry_t *e = cache_lookup(fs, blkno, &created);
+    if (!e) return NULL;
+    if (created && !fs->map) {
+        blkio_read(&fs->io, e->data, BS, blkno * BS);
+        if (blkio_wait(&fs->io) != 0) {
+            fprintf(stderr, "Failed to read block %" PRIu64 ": %s\n", blkno, strerror(errno));
+            memset(e->data, 0, BS); // keep the entry usable, the caller fails anyway
+            return NULL;
+        }
+    }
+    return e->data;
+}
+
+uint8_t *fs_block_mut(fs_image_t *fs, uint64_t blkno) {
+    uint8_t *data = fs_block(fs, blkno);
+    if (data) cache_slot(fs, blkno)->dirty = 1;
+    return data;
+}
+
+uint8_t *fs_block_new(fs_image_t *fs, uint64_t blkno) {
+    if (blkno >= fs->sb.total_blocks) {
+        fprintf(stderr, "Block %" PRIu64 " is outside the image\n", blkno);
+        return NULL;
+    }
+    int created;
+    cache_entry_t *e = cache_lookup(fs, blkno, &created);
+    if (!e) return NULL;
+    memset(e->data, 0, BS);
+    e->dirty = 1;
+    return e->data;
+}
+
+// Allocate up to `want` contiguous data blocks (as data bitmap bits),
+// preferring group `goal` and skipping groups whose counters say they are full
+static uint64_t alloc_data_run(fs_image_t *fs, uint64_t goal, uint64_t want, uint64_t *start) {
+    for (uint64_t i = 0; i < fs->sb.group_count; i++) {
+        uint64_t g = (goal + i) % fs->sb.group_count;
+        group_t *grp = &fs->groups[g];
+        if (grp->free_blocks == 0) continue;
+        uint64_t len = bitmap_alloc_run(&fs->data_bm, grp->data_start, grp->data_end, want, start);
+        if (len == 0) continue;
+        grp->free_blocks -= len;
+        fs->group_dirty[g] = 1;
+        return len;
+    }
+    return 0;
+}
+
+// Allocate one data block near group `goal`, returning its block number or 0
+static uint32_t alloc_data_block(fs_image_t *fs, uint64_t goal) {
+    uint64_t bit;
+    if (alloc_data_run(fs, goal, 1, &bit) == 0) return 0;
+    return (uint32_t)(fs->sb.data_region_start + bit);
+}
+
+// Release one data block by block number
+static void free_data_block(fs_image_t *fs, uint32_t blkno) {
+    uint64_t bit = blkno - fs->sb.data_region_start;
+    if (!is_bit_set(fs->data_bm.bits, bit)) return;
+    bitmap_free(&fs->data_bm, bit);
+    uint64_t g = bit / fs->sb.blocks_per_group;
+    fs->groups[g].free_blocks++;
+    fs->group_dirty[g] = 1;
+}
+
+void fs_set_block_used(fs_image_t *fs, uint32_t blkno, int used) {
+    uint64_t bit = blkno - fs->sb.data_region_start;
+    if (!used) {
+        free_data_block(fs, blkno);
+        return;
+    }
+    if (is_bit_set(fs->data_bm.bits, bit)) return;
+    set_bit(fs->data_bm.bits, bit);
+    fs->data_bm.dirty[bit / BITS_PER_BLOCK] = 1;
+    fs->data_bm.nfree--;
+    uint64_t g = bit / fs->sb.blocks_per_group;
+    fs->groups[g].free_blocks--;
+    fs->group_dirty[g] = 1;
+}
+
+void fs_set_inode_used(fs_image_t *fs, uint32_t slot, int used) {
+    uint64_t g = fs_inode_group(fs, slot);
+    if (is_bit_set(fs->inode_bm.bits, slot) == !!used) return;
+    if (used) {
+        set_bit(fs->inode_bm.bits, slot);
+        fs->inode_bm.dirty[slot / BITS_PER_BLOCK] = 1;
+        fs->inode_bm.nfree--;
+        fs->groups[g].free_inodes--;
+    } else {
+        bitmap_free(&fs->inode_bm, slot);
+        fs->groups[g].free_inodes++;
+    }
+    fs->group_dirty[g] = 1;
+}
+
+// Pick the first group from the rolling goal that has a free inode and room
+// for the file's data, so data lands next to its inode. Falls back to any
+// group with a free inode.
+int64_t fs_alloc_inode(fs_image_t *fs, uint64_t blocks_hint) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64_t i = 0; i < fs->sb.group_count; i++) {
+            uint64_t g = (fs->inode_goal + i) % fs->sb.group_count;
+            group_t *grp = &fs->groups[g];
+            if (grp->free_inodes == 0) continue;
+            if (pass == 0 && grp->free_blocks < blocks_hint) continue;
+            int64_t bit = bitmap_alloc(&fs->inode_bm, grp->ino_start, grp->ino_end);
+            if (bit < 0) continue;
+            grp->free_inodes--;
+            fs->group_dirty[g] = 1;
+            fs->inode_goal = g;
+            return bit;
+        }
+    }
+    return -1;
+}
+
+uint64_t fs_inode_group(const fs_image_t *fs, uint64_t slot) {
+    return slot / fs->sb.inodes_per_group;
+}
+
+// Hand back the runs of an allocation that could not be completed
+static void free_runs(fs_image_t *fs, const extent_t *extents, size_t nextents) {
+    for (size_t e = 0; e < nextents; e++)
+        for (uint32_t j = 0; j < extents[e].len; j++) free_data_block(fs, extents[e].start + j);
+}
+
+int fs_alloc_blocks(fs_image_t *fs, uint64_t goal, uint64_t count, extent_t **out, size_t *nout) {
+    if (fs->data_bm.nfree < count) {
+        fprintf(stderr, "Not enough free data blocks\n");
+        return 1;
+    }
+
+    extent_t *extents = NULL;
+    size_t nextents = 0, ext_cap = 0;
+    for (uint64_t done = 0; done < count; ) {
+        uint64_t start;
+        uint64_t len = alloc_data_run(fs, goal, count - done, &start);
+        if (len == 0) {
+            //The counters promised more than the bitmap holds
+            fprintf(stderr, "Not enough free data blocks\n");
+            free_runs(fs, extents, nextents);
+            free(extents);
+            return 1;
+        }
+        uint32_t abs_start = (uint32_t)(fs->sb.data_region_start + start);
+        done += len;
+
+        if (nextents && extents[nextents - 1].start + extents[nextents - 1].len == abs_start) {
+            extents[nextents - 1].len += (uint32_t)len;
+            continue;
+        }
+        if (nextents == ext_cap) {
+            ext_cap = ext_cap ? ext_cap * 2 : 8;
+            extent_t *grown = realloc(extents, ext_cap * sizeof(*grown));
+            if (!grown) {
+                perror("Failed to allocate extent list");
+                free_runs(fs, extents, nextents);
+                free_runs(fs, &(extent_t){ abs_start, (uint32_t)len }, 1);
+                free(extents);
+                return 1;
+            }
+            extents = grown;
+        }
+        extents[nextents].start = abs_start;
+        extents[nextents++].len = (uint32_t)len;
+    }
+
+    *out = extents;
+    *nout = nextents;
+    return 0;
+}
+
+// Extent block `blkno` of a chain, or NULL (with a message) when the block
+// is out of range or not a valid extent block
+static const extent_block_t *load_extent_block(fs_image_t *fs, uint32_t blkno) {
+    if (blkno < fs->sb.data_region_start || blkno >= fs->sb.total_blocks) {
+        fprintf(stderr, "Extent chain points at block %u\n", blkno);
+        return NULL;
+    }
+    const extent_block_t *eb = (const extent_block_t *)fs_block(fs, blkno);
+    if (!eb) return NULL;
+    uint32_t count = from_le32(eb->count);
+    if (from_le32(eb->magic) != EXTENT_MAGIC || count > EXTENT_BLOCK_MAX ||
+        eb->crc != crc32(eb->ext, count * sizeof(extent_t))) {
+        fprintf(stderr, "Corrupt extent block %u\n", blkno);
+        return NULL;
+    }
+    return eb;
+}
+
+int fs_extent_chain(fs_image_t *fs, const inode_t *in, uint32_t *blknos, size_t *n) {
+    *n = 0;
+    if (!(in->reserved_0 & INODE_FL_EXTENTS) || (in->reserved_0 & INODE_FL_INLINE)) return 0;
+    for (uint32_t blkno = in->reserved_2; blkno; ) {
+        if (*n == EXTENT_CHAIN_MAX) {
+            fprintf(stderr, "Extent chain longer than %d blocks\n", EXTENT_CHAIN_MAX);
+            return 1;
+        }
+        const extent_block_t *eb = load_extent_block(fs, blkno);
+        if (!eb) return 1;
+        blknos[(*n)++] = blkno;
+        blkno = from_le32(eb->next);
+    }
+    return 0;
+}
+
+// Release an inode's extent blocks once the commit lands
+static int drop_extent_chain(fs_image_t *fs, const inode_t *in) {
+    uint32_t chain[EXTENT_CHAIN_MAX];
+    size_t n;
+    if (fs_extent_chain(fs, in, chain, &n) != 0) return 1;
+    for (size_t i = 0; i < n; i++)
+        if (fs_defer_free(fs, chain[i], 1) != 0) return 1;
+    return 0;
+}
+
+int fs_load_extents(fs_image_t *fs, const inode_t *in, extent_t **out, size_t *nout) {
+    size_t count = in->reserved_1;
+    extent_t *extents = malloc((count ? count : 1) * sizeof(*extents));
+    if (!extents) {
+        perror("Failed to allocate extent list");
+        return 1;
+    }
+
+    if (!in->reserved_2) {
+        if (count > INODE_EXTENTS) {
+            fprintf(stderr, "Corrupt inode: %zu inline extents\n", count);
+            free(extents);
+            return 1;
+        }
+        memcpy(extents, in->direct, count * sizeof(extent_t));
+    } else {
+        size_t got = 0;
+        uint32_t blkno = in->reserved_2;
+        for (size_t hops = 0; blkno; hops++) {
+            const extent_block_t *eb = hops < EXTENT_CHAIN_MAX ? load_extent_block(fs, blkno) : NULL;
+            size_t n = eb ? from_le32(eb->count) : 0;
+            if (!eb || n > count - got) {
+                if (eb || hops == EXTENT_CHAIN_MAX) fprintf(stderr, "Corrupt extent block %u\n", blkno);
+                free(extents);
+                return 1;
+            }
+            for (size_t i = 0; i < n; i++) {
+                extents[got + i].start = from_le32(eb->ext[i].start);
+                extents[got + i].len = from_le32(eb->ext[i].len);
+            }
+            got += n;
+            blkno = from_le32(eb->next);
+        }
+        if (got != count) {
+            fprintf(stderr, "Extent chain of %zu runs ends after %zu\n", count, got);
+            free(extents);
+            return 1;
+        }
+    }
+
+    *out = extents;
+    *nout = count;
+    return 0;
+}
+
+int fs_inode_map(fs_image_t *fs, const inode_t *in, extent_t **out, size_t *nout) {
+    extent_t *extents = NULL;
+    size_t count = 0;
+    if (in->reserved_0 & INODE_FL_INLINE) {
+        *out = NULL;
+        *nout = 0;
+        return 0;
+    }
+    if (in->reserved_0 & INODE_FL_EXTENTS) {
+        if (fs_load_extents(fs, in, &extents, &count) != 0) return 1;
+    } else {
+        extents = malloc(DIRECT_MAX * sizeof(*extents));
+        if (!extents) {
+            perror("Failed to allocate extent list");
+            return 1;
+        }
+        for (int i = 0; i < DIRECT_MAX && in->direct[i]; i++) extents[count++] = (extent_t){ in->direct[i], 1 };
+    }
+
+    //Physically adjacent runs become one
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n && extents[n - 1].start + extents[n - 1].len == extents[i].start) extents[n - 1].len += extents[i].len;
+        else extents[n++] = extents[i];
+    }
+    *out = extents;
+    *nout = n;
+    return 0;
+}
+
+int fs_defer_free(fs_image_t *fs, uint32_t start, uint32_t len) {
+    if (fs->deferred_count == fs->deferred_cap) {
+        size_t new_cap = fs->deferred_cap ? fs->deferred_cap * 2 : 8;
+        extent_t *grown = realloc(fs->deferred_free, new_cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow free list");
+            return 1;
+        }
+        fs->deferred_free = grown;
+        fs->deferred_cap = new_cap;
+    }
+    fs->deferred_free[fs->deferred_count].start = start;
+    fs->deferred_free[fs->deferred_count++].len = len;
+    return 0;
+}
+
+// Checksum block `blkno` of a chain, or NULL (with a message) when the
+// block is out of range or not a valid checksum block
+static const csum_block_t *load_csum_block(fs_image_t *fs, uint32_t blkno) {
+    if (blkno < fs->sb.data_region_start || blkno >= fs->sb.total_blocks) {
+        fprintf(stderr, "Checksum chain points at block %u\n", blkno);
+        return NULL;
+    }
+    const csum_block_t *cb = (const csum_block_t *)fs_block(fs, blkno);
+    if (!cb) return NULL;
+    uint32_t count = from_le32(cb->count);
+    if (from_le32(cb->magic) != CSUM_MAGIC || count > CSUM_BLOCK_MAX ||
+        cb->crc != crc32(cb->crcs, count * sizeof(uint32_t))) {
+        fprintf(stderr, "Corrupt checksum block %u\n", blkno);
+        return NULL;
+    }
+    return cb;
+}
+
+int fs_load_checksums(fs_image_t *fs, const inode_t *in, uint64_t first, uint64_t count, uint32_t *out) {
+    uint64_t base = 0; // data block the current checksum block starts at
+    uint32_t blkno = (uint32_t)in->xattr_ptr;
+    for (uint64_t hops = 0; base < first + count; hops++) {
+        if (!blkno || hops >= fs->sb.data_region_blocks) {
+            fprintf(stderr, "Checksum chain ends before data block %" PRIu64 "\n", base);
+            return 1;
+        }
+        const csum_block_t *cb = load_csum_block(fs, blkno);
+        if (!cb) return 1;
+        uint64_t n = from_le32(cb->count);
+        uint64_t lo = first > base ? first - base : 0;
+        uint64_t hi = first + count - base < n ? first + count - base : n;
+        for (uint64_t i = lo; i < hi; i++) out[base + i - first] = from_le32(cb->crcs[i]);
+        base += n;
+        blkno = from_le32(cb->next);
+    }
+    return 0;
+}
+
+int fs_drop_checksums(fs_image_t *fs, inode_t *in) {
+    uint32_t blkno = (uint32_t)in->xattr_ptr;
+    for (uint64_t hops = 0; blkno && hops < fs->sb.data_region_blocks; hops++) {
+        //Stop at anything that is not a checksum block rather than free it
+        const csum_block_t *cb = load_csum_block(fs, blkno);
+        if (!cb) break;
+        uint32_t next = from_le32(cb->next);
+        if (fs_defer_free(fs, blkno, 1) != 0) return 1;
+        blkno = next;
+    }
+    in->reserved_0 &= ~INODE_FL_CSUM;
+    in->xattr_ptr = 0;
+    return 0;
+}
+
+int fs_store_checksums(fs_image_t *fs, uint32_t ino, const uint32_t *crcs, uint64_t count) {
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+    if ((in.reserved_0 & INODE_FL_CSUM) && fs_drop_checksums(fs, &in) != 0) return 1;
+
+    uint64_t nblocks = (count + CSUM_BLOCK_MAX - 1) / CSUM_BLOCK_MAX;
+    if (nblocks) {
+        extent_t *runs = NULL;
+        size_t nruns = 0;
+        if (fs_alloc_blocks(fs, fs_inode_group(fs, ino - 1), nblocks, &runs, &nruns) != 0) return 1;
+
+        //Each block names the next, so the chain is laid out in one pass
+        size_t r = 0;
+        uint32_t j = 0;
+        for (uint64_t i = 0; i < nblocks; i++) {
+            uint32_t blkno = runs[r].start + j;
+            if (++j == runs[r].len) {
+                r++;
+                j = 0;
+            }
+            csum_block_t *cb = (csum_block_t *)fs_block_new(fs, blkno);
+            if (!cb) {
+                free(runs);
+                return 1;
+            }
+            uint64_t n = count - i * CSUM_BLOCK_MAX < CSUM_BLOCK_MAX ? count - i * CSUM_BLOCK_MAX : CSUM_BLOCK_MAX;
+            cb->magic = CSUM_MAGIC;
+            cb->count = (uint32_t)n;
+            cb->next = i + 1 < nblocks ? runs[r].start + j : 0;
+            memcpy(cb->crcs, crcs + i * CSUM_BLOCK_MAX, n * sizeof(uint32_t));
+            csum_block_finalize(cb);
+            if (i == 0) in.xattr_ptr = blkno;
+        }
+        free(runs);
+        in.reserved_0 |= INODE_FL_CSUM;
+    }
+    fs->sb.flags |= SB_FEAT_DATA_CSUM;
+    return fs_write_inode(fs, ino - 1, &in);
+}
+
+// 64-bit hash of a block's contents: four multiply-rotate lanes over its
+// words, folded and mixed. Matches are confirmed byte for byte, so it only
+// has to spread blocks well.
+static uint64_t block_hash(const uint8_t *p) {
+    uint64_t h[4] = { 0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x85EBCA77C2B2AE63ull };
+    for (size_t i = 0; i < BS; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, p + i + 8 * l, sizeof(w));
+            h[l] ^= w * 0xC2B2AE3D27D4EB4Full;
+            h[l] = (h[l] << 31 | h[l] >> 33) * 0x9E3779B97F4A7C15ull;
+        }
+    }
+    uint64_t x = h[0] ^ (h[1] << 1 | h[1] >> 63) ^ (h[2] << 7 | h[2] >> 57) ^ (h[3] << 12 | h[3] >> 52);
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    return x ^ (x >> 33);
+}
+
+static size_t dedup_slot_of(uint64_t key, size_t cap) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 17) & (cap - 1);
+}
+
+// Rebuild both lookup tables for at least `want` entries, leaving out the
+// dropped ones
+static int dedup_rehash(fs_image_t *fs, size_t want) {
+    size_t cap = 64;
+    while (cap * DIR_LOAD_NUM / DIR_LOAD_DEN < want) cap *= 2;
+    uint32_t *by_hash = calloc(cap, sizeof(*by_hash)), *by_blk = calloc(cap, sizeof(*by_blk));
+    dedup_entry_t *ent = malloc(cap * sizeof(*ent));
+    if (!by_hash || !by_blk || !ent) {
+        perror("Failed to allocate dedup index");
+        free(by_hash);
+        free(by_blk);
+        free(ent);
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < fs->dedup_count; i++) {
+        if (!fs->dedup[i].refs) continue;
+        ent[n] = fs->dedup[i];
+        size_t h = dedup_slot_of(ent[n].hash, cap), b = dedup_slot_of(ent[n].blkno, cap);
+        while (by_hash[h]) h = (h + 1) & (cap - 1);
+        while (by_blk[b]) b = (b + 1) & (cap - 1);
+        by_hash[h] = by_blk[b] = (uint32_t)++n;
+    }
+    free(fs->dedup);
+    free(fs->dedup_by_hash);
+    free(fs->dedup_by_blk);
+    fs->dedup = ent;
+    fs->dedup_by_hash = by_hash;
+    fs->dedup_by_blk = by_blk;
+    fs->dedup_cap = cap;
+    fs->dedup_count = fs->dedup_live = n;
+    return 0;
+}
+
+// Index a block with one reference
+static int dedup_add(fs_image_t *fs, uint64_t hash, uint32_t blkno) {
+    if ((fs->dedup_count + 1) > fs->dedup_cap * DIR_LOAD_NUM / DIR_LOAD_DEN &&
+        dedup_rehash(fs, (fs->dedup_live + 1) * 2) != 0) return 1;
+    size_t n = fs->dedup_count++;
+    fs->dedup[n] = (dedup_entry_t){ hash, blkno, 1 };
+    size_t h = dedup_slot_of(hash, fs->dedup_cap), b = dedup_slot_of(blkno, fs->dedup_cap);
+    while (fs->dedup_by_hash[h]) h = (h + 1) & (fs->dedup_cap - 1);
+    while (fs->dedup_by_blk[b]) b = (b + 1) & (fs->dedup_cap - 1);
+    fs->dedup_by_hash[h] = fs->dedup_by_blk[b] = (uint32_t)(n + 1);
+    fs->dedup_live++;
+    fs->dedup_dirty = 1;
+    return 0;
+}
+
+// Live entry for blkno, or NULL
+static dedup_entry_t *dedup_find_block(fs_image_t *fs, uint32_t blkno) {
+    for (size_t b = dedup_slot_of(blkno, fs->dedup_cap); fs->dedup_by_blk[b]; b = (b + 1) & (fs->dedup_cap - 1)) {
+        dedup_entry_t *e = &fs->dedup[fs->dedup_by_blk[b] - 1];
+        if (e->blkno == blkno && e->refs) return e;
+    }
+    return NULL;
+}
+
+int fs_dedup_load(fs_image_t *fs) {
+    if (fs->dedup_loaded) return 0;
+    uint64_t total = (fs->sb.flags & SB_FEAT_DEDUP) ? fs->sb.dedup_entries : 0;
+    size_t max_chain = (size_t)((total + DEDUP_BLOCK_MAX - 1) / DEDUP_BLOCK_MAX);
+    fs->dedup_count = fs->dedup_live = fs->dedup_nchain = 0;
+    fs->dedup = malloc((total ? total : 1) * sizeof(*fs->dedup));
+    fs->dedup_chain = malloc((max_chain ? max_chain : 1) * sizeof(*fs->dedup_chain));
+    if (!fs->dedup || !fs->dedup_chain) {
+        perror("Failed to allocate dedup index");
+        goto fail;
+    }
+
+    uint32_t blkno = total ? (uint32_t)fs->sb.dedup_index : 0;
+    while (blkno) {
+        if (blkno < fs->sb.data_region_start || blkno >= fs->sb.total_blocks || fs->dedup_nchain == max_chain) {
+            fprintf(stderr, "Dedup index chain points at block %u\n", blkno);
+            goto fail;
+        }
+        const dedup_block_t *db = (const dedup_block_t *)fs_block(fs, blkno);
+        if (!db) goto fail;
+        uint32_t count = from_le32(db->count);
+        if (from_le32(db->magic) != DEDUP_MAGIC || count > DEDUP_BLOCK_MAX || count > total - fs->dedup_count ||
+            db->crc != crc32(db->ent, count * sizeof(dedup_entry_t))) {
+            fprintf(stderr, "Corrupt dedup index block %u\n", blkno);
+            goto fail;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            dedup_entry_t *e = &fs->dedup[fs->dedup_count++];
+            e->hash = from_le64(db->ent[i].hash);
+            e->blkno = from_le32(db->ent[i].blkno);
+            e->refs = from_le32(db->ent[i].refs);
+        }
+        fs->dedup_chain[fs->dedup_nchain++] = blkno;
+        blkno = from_le32(db->next);
+    }
+    if (fs->dedup_count != total) {
+        fprintf(stderr, "Dedup index holds %zu of its %" PRIu64 " entries\n", fs->dedup_count, total);
+        goto fail;
+    }
+    if (dedup_rehash(fs, fs->dedup_count) != 0) goto fail;
+    fs->dedup_loaded = 1;
+    return 0;
+
+fail:
+    //Nothing is kept, so a later call starts again from scratch
+    free(fs->dedup);
+    free(fs->dedup_chain);
+    fs->dedup = NULL;
+    fs->dedup_chain = NULL;
+    fs->dedup_count = fs->dedup_live = fs->dedup_nchain = 0;
+    return 1;
+}
+
+int fs_dedup_set_refs(fs_image_t *fs, uint32_t blkno, uint32_t refs) {
+    if (fs_dedup_load(fs) != 0) return 1;
+    dedup_entry_t *e = dedup_find_block(fs, blkno);
+    if (!e) return 1;
+    e->refs = refs;
+    if (!refs) fs->dedup_live--;
+    fs->dedup_dirty = 1;
+    return 0;
+}
+
+// Write a changed index back as a chain, reusing the blocks it came from
+static int dedup_flush(fs_image_t *fs) {
+    if (!fs->dedup_loaded || !fs->dedup_dirty) return 0;
+    size_t nblocks = (fs->dedup_live + DEDUP_BLOCK_MAX - 1) / DEDUP_BLOCK_MAX;
+    uint32_t *chain = malloc((nblocks ? nblocks : 1) * sizeof(*chain));
+    if (!chain) {
+        perror("Failed to allocate dedup index");
+        return 1;
+    }
+    for (size_t i = 0; i < nblocks; i++) {
+        chain[i] = i < fs->dedup_nchain ? fs->dedup_chain[i] : alloc_data_block(fs, 0);
+        if (!chain[i]) {
+            fprintf(stderr, "Not enough free data blocks\n");
+            free(chain);
+            return 1;
+        }
+    }
+    for (size_t i = nblocks; i < fs->dedup_nchain; i++)
+        if (fs_defer_free(fs, fs->dedup_chain[i], 1) != 0) {
+            free(chain);
+            return 1;
+        }
+
+    size_t e = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+        dedup_block_t *db = (dedup_block_t *)fs_block_new(fs, chain[i]);
+        if (!db) {
+            free(chain);
+            return 1;
+        }
+        db->magic = DEDUP_MAGIC;
+        db->next = i + 1 < nblocks ? chain[i + 1] : 0;
+        for (db->count = 0; db->count < DEDUP_BLOCK_MAX && e < fs->dedup_count; e++)
+            if (fs->dedup[e].refs) db->ent[db->count++] = fs->dedup[e];
+        dedup_block_finalize(db);
+    }
+    free(fs->dedup_chain);
+    fs->dedup_chain = chain;
+    fs->dedup_nchain = nblocks;
+    fs->sb.dedup_index = nblocks ? chain[0] : 0;
+    fs->sb.dedup_entries = fs->dedup_live;
+    fs->sb.flags |= SB_FEAT_DEDUP;
+    fs->dedup_dirty = 0;
+    return 0;
+}
+
+// 32-bit FNV-1a of a directory entry name
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Look a name up in a hashed directory of nblocks buckets. Returns the live
+// entry and sets *found, or returns the slot an insert should use (NULL
+// when every bucket is full).
+static dirent64_t *hashed_probe(uint8_t *dir, uint32_t nblocks, const char *name, int *found) {
+    uint32_t h = name_hash(name);
+    dirent64_t *free_slot = NULL;
+    *found = 0;
+
+    for (uint32_t i = 0; i < nblocks; i++) {
+        dirent64_t *e = (dirent64_t *)(dir + (size_t)((h + i) & (nblocks - 1)) * BS);
+        int saw_unused = 0;
+        for (size_t k = 0; k < DIRENTS_PER_BLOCK; k++) {
+            if (e[k].ino != 0) {
+                if (strcmp(e[k].name, name) == 0) {
+                    *found = 1;
+                    return &e[k];
+                }
+            } else {
+                if (!free_slot) free_slot = &e[k];
+                if (e[k].name[0] == '\0') saw_unused = 1;
+            }
+        }
+        if (saw_unused) break;
+    }
+    return free_slot;
+}
+
+// Find a name in a directory, or the slot where it would go
+static dirent64_t *dir_probe(fs_dir_t *d, const char *name, int *found) {
+    if (d->inode.reserved_0 & INODE_FL_HASHED)
+        return hashed_probe(d->ents, d->nblocks, name, found);
+
+    //Linear single-block directory
+    dirent64_t *entries = (dirent64_t *)d->ents;
+    dirent64_t *free_slot = NULL;
+    *found = 0;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].ino != 0 && strcmp(entries[i].name, name) == 0) {
+            *found = 1;
+            return &entries[i];
+        }
+        if (entries[i].ino == 0 && !free_slot) free_slot = &entries[i];
+    }
+    return free_slot;
+}
+
+// Hash buckets a directory of `live` entries needs to stay under the load limit
+static uint32_t dir_buckets(uint64_t live) {
+    uint32_t nblocks = 2;
+    while ((uint64_t)nblocks * DIRENTS_PER_BLOCK * DIR_LOAD_NUM < live * DIR_LOAD_DEN) nblocks *= 2;
+    return nblocks;
+}
+
+// Rebuild a directory as a hashed directory of nblocks buckets
+static int dir_rebuild(fs_image_t *fs, fs_dir_t *d, uint32_t nblocks) {
+    uint64_t goal = fs_inode_group(fs, d->ino - 1);
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    if (fs_alloc_blocks(fs, goal, nblocks, &extents, &nextents) != 0) return 1;
+
+    uint8_t *ents = calloc(nblocks, BS);
+    uint32_t *blknos = malloc(nblocks * sizeof(uint32_t));
+    uint8_t *dirty = malloc(nblocks);
+    if (!ents || !blknos || !dirty) {
+        perror("Failed to allocate directory");
+        goto fail;
+    }
+    memset(dirty, 1, nblocks);
+    uint32_t b = 0;
+    for (size_t e = 0; e < nextents; e++)
+        for (uint32_t j = 0; j < extents[e].len; j++)
+            blknos[b++] = extents[e].start + j;
+
+    //The new map gets its own extent block; the old one goes with the old buckets
+    inode_t in = d->inode;
+    in.reserved_0 |= INODE_FL_EXTENTS | INODE_FL_HASHED;
+    in.reserved_2 = 0;
+    if (fs_set_extents(fs, &in, extents, nextents, goal) != 0) goto fail;
+
+    //"." and ".." keep their slots, everything else is rehashed
+    dirent64_t *old = (dirent64_t *)d->ents;
+    memcpy(ents, old, 2 * sizeof(dirent64_t));
+    for (size_t i = 2; i < (size_t)d->nblocks * DIRENTS_PER_BLOCK; i++) {
+        if (old[i].ino == 0) continue;
+        int found;
+        dirent64_t *slot = hashed_probe(ents, nblocks, old[i].name, &found);
+        *slot = old[i];
+    }
+
+    //Old blocks stay allocated until the new directory is committed
+    if (d->inode.reserved_0 & INODE_FL_HASHED) {
+        for (uint32_t i = 0; i < d->nblocks; i++)
+            if (fs_defer_free(fs, d->blknos[i], 1) != 0) goto fail;
+        if (drop_extent_chain(fs, &d->inode) != 0) goto fail;
+    } else if (fs_defer_free(fs, d->blknos[0], 1) != 0) {
+        goto fail;
+    }
+
+    free(d->ents);
+    free(d->blknos);
+    free(d->dirty);
+    d->ents = ents;
+    d->blknos = blknos;
+    d->dirty = dirty;
+    d->nblocks = nblocks;
+    d->inode = in;
+    d->inode_dirty = 1;
+    fs->sb.flags |= SB_FEAT_DIR_INDEX;
+    free(extents);
+    return 0;
+
+fail:
+    free(ents); free(blknos); free(dirty); free(extents);
+    return 1;
+}
+
+// Make sure one more entry fits in a directory, converting a full linear
+// directory to a hashed one and doubling hashed ones as they fill
+static int dir_reserve(fs_image_t *fs, fs_dir_t *d) {
+    uint64_t want = d->live + 1;
+
+    if (!(d->inode.reserved_0 & INODE_FL_HASHED)) {
+        int found;
+        if (dir_probe(d, "", &found)) return 0;
+        return dir_rebuild(fs, d, dir_buckets(want));
+    }
+
+    if ((uint64_t)d->nblocks * DIRENTS_PER_BLOCK * DIR_LOAD_NUM < want * DIR_LOAD_DEN)
+        return dir_rebuild(fs, d, d->nblocks * 2);
+    return 0;
+}
+
+uint32_t fs_dir_blocks(uint64_t entries) {
+    return entries + 2 <= DIRENTS_PER_BLOCK ? 1 : dir_buckets(entries + 2);
+}
+
+int fs_dir_grow(fs_image_t *fs, fs_dir_t *d, uint64_t entries) {
+    uint64_t live = entries + 2 > d->live ? entries + 2 : d->live;
+    if (!(d->inode.reserved_0 & INODE_FL_HASHED) && live <= DIRENTS_PER_BLOCK) return 0;
+    uint32_t nblocks = dir_buckets(live);
+    if ((d->inode.reserved_0 & INODE_FL_HASHED) && d->nblocks >= nblocks) return 0;
+    return dir_rebuild(fs, d, nblocks);
+}
+
+// Queue the read of a bitmap spanning `blocks` blocks, of which the first nbits bits are valid
+static int load_bitmap(fs_image_t *fs, bitmap_t *bm, uint64_t start, uint64_t blocks, uint64_t nbits, const char *what) {
+    if (blocks == 0 || nbits > blocks * BITS_PER_BLOCK) {
+        fprintf(stderr, "Corrupt superblock: %" PRIu64 " bits do not fit the %" PRIu64 "-block %s\n", nbits, blocks, what);
+        return 1;
+    }
+    if (start + blocks > fs->sb.total_blocks) {
+        fprintf(stderr, "Corrupt superblock: %s lies outside the image\n", what);
+        return 1;
+    }
+    bm->bits = fs->map ? fs->map + start * BS : malloc(blocks * BS);
+    bm->dirty = calloc(blocks, 1);
+    if (!bm->bits || !bm->dirty) {
+        fprintf(stderr, "Failed to allocate %s\n", what);
+        return 1;
+    }
+    //Completed together with the group descriptors in load_groups()
+    if (!fs->map) blkio_read(&fs->io, bm->bits, blocks * BS, start * BS);
+    bm->nbits = nbits;
+    bm->nblocks = blocks;
+    bm->hint = 0;
+    return 0;
+}
+
+// Set up block groups. With SB_FEAT_GROUPS the free counters come straight
+// from the descriptor table (a descriptor with a bad checksum is recounted
+// from its bitmap ranges); older images are grouped in memory and counted.
+static int load_groups(fs_image_t *fs) {
+    superblock_t *sb = &fs->sb;
+    int on_disk = (sb->flags & SB_FEAT_GROUPS) != 0;
+
+    if (!on_disk) {
+        sb->blocks_per_group = BITS_PER_BLOCK;
+        sb->group_count = (sb->data_region_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        sb->inodes_per_group = (sb->inode_count + sb->group_count - 1) / sb->group_count;
+    }
+    if (sb->blocks_per_group == 0 || sb->inodes_per_group == 0 || sb->group_count == 0 ||
+        sb->group_count != (sb->data_region_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+        sb->group_count * sb->inodes_per_group < sb->inode_count ||
+        (on_disk && sb->group_desc_blocks * GROUP_DESCS_PER_BLOCK < sb->group_count)) {
+        fprintf(stderr, "Corrupt superblock: inconsistent block group geometry\n");
+        return 1;
+    }
+
+    fs->groups = calloc(sb->group_count, sizeof(*fs->groups));
+    fs->group_dirty = calloc(sb->group_count, 1);
+    if (!fs->groups || !fs->group_dirty) {
+        perror("Failed to allocate block groups");
+        return 1;
+    }
+    if (on_disk && sb->group_desc_start + sb->group_desc_blocks > sb->total_blocks) {
+        fprintf(stderr, "Corrupt superblock: group descriptors lie outside the image\n");
+        return 1;
+    }
+    if (on_disk && fs->map) {
+        fs->gdt = fs->map + sb->group_desc_start * BS;
+    } else if (on_disk) {
+        fs->gdt = malloc(sb->group_desc_blocks * BS);
+        if (!fs->gdt) {
+            perror("Failed to allocate group descriptors");
+            return 1;
+        }
+        blkio_read(&fs->io, fs->gdt, sb->group_desc_blocks * BS, sb->group_desc_start * BS);
+    }
+    if (blkio_wait(&fs->io) != 0) {
+        perror("Failed to read bitmaps and group descriptors");
+        return 1;
+    }
+
+    fs->data_bm.nfree = 0;
+    fs->inode_bm.nfree = 0;
+    for (uint64_t g = 0; g < sb->group_count; g++) {
+        group_t *grp = &fs->groups[g];
+        grp->data_start = g * sb->blocks_per_group;
+        grp->data_end = grp->data_start + sb->blocks_per_group;
+        if (grp->data_end > sb->data_region_blocks) grp->data_end = sb->data_region_blocks;
+        grp->ino_start = g * sb->inodes_per_group;
+        grp->ino_end = grp->ino_start + sb->inodes_per_group;
+        if (grp->ino_start > sb->inode_count) grp->ino_start = sb->inode_count;
+        if (grp->ino_end > sb->inode_count) grp->ino_end = sb->inode_count;
+
+        int counted = 0;
+        if (on_disk) {
+            group_desc_t *gd = (group_desc_t *)fs->gdt + g;
+            if (gd->checksum == crc32(gd, offsetof(group_desc_t, checksum))) {
+                grp->free_blocks = from_le32(gd->free_blocks);
+                grp->free_inodes = from_le32(gd->free_inodes);
+                counted = 1;
+            } else {
+                fprintf(stderr, "Warning: group %" PRIu64 " descriptor checksum mismatch, recounting\n", g);
+                fs->group_dirty[g] = 1;
+            }
+        }
+        if (!counted) {
+            grp->free_blocks = bitmap_count_free(&fs->data_bm, grp->data_start, grp->data_end);
+            grp->free_inodes = bitmap_count_free(&fs->inode_bm, grp->ino_start, grp->ino_end);
+        }
+        fs->data_bm.nfree += grp->free_blocks;
+        fs->inode_bm.nfree += grp->free_inodes;
+    }
+
+    //The superblock totals must agree with the groups; a stale pair is
+    //reported and rewritten from the group counts on commit
+    if ((sb->flags & SB_FEAT_FREE_COUNTS) &&
+        (sb->free_blocks != fs->data_bm.nfree || sb->free_inodes != fs->inode_bm.nfree)) {
+        fprintf(stderr, "Warning: superblock free counts (%" PRIu64 " blocks, %" PRIu64 " inodes) "
+                "do not match the groups (%" PRIu64 ", %" PRIu64 "), correcting\n",
+                sb->free_blocks, sb->free_inodes, fs->data_bm.nfree, fs->inode_bm.nfree);
+    }
+    return 0;
+}
+
+int fs_read_inode(fs_image_t *fs, uint32_t slot, inode_t *out) {
+    if (slot >= fs->sb.inode_count) {
+        fprintf(stderr, "Inode %u is outside the inode table\n", slot + 1);
+        return 1;
+    }
+    uint8_t *blk = fs_block(fs, fs->sb.inode_table_start + (uint64_t)slot * INODE_SIZE / BS);
+    if (!blk) return 1;
+    memcpy(out, blk + (uint64_t)slot * INODE_SIZE % BS, sizeof(*out));
+    inode_to_host(out);
+    return 0;
+}
+
+int fs_write_inode(fs_image_t *fs, uint32_t slot, const inode_t *in) {
+    if (slot >= fs->sb.inode_count) {
+        fprintf(stderr, "Inode %u is outside the inode table\n", slot + 1);
+        return 1;
+    }
+    uint8_t *blk = fs_block_mut(fs, fs->sb.inode_table_start + (uint64_t)slot * INODE_SIZE / BS);
+    if (!blk) return 1;
+
+    inode_t disk = *in;
+    inode_to_disk(&disk);
+    inode_crc_finalize(&disk);
+    memcpy(blk + (uint64_t)slot * INODE_SIZE % BS, &disk, sizeof(disk));
+    return 0;
+}
+
+// Read a directory's blocks: one block, or every bucket when hashed
+static int load_dir(fs_image_t *fs, fs_dir_t *d) {
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    if (d->inode.reserved_0 & INODE_FL_HASHED) {
+        if (fs_load_extents(fs, &d->inode, &extents, &nextents) != 0) return 1;
+        d->nblocks = 0;
+        for (size_t e = 0; e < nextents; e++) d->nblocks += extents[e].len;
+        //Lookups mask the name hash with the bucket count
+        if (d->nblocks == 0 || (d->nblocks & (d->nblocks - 1))) {
+            fprintf(stderr, "Corrupt directory inode %u: %u buckets\n", d->ino, d->nblocks);
+            free(extents);
+            return 1;
+        }
+    } else {
+        d->nblocks = 1;
+    }
+
+    d->ents = malloc((size_t)d->nblocks * BS);
+    d->blknos = malloc(d->nblocks * sizeof(uint32_t));
+    d->dirty = calloc(d->nblocks, 1);
+    if (!d->ents || !d->blknos || !d->dirty) {
+        perror("Failed to allocate directory");
+        free(extents);
+        return 1;
+    }
+    if (extents) {
+        uint32_t b = 0;
+        for (size_t e = 0; e < nextents; e++)
+            for (uint32_t j = 0; j < extents[e].len; j++)
+                d->blknos[b++] = extents[e].start + j;
+        free(extents);
+    } else {
+        d->blknos[0] = d->inode.direct[0];
+    }
+
+    //One batch for all buckets, then copy them out of the cache. Entries
+    //are kept in host order, so even a mapped image copies these.
+    for (uint32_t b = 0; b < d->nblocks; b++)
+        if (cache_prefetch(fs, d->blknos[b]) != 0) return 1;
+    if (blkio_wait(&fs->io) != 0) {
+        perror("Failed to read directory");
+        return 1;
+    }
+    for (uint32_t b = 0; b < d->nblocks; b++) {
+        const uint8_t *blk = fs_block(fs, d->blknos[b]);
+        if (!blk) return 1;
+        memcpy(d->ents + (size_t)b * BS, blk, BS);
+    }
+    dirent64_t *entries = (dirent64_t *)d->ents;
+    for (size_t i = 0; i < (size_t)d->nblocks * DIRENTS_PER_BLOCK; i++) {
+        dirent_to_host(&entries[i]);
+        if (entries[i].ino != 0) d->live++;
+    }
+    return 0;
+}
+
+static void dir_release(fs_dir_t *d) {
+    free(d->ents);
+    free(d->blknos);
+    free(d->dirty);
+}
+
+static size_t dir_slot_of(uint32_t ino, size_t cap) {
+    return (size_t)(((uint64_t)ino * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+// Add a loaded directory to the table, doubling it at 3/4 load
+static int dirs_insert(fs_image_t *fs, fs_dir_t *d) {
+    if ((fs->ndirs + 1) * 4 > fs->dirs_cap * 3) {
+        size_t cap = fs->dirs_cap ? fs->dirs_cap * 2 : 16;
+        fs_dir_t **table = calloc(cap, sizeof(*table));
+        if (!table) {
+            perror("Failed to grow directory table");
+            return 1;
+        }
+        for (size_t i = 0; i < fs->dirs_cap; i++) {
+            if (!fs->dirs[i]) continue;
+            size_t k = dir_slot_of(fs->dirs[i]->ino, cap);
+            while (table[k]) k = (k + 1) & (cap - 1);
+            table[k] = fs->dirs[i];
+        }
+        free(fs->dirs);
+        fs->dirs = table;
+        fs->dirs_cap = cap;
+    }
+    size_t k = dir_slot_of(d->ino, fs->dirs_cap);
+    while (fs->dirs[k]) k = (k + 1) & (fs->dirs_cap - 1);
+    fs->dirs[k] = d;
+    fs->ndirs++;
+    return 0;
+}
+
+fs_dir_t *fs_dir(fs_image_t *fs, uint32_t ino) {
+    if (ino == ROOT_INO) return &fs->root;
+    for (size_t k = fs->dirs_cap ? dir_slot_of(ino, fs->dirs_cap) : 0; fs->dirs_cap && fs->dirs[k];
+         k = (k + 1) & (fs->dirs_cap - 1))
+        if (fs->dirs[k]->ino == ino) return fs->dirs[k];
+
+    if (ino == 0 || ino > fs->sb.inode_count) {
+        fprintf(stderr, "Inode %u is outside the inode table\n", ino);
+        return NULL;
+    }
+    fs_dir_t *d = calloc(1, sizeof(*d));
+    if (!d) {
+        perror("Failed to allocate directory");
+        return NULL;
+    }
+    d->ino = ino;
+    if (fs_read_inode(fs, ino - 1, &d->inode) != 0) goto fail;
+    if ((d->inode.mode & 0170000) != 0040000) {
+        fprintf(stderr, "Inode %u is not a directory\n", ino);
+        goto fail;
+    }
+    if (load_dir(fs, d) != 0 || dirs_insert(fs, d) != 0) goto fail;
+    return d;
+
+fail:
+    dir_release(d);
+    free(d);
+    return NULL;
+}
+
+// Copy the next component of *path into name and step past it. Empty and
+// "." components are skipped. 0 at the end of the path, -1 for ".." or a
+// component longer than NAME_MAX_LEN, with *path left on it for
+// path_report(); callers that only look a path up stay quiet.
+static int path_next(const char **path, char *name) {
+    const char *p = *path;
+    for (;;) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0) {
+            *path = p;
+            return 0;
+        }
+        if (len == 1 && p[0] == '.') {
+            p++;
+            continue;
+        }
+        if ((len == 2 && p[0] == '.' && p[1] == '.') || len > NAME_MAX_LEN) {
+            *path = p;
+            return -1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        *path = p + len;
+        return 1;
+    }
+}
+
+// Report the component path_next() refused
+static void path_report(const char *p) {
+    size_t len = strcspn(p, "/");
+    if (len == 2 && p[0] == '.' && p[1] == '.')
+        fprintf(stderr, "Error: '..' is not allowed in image paths\n");
+    else
+        fprintf(stderr, "Error: Filename '%.*s' too long (max %u characters)\n", (int)len, p, NAME_MAX_LEN);
+}
+
+// Whether nothing but separators and "." components is left of a path
+static int path_end(const char *p) {
+    for (;;) {
+        while (*p == '/') p++;
+        if (p[0] != '.' || (p[1] != '/' && p[1] != '\0')) return *p == '\0';
+        p++;
+    }
+}
+
+// Directory that holds the last component of path, which is copied to
+// leaf. NULL, reported, when a parent is missing or not a directory.
+static fs_dir_t *path_parent(fs_image_t *fs, const char *path, char *leaf) {
+    char name[NAME_MAX_LEN + 1];
+    const char *p = path;
+    int rc = path_next(&p, leaf);
+    if (rc == 0) fprintf(stderr, "Error: Empty file name\n");
+    if (rc < 0) path_report(p);
+    if (rc <= 0) return NULL;
+
+    fs_dir_t *d = &fs->root;
+    while ((rc = path_next(&p, name)) > 0) {
+        int found;
+        dirent64_t *e = dir_probe(d, leaf, &found);
+        if (!found) {
+            fprintf(stderr, "Error: No directory '%s' on the way to '%s'\n", leaf, path);
+            return NULL;
+        }
+        if (e->type != DIRENT_DIR) {
+            fprintf(stderr, "Error: '%s' on the way to '%s' is not a directory\n", leaf, path);
+            return NULL;
+        }
+        if (!(d = fs_dir(fs, e->ino))) return NULL;
+        strcpy(leaf, name);
+    }
+    if (rc < 0) path_report(p);
+    return rc < 0 ? NULL : d;
+}
+
+// Map the whole image twice: a private copy-on-write view the handle works
+// on, so nothing reaches the file before fs_commit(), and a shared view that
+// commits copy finished blocks into and msync.
+static int map_image(fs_image_t *fs) {
+    struct stat st;
+    if (fstat(fileno(fs->img), &st) != 0) {
+        perror("Failed to stat image");
+        return 1;
+    }
+    if ((uint64_t)st.st_size < fs->sb.total_blocks * BS) {
+        fprintf(stderr, "Image is shorter than its %" PRIu64 " blocks\n", fs->sb.total_blocks);
+        return 1;
+    }
+    fs->map_len = fs->sb.total_blocks * BS;
+    void *priv = mmap(NULL, fs->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fs->img), 0);
+    if (priv == MAP_FAILED) {
+        perror("Failed to map image");
+        return 1;
+    }
+    fs->map = priv;
+    if (fs->read_only) return 0;
+    void *shared = mmap(NULL, fs->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fs->img), 0);
+    if (shared == MAP_FAILED) {
+        perror("Failed to map image");
+        return 1;
+    }
+    fs->map_shared = shared;
+    return 0;
+}
+
+// Load superblock, bitmaps, group counters, root inode and root directory.
+// Inode table and extent blocks are read through the cache on first use.
+int fs_open(fs_image_t *fs, const char *path, unsigned flags) {
+    memset(fs, 0, sizeof(*fs));
+    fs->read_only = (flags & FS_OPEN_RDONLY) != 0;
+    fs->img = fopen(path, fs->read_only ? "rb" : "rb+");
+    if (!fs->img) {
+        perror("Failed to open image");
+        return 1;
+    }
+
+    blkio_init(&fs->io, fileno(fs->img), (flags & FS_OPEN_PSYNC) ? BLKIO_PSYNC : BLKIO_AUTO);
+
+    blkio_read(&fs->io, &fs->sb, sizeof(fs->sb), 0);
+    if (blkio_wait(&fs->io) != 0) {
+        perror("Failed to read superblock");
+        return 1;
+    }
+    superblock_to_host(&fs->sb);
+
+    //Verify magic number
+    if (fs->sb.magic != SB_MAGIC) {
+        fprintf(stderr, "Invalid filesystem magic number\n");
+        return 1;
+    }
+
+    if ((flags & FS_OPEN_MMAP) && map_image(fs) != 0) return 1;
+
+    if (load_bitmap(fs, &fs->inode_bm, fs->sb.inode_bitmap_start, fs->sb.inode_bitmap_blocks,
+                    fs->sb.inode_count, "inode bitmap") != 0) return 1;
+    if (load_bitmap(fs, &fs->data_bm, fs->sb.data_bitmap_start, fs->sb.data_bitmap_blocks,
+                    fs->sb.data_region_blocks, "data bitmap") != 0) return 1;
+    //Root inode lives in the first inode table slot; its block joins the batch
+    if (cache_prefetch(fs, fs->sb.inode_table_start) != 0) return 1;
+    if (load_groups(fs) != 0) return 1;
+
+    fs->root.ino = ROOT_INO;
+    if (fs_read_inode(fs, 0, &fs->root.inode) != 0) return 1;
+    return load_dir(fs, &fs->root);
+}
+
+void fs_close(fs_image_t *fs) {
+    if (fs->img) {
+        blkio_exit(&fs->io);
+        fclose(fs->img);
+    }
+    if (fs->map) {
+        munmap(fs->map, fs->map_len);
+    } else {
+        for (size_t i = 0; i < fs->cache_cap; i++) free(fs->cache[i].data);
+        free(fs->inode_bm.bits);
+        free(fs->data_bm.bits);
+        free(fs->gdt);
+    }
+    if (fs->map_shared) munmap(fs->map_shared, fs->map_len);
+    free(fs->cache);
+    free(fs->inode_bm.dirty);
+    free(fs->data_bm.dirty);
+    free(fs->groups);
+    free(fs->group_dirty);
+    dir_release(&fs->root);
+    for (size_t i = 0; i < fs->dirs_cap; i++) {
+        if (!fs->dirs[i]) continue;
+        dir_release(fs->dirs[i]);
+        free(fs->dirs[i]);
+    }
+    free(fs->dirs);
+    free(fs->deferred_free);
+    free(fs->dedup);
+    free(fs->dedup_by_hash);
+    free(fs->dedup_by_blk);
+    free(fs->dedup_chain);
+    memset(fs, 0, sizeof(*fs));
+}
+
+uint32_t fs_lookup(fs_image_t *fs, const char *path) {
+    char name[NAME_MAX_LEN + 1];
+    fs_dir_t *d = &fs->root;
+    uint32_t ino = ROOT_INO;
+    int rc;
+    while ((rc = path_next(&path, name)) > 0) {
+        //Only the last component may be something other than a directory
+        if (!d || !(d = fs_dir(fs, ino))) return 0;
+        int found;
+        dirent64_t *e = dir_probe(d, name, &found);
+        if (!found) return 0;
+        ino = e->ino;
+        if (e->type != DIRENT_DIR) d = NULL;
+    }
+    return rc < 0 ? 0 : ino;
+}
+
+int64_t fs_dir_slot(fs_dir_t *d, const char *name) {
+    int found;
+    dirent64_t *e = dir_probe(d, name, &found);
+    return found ? (int64_t)(e - (dirent64_t *)d->ents) : -1;
+}
+
+// Zero `len` bytes of the image at `off`. The filesystem zeroes the range
+// itself where it can; only otherwise is a zero buffer written.
+static int zero_fill(int fd, uint64_t off, uint64_t len) {
+    if (len == 0) return 0;
+#ifdef __linux__
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0) return 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) == 0) return 0;
+#endif
+    static const uint8_t zeros[BS];
+    while (len > 0) {
+        size_t n = len < BS ? (size_t)len : BS;
+        ssize_t w = pwrite(fd, zeros, n, (off_t)off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to zero file tail");
+            return 1;
+        }
+        off += (uint64_t)w;
+        len -= (uint64_t)w;
+    }
+    return 0;
+}
+
+// In-kernel copy of up to len bytes from in_fd at in_off to out_fd at
+// *out_off, or at out_fd's file position (which may be a pipe) when out_off
+// is NULL. *method starts at COPY_RANGE and drops to COPY_SENDFILE, then COPY_NONE,
+// as the kernel or filesystem turns a call down. Returns the bytes copied
+// (short at end of input), or -1 when nothing could be copied this way.
+enum { COPY_RANGE, COPY_SENDFILE, COPY_NONE };
+static int64_t copy_range(int in_fd, uint64_t in_off, int out_fd, const uint64_t *out_off, uint64_t len, int *method) {
+    uint64_t done = 0;
+#ifdef __linux__
+    while (done < len && *method == COPY_RANGE) {
+        off_t in = (off_t)(in_off + done), out = out_off ? (off_t)(*out_off + done) : 0;
+        ssize_t n = copy_file_range(in_fd, &in, out_fd, out_off ? &out : NULL, len - done, 0);
+        if (n > 0) { done += (uint64_t)n; continue; }
+        if (n == 0) return (int64_t)done;
+        if (errno == EINTR) continue;
+        if (done) return -1;
+        *method = COPY_SENDFILE; // ENOSYS, EXDEV, EINVAL, EOPNOTSUPP, ...
+    }
+    if (done < len && *method == COPY_SENDFILE) {
+        //sendfile writes at the output file offset
+        if (out_off && lseek(out_fd, (off_t)(*out_off + done), SEEK_SET) < 0) return -1;
+        while (done < len) {
+            off_t in = (off_t)(in_off + done);
+            ssize_t n = sendfile(out_fd, in_fd, &in, len - done);
+            if (n > 0) { done += (uint64_t)n; continue; }
+            if (n == 0) return (int64_t)done;
+            if (errno == EINTR) continue;
+            if (done) return -1;
+            *method = COPY_NONE;
+            break;
+        }
+    }
+#else
+    (void)in_fd; (void)in_off; (void)out_fd; (void)out_off;
+    *method = COPY_NONE;
+#endif
+    return *method == COPY_NONE ? -1 : (int64_t)done;
+}
+
+// Per-block CRCs of a stream of file data, fed in arbitrary pieces
+typedef struct {
+    uint32_t *out;
+    uint64_t index;              // block the running CRC belongs to
+    uint32_t crc;
+    uint32_t fill;               // bytes of that block seen so far
+} block_sums_t;
+
+// Add len bytes of data (zeros when p is NULL) to the running block CRCs
+static void block_sums_add(block_sums_t *bs, const uint8_t *p, uint64_t len) {
+    while (len > 0) {
+        uint32_t n = len < BS - bs->fill ? (uint32_t)len : BS - bs->fill;
+        bs->crc = p ? crc32_update(bs->crc, p, n) : crc32_zeros(bs->crc, n);
+        if (p) p += n;
+        bs->fill += n;
+        len -= n;
+        if (bs->fill == BS) {
+            bs->out[bs->index++] = bs->crc;
+            bs->crc = 0;
+            bs->fill = 0;
+        }
+    }
+}
+
+// Fallback data path: read the extent's `want` bytes of input through a
+// bounded buffer and write them with stdio, zero-padding the rest of the
+// extent. block_crcs, when not NULL, gets the CRC of each block of the extent.
+static int write_extent_buffered(fs_image_t *fs, FILE *src, uint64_t src_off, uint64_t want, const extent_t *ext,
+                                 uint32_t *block_crcs) {
+    size_t chunk_blocks = 64;
+    uint8_t *file_buffer = malloc(chunk_blocks * BS);
+    if (!file_buffer) {
+        perror("Failed to allocate file buffer");
+        return 1;
+    }
+    if (fseeko(src, (off_t)src_off, SEEK_SET) != 0) {
+        perror("Failed to seek file");
+        free(file_buffer);
+        return 1;
+    }
+    if (fseeko(fs->img, (off_t)ext->start * BS, SEEK_SET) != 0) {
+        perror("Failed to seek image");
+        free(file_buffer);
+        return 1;
+    }
+    for (uint64_t off = 0; off < ext->len; off += chunk_blocks) {
+        size_t n = ext->len - off < chunk_blocks ? ext->len - off : chunk_blocks;
+        uint64_t left = want > off * BS ? want - off * BS : 0;
+        size_t expect = left < n * BS ? (size_t)left : n * BS;
+        size_t bytes_read = fread(file_buffer, 1, expect, src);
+        if (bytes_read < expect) {
+            if (ferror(src)) perror("Failed to read file");
+            else fprintf(stderr, "File shrank while being added\n");
+            free(file_buffer);
+            return 1;
+        }
+
+        //Pad last block with zeros if needed
+        if (bytes_read < n * BS) {
+            memset(file_buffer + bytes_read, 0, n * BS - bytes_read);
+        }
+        if (block_crcs)
+            for (size_t b = 0; b < n; b++) block_crcs[off + b] = crc32(file_buffer + b * BS, BS);
+
+        if (fwrite(file_buffer, BS, n, fs->img) != n) {
+            perror("Failed to write file data");
+            free(file_buffer);
+            return 1;
+        }
+    }
+    free(file_buffer);
+    return 0;
+}
+
+static int copy_into_extents(int img_fd, int src_fd, uint64_t src_off, uint64_t size,
+                             const extent_t *extents, size_t nextents, uint32_t *crc_out, uint32_t *block_crcs);
+
+// Move `size` bytes of src into the extents, one in-kernel copy per extent
+// when src is a plain file descriptor. The rest of the last block is zeroed
+// by the filesystem; a source that ends early is an error.
+// Block CRCs need the data in user space, so with block_crcs the copy goes
+// through a buffer and each block is summed on the way.
+static int write_file_data(fs_image_t *fs, FILE *src, uint64_t size, const extent_t *extents, size_t nextents,
+                           uint32_t *block_crcs) {
+    int in_fd = fileno(src);
+    int out_fd = fileno(fs->img);
+    off_t src_pos = ftello(src);
+    int method = in_fd >= 0 && src_pos >= 0 ? COPY_RANGE : COPY_NONE;
+
+    //Block-level writes bypass stdio, so nothing may stay buffered there
+    if (method != COPY_NONE && fflush(fs->img) != 0) {
+        perror("Failed to flush image");
+        return 1;
+    }
+    if (block_crcs && method != COPY_NONE)
+        return copy_into_extents(out_fd, in_fd, (uint64_t)src_pos, size, extents, nextents, NULL, block_crcs);
+
+    uint64_t pos = 0, blocks = 0;
+    for (size_t e = 0; e < nextents; e++) {
+        uint64_t dst = (uint64_t)extents[e].start * BS;
+        uint64_t ext_bytes = (uint64_t)extents[e].len * BS;
+        uint64_t want = size - pos < ext_bytes ? size - pos : ext_bytes;
+
+        int64_t copied = method != COPY_NONE
+            ? copy_range(in_fd, (uint64_t)src_pos + pos, out_fd, &dst, want, &method) : -1;
+        if (copied < 0) {
+            if (write_extent_buffered(fs, src, (uint64_t)src_pos + pos, want, &extents[e],
+                                      block_crcs ? block_crcs + blocks : NULL) != 0) return 1;
+            //Keep stdio and the descriptor-level path from interleaving
+            if (method != COPY_NONE && fflush(fs->img) != 0) {
+                perror("Failed to flush image");
+                return 1;
+            }
+        } else if ((uint64_t)copied < want) {
+            fprintf(stderr, "File shrank while being added\n");
+            return 1;
+        } else if (zero_fill(out_fd, dst + (uint64_t)copied, ext_bytes - (uint64_t)copied) != 0) {
+            return 1;
+        }
+        pos += want;
+        blocks += extents[e].len;
+    }
+    return 0;
+}
+
+// fs_write_extents() reading the source from src_off on
+static int copy_into_extents(int img_fd, int src_fd, uint64_t src_off, uint64_t size,
+                             const extent_t *extents, size_t nextents, uint32_t *crc_out, uint32_t *block_crcs) {
+    uint64_t max_extent = 0;
+    for (size_t e = 0; e < nextents; e++)
+        if (extents[e].len > max_extent) max_extent = extents[e].len;
+    size_t chunk = (size_t)(max_extent < 64 ? max_extent : 64) * BS;
+    uint8_t *buf = chunk ? malloc(chunk) : NULL;
+    if (chunk && !buf) {
+        perror("Failed to allocate file buffer");
+        return 1;
+    }
+
+    uint32_t crc = 0;
+    block_sums_t sums = { .out = block_crcs };
+    uint64_t pos = 0;
+    for (size_t e = 0; e < nextents; e++) {
+        uint64_t dst = (uint64_t)extents[e].start * BS;
+        uint64_t ext_bytes = (uint64_t)extents[e].len * BS;
+        uint64_t done = 0;
+        while (done < ext_bytes && pos < size) {
+            uint64_t want = size - pos < ext_bytes - done ? size - pos : ext_bytes - done;
+            size_t n = want < chunk ? (size_t)want : chunk;
+            ssize_t r = pread(src_fd, buf, n, (off_t)(src_off + pos));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r < 0) perror("Failed to read file");
+                else fprintf(stderr, "File shrank while being added\n");
+                free(buf);
+                return 1;
+            }
+            if (crc_out) crc = crc32_update(crc, buf, (size_t)r);
+            if (block_crcs) block_sums_add(&sums, buf, (uint64_t)r);
+            for (ssize_t w, off = 0; off < r; off += w) {
+                w = pwrite(img_fd, buf + off, (size_t)(r - off), (off_t)(dst + done + (uint64_t)off));
+                if (w < 0 && errno == EINTR) w = 0;
+                else if (w < 0) {
+                    perror("Failed to write file data");
+                    free(buf);
+                    return 1;
+                }
+            }
+            done += (uint64_t)r;
+            pos += (uint64_t)r;
+        }
+        if (block_crcs) block_sums_add(&sums, NULL, ext_bytes - done);
+        if (zero_fill(img_fd, dst + done, ext_bytes - done) != 0) {
+            free(buf);
+            return 1;
+        }
+    }
+    free(buf);
+    if (crc_out) *crc_out = crc;
+    return 0;
+}
+
+int fs_write_extents(int img_fd, int src_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                     uint32_t *crc_out, uint32_t *block_crcs) {
+    return copy_into_extents(img_fd, src_fd, 0, size, extents, nextents, crc_out, block_crcs);
+}
+
+// Bytes laid out across a file's extents through a staging buffer, with
+// per-block CRCs taken on the way when sums.out is set
+typedef struct {
+    int fd;
+    const extent_t *extents;
+    size_t nextents;
+    size_t ext;                  // extent the next flushed block goes to
+    uint64_t ext_used;           // blocks of it already written
+    uint8_t *buf;
+    size_t fill, cap;
+    uint64_t pos;                // stream bytes so far
+    block_sums_t sums;
+} stream_t;
+
+// Write the staged bytes, padding a partial last block with zeros
+static int stream_flush(stream_t *st) {
+    size_t bytes = (st->fill + BS - 1) / BS * BS;
+    memset(st->buf + st->fill, 0, bytes - st->fill);
+    if (st->sums.out) block_sums_add(&st->sums, st->buf, bytes);
+    for (size_t done = 0; done < bytes; ) {
+        if (st->ext == st->nextents) {
+            fprintf(stderr, "Compressed data overruns its blocks\n");
+            return 1;
+        }
+        const extent_t *e = &st->extents[st->ext];
+        size_t n = (size_t)((e->len - st->ext_used) * BS < bytes - done ? (e->len - st->ext_used) * BS : bytes - done);
+        uint64_t dst = ((uint64_t)e->start + st->ext_used) * BS;
+        for (ssize_t w, off = 0; off < (ssize_t)n; off += w) {
+            w = pwrite(st->fd, st->buf + done + off, n - (size_t)off, (off_t)(dst + (uint64_t)off));
+            if (w < 0 && errno == EINTR) w = 0;
+            else if (w < 0) {
+                perror("Failed to write file data");
+                return 1;
+            }
+        }
+        done += n;
+        st->ext_used += n / BS;
+        if (st->ext_used == e->len) {
+            st->ext++;
+            st->ext_used = 0;
+        }
+    }
+    st->fill = 0;
+    return 0;
+}
+
+// Append n bytes (zeros when p is NULL) to the stream
+static int stream_put(stream_t *st, const void *p, size_t n) {
+    const uint8_t *src = p;
+    while (n > 0) {
+        size_t k = n < st->cap - st->fill ? n : st->cap - st->fill;
+        if (src) {
+            memcpy(st->buf + st->fill, src, k);
+            src += k;
+        } else {
+            memset(st->buf + st->fill, 0, k);
+        }
+        st->fill += k;
+        st->pos += k;
+        n -= k;
+        if (st->fill == st->cap && stream_flush(st) != 0) return 1;
+    }
+    return 0;
+}
+
+// Blocks a compressed stream takes once `pos` bytes of chunks are followed
+// by the index and trailer
+static uint64_t stream_blocks(uint64_t pos, uint64_t nchunks) {
+    return (pos + nchunks * sizeof(uint64_t) + sizeof(cz_trailer_t) + BS - 1) / BS;
+}
+
+uint64_t fs_compressed_bound(uint64_t size) {
+    return size ? stream_blocks(size, (size + CZ_CHUNK - 1) / CZ_CHUNK) : 0;
+}
+
+// fs_compress_extents() reading the source from src_off on. Gives up on
+// the stream as soon as it cannot end up smaller than the plain file.
+static int compress_into_extents(int img_fd, int src_fd, uint64_t src_off, uint64_t size,
+                                 const extent_t *extents, size_t nextents, uint64_t *used, int *packed,
+                                 uint32_t *crc_out, uint32_t *block_crcs) {
+    uint64_t raw_blocks = (size + BS - 1) / BS;
+    uint64_t nchunks = (size + CZ_CHUNK - 1) / CZ_CHUNK;
+    stream_t st = { .fd = img_fd, .extents = extents, .nextents = nextents, .cap = 64 * BS,
+                    .sums = { .out = block_crcs } };
+    uint64_t *index = nchunks ? malloc(nchunks * sizeof(*index)) : NULL;
+    uint8_t *raw = malloc(CZ_CHUNK), *comp = malloc(CZ_CHUNK);
+    st.buf = malloc(st.cap);
+    int status = 1;
+    if ((nchunks && !index) || !raw || !comp || !st.buf) {
+        perror("Failed to allocate compression buffers");
+        goto out;
+    }
+
+    uint32_t crc = 0;
+    uint64_t c = 0;
+    for (; c < nchunks && stream_blocks(st.pos, nchunks) < raw_blocks; c++) {
+        size_t n = size - c * CZ_CHUNK < CZ_CHUNK ? (size_t)(size - c * CZ_CHUNK) : CZ_CHUNK;
+        size_t got = 0;
+        while (got < n) {
+            ssize_t r = pread(src_fd, raw + got, n - got, (off_t)(src_off + c * CZ_CHUNK + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r < 0) perror("Failed to read file");
+                else fprintf(stderr, "File shrank while being added\n");
+                goto out;
+            }
+            got += (size_t)r;
+        }
+        if (crc_out) crc = crc32_update(crc, raw, n);
+
+        size_t len = lz_compress(raw, n, comp, n - 1, LZ_ACCEL_DEFAULT);
+        if (stream_put(&st, len ? comp : raw, len ? len : n) != 0) goto out;
+        index[c] = to_le64(st.pos);
+    }
+
+    if (c == nchunks && stream_blocks(st.pos, nchunks) < raw_blocks) {
+        cz_trailer_t tr = { .nchunks = to_le64(nchunks), .chunk_size = to_le32(CZ_CHUNK), .magic = to_le32(CZ_MAGIC) };
+        uint64_t meta = nchunks * sizeof(uint64_t) + sizeof(tr);
+        *used = stream_blocks(st.pos, nchunks);
+        if (stream_put(&st, NULL, *used * BS - st.pos - meta) != 0 ||
+            stream_put(&st, index, nchunks * sizeof(uint64_t)) != 0 ||
+            stream_put(&st, &tr, sizeof(tr)) != 0 || stream_flush(&st) != 0) goto out;
+        *packed = 1;
+        if (crc_out) *crc_out = crc;
+        status = 0;
+        goto out;
+    }
+
+    //No gain: store the file as is in the first blocks of the map
+    size_t nplain = 0;
+    for (uint64_t blocks = 0; blocks < raw_blocks; blocks += extents[nplain++].len) {}
+    extent_t *plain = nplain ? malloc(nplain * sizeof(*plain)) : NULL;
+    if (nplain && !plain) {
+        perror("Failed to allocate extent list");
+        goto out;
+    }
+    if (nplain) {
+        memcpy(plain, extents, nplain * sizeof(*plain));
+        uint64_t over = 0;
+        for (size_t e = 0; e < nplain; e++) over += plain[e].len;
+        plain[nplain - 1].len -= (uint32_t)(over - raw_blocks);
+    }
+    status = copy_into_extents(img_fd, src_fd, src_off, size, plain, nplain, crc_out, block_crcs);
+    free(plain);
+    *used = raw_blocks;
+    *packed = 0;
+
+out:
+    free(index);
+    free(raw);
+    free(comp);
+    free(st.buf);
+    return status;
+}
+
+int fs_compress_extents(int img_fd, int src_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                        uint64_t *used, int *packed, uint32_t *crc_out, uint32_t *block_crcs) {
+    return compress_into_extents(img_fd, src_fd, 0, size, extents, nextents, used, packed, crc_out, block_crcs);
+}
+
+// pread exactly n bytes of file data from the image
+static int read_data(int img_fd, void *buf, size_t n, uint64_t off) {
+    uint8_t *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(img_fd, p, n, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r < 0) perror("Failed to read file data");
+            else fprintf(stderr, "Image ends inside file data\n");
+            return 1;
+        }
+        p += r;
+        off += (uint64_t)r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+// Compare whole data blocks against their stored CRCs
+static int check_blocks(const uint8_t *p, uint64_t nblocks, const uint32_t *crcs, uint64_t first_blkno) {
+    for (uint64_t b = 0; b < nblocks; b++) {
+        if (crc32(p + b * BS, BS) != crcs[b]) {
+            fprintf(stderr, "Data block %" PRIu64 " fails its checksum\n", first_blkno + b);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int fs_read_extents(int img_fd, int out_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                    const uint32_t *block_crcs) {
+    uint64_t mapped = 0, max_extent = 0;
+    for (size_t e = 0; e < nextents; e++) {
+        mapped += extents[e].len;
+        if (extents[e].len > max_extent) max_extent = extents[e].len;
+    }
+    if (mapped * BS < size) {
+        fprintf(stderr, "File data extends past its block map\n");
+        return 1;
+    }
+
+    //Checked data has to pass through user space
+    int method = block_crcs ? COPY_NONE : COPY_RANGE;
+    size_t chunk = (size_t)(max_extent < 64 ? max_extent : 64) * BS;
+    uint8_t *buf = NULL;
+    int status = 1;
+    uint64_t pos = 0;
+    for (size_t e = 0; e < nextents && pos < size; e++) {
+        uint64_t src = (uint64_t)extents[e].start * BS;
+        uint64_t ext_bytes = (uint64_t)extents[e].len * BS;
+        uint64_t want = size - pos < ext_bytes ? size - pos : ext_bytes;
+        uint64_t done = 0;
+        //Whole blocks are read when they are checked, the tail padding too
+        uint64_t span = block_crcs ? (want + BS - 1) / BS * BS : want;
+
+        //One in-kernel transfer per run of blocks; only a call that moved
+        //nothing falls through to the buffered copy below
+        if (method != COPY_NONE) {
+            int64_t copied = copy_range(img_fd, src, out_fd, NULL, want, &method);
+            if (copied < 0 && method != COPY_NONE) {
+                perror("Failed to write file data");
+                goto out;
+            }
+            if (copied > 0) done = (uint64_t)copied;
+        }
+        while (done < want) {
+            if (!buf && !(buf = malloc(chunk))) {
+                perror("Failed to allocate file buffer");
+                goto out;
+            }
+            size_t n = span - done < chunk ? (size_t)(span - done) : chunk;
+            if (read_data(img_fd, buf, n, src + done) != 0) goto out;
+            if (block_crcs && check_blocks(buf, n / BS, block_crcs + (pos + done) / BS, (src + done) / BS) != 0)
+                goto out;
+            size_t keep = want - done < n ? (size_t)(want - done) : n;
+            for (size_t off = 0; off < keep; ) {
+                ssize_t w = write(out_fd, buf + off, keep - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) {
+                    perror("Failed to write file data");
+                    goto out;
+                }
+                off += (size_t)w;
+            }
+            done += n;
+        }
+        pos += want;
+    }
+    status = 0;
+
+out:
+    free(buf);
+    return status;
+}
+
+// The blocks of one file as a byte stream, read with their checksums
+typedef struct {
+    fs_image_t *fs;
+    const inode_t *in;
+    const extent_t *extents;
+    size_t nextents;
+    uint64_t csum_count;         // CRCs in the inode's chain
+    uint32_t *crcs;              // CRCs of blocks [crc_first, crc_end), loaded as needed
+    uint64_t crc_first, crc_end;
+    uint8_t *block;              // a partly wanted block, read whole to check it
+} stored_reader_t;
+
+// Have the CRCs of blocks [first, end) at hand, loading them a whole
+// checksum block's worth at a time so sequential reads walk the chain rarely
+static int reader_crcs(stored_reader_t *r, uint64_t first, uint64_t end) {
+    if (first >= r->crc_first && end <= r->crc_end) return 0;
+    uint64_t lo = first / CSUM_BLOCK_MAX * CSUM_BLOCK_MAX;
+    uint64_t hi = (end + CSUM_BLOCK_MAX - 1) / CSUM_BLOCK_MAX * CSUM_BLOCK_MAX;
+    if (hi > r->csum_count) hi = r->csum_count;
+    if (end > hi) {
+        fprintf(stderr, "Data block %" PRIu64 " of the file has no checksum\n", end - 1);
+        return 1;
+    }
+    free(r->crcs);
+    r->crc_first = r->crc_end = 0;
+    r->crcs = malloc((hi - lo) * sizeof(*r->crcs));
+    if (!r->crcs) {
+        perror("Failed to allocate checksum buffer");
+        return 1;
+    }
+    if (fs_load_checksums(r->fs, r->in, lo, hi - lo, r->crcs) != 0) return 1;
+    r->crc_first = lo;
+    r->crc_end = hi;
+    return 0;
+}
+
+// Read exactly len bytes of the stored stream at off into dst; on a
+// checksummed file every block touched is checked whole
+static int read_stored(stored_reader_t *r, uint64_t off, uint64_t len, uint8_t *dst) {
+    if (len == 0) return 0;
+    int csum = (r->in->reserved_0 & INODE_FL_CSUM) != 0;
+    if (csum) {
+        if (reader_crcs(r, off / BS, (off + len - 1) / BS + 1) != 0) return 1;
+        if (!r->block && !(r->block = malloc(BS))) {
+            perror("Failed to allocate checksum buffer");
+            return 1;
+        }
+    }
+
+    int img_fd = fileno(r->fs->img);
+    uint64_t ext_first = 0; // file block extent e starts at
+    for (size_t e = 0; e < r->nextents && len > 0; ext_first += r->extents[e++].len) {
+        uint64_t ext_end = (ext_first + r->extents[e].len) * BS;
+        if (off >= ext_end) continue;
+        for (uint64_t want = (len < ext_end - off ? len : ext_end - off); want > 0; ) {
+            uint64_t in_block = off % BS;
+            uint64_t blkno = r->extents[e].start + (off / BS - ext_first);
+            const uint32_t *sums = csum ? r->crcs + (off / BS - r->crc_first) : NULL;
+            size_t n;
+            if (!csum) {
+                n = (size_t)want;
+                if (read_data(img_fd, dst, n, blkno * BS + in_block) != 0) return 1;
+            } else if (in_block || want < BS) {
+                //A partly wanted block is still checked whole
+                n = (size_t)(BS - in_block < want ? BS - in_block : want);
+                if (read_data(img_fd, r->block, BS, blkno * BS) != 0 || check_blocks(r->block, 1, sums, blkno) != 0)
+                    return 1;
+                memcpy(dst, r->block + in_block, n);
+            } else {
+                n = (size_t)(want / BS * BS);
+                if (read_data(img_fd, dst, n, blkno * BS) != 0 || check_blocks(dst, n / BS, sums, blkno) != 0)
+                    return 1;
+            }
+            dst += n;
+            off += n;
+            want -= n;
+            len -= n;
+        }
+    }
+    if (len > 0) {
+        fprintf(stderr, "File data extends past its block map\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Bytes [off, off + len) of a compressed file: only the chunks holding the
+// range are read and decompressed, found through their index entries
+static int read_compressed(stored_reader_t *r, uint32_t ino, uint64_t off, uint64_t len, uint8_t *dst) {
+    uint64_t stored = 0;
+    for (size_t e = 0; e < r->nextents; e++) stored += (uint64_t)r->extents[e].len * BS;
+    cz_trailer_t tr;
+    if (stored < sizeof(tr) || read_stored(r, stored - sizeof(tr), sizeof(tr), (uint8_t *)&tr) != 0) return 1;
+    uint64_t chunk = from_le32(tr.chunk_size), nchunks = from_le64(tr.nchunks);
+    if (from_le32(tr.magic) != CZ_MAGIC || chunk < BS || chunk > (16u << 20) ||
+        nchunks != (r->in->size_bytes + chunk - 1) / chunk || nchunks > (stored - sizeof(tr)) / sizeof(uint64_t)) {
+        fprintf(stderr, "Inode %u: corrupt compressed file trailer\n", ino);
+        return 1;
+    }
+    uint64_t index_off = stored - sizeof(tr) - nchunks * sizeof(uint64_t);
+
+    //Index entries from the one before the first chunk to the last chunk
+    uint64_t first = off / chunk, last = (off + len - 1) / chunk;
+    uint64_t from = first ? first - 1 : 0, nent = last - from + 1;
+    uint64_t *index = malloc(nent * sizeof(*index));
+    uint8_t *packed = malloc(chunk), *raw = malloc(chunk);
+    int status = 1;
+    if (!index || !packed || !raw) {
+        perror("Failed to allocate chunk buffers");
+        goto out;
+    }
+    if (read_stored(r, index_off + from * sizeof(uint64_t), nent * sizeof(uint64_t), (uint8_t *)index) != 0) goto out;
+
+    for (uint64_t c = first; c <= last; c++) {
+        uint64_t start = c ? from_le64(index[c - 1 - from]) : 0, end = from_le64(index[c - from]);
+        uint64_t raw_len = r->in->size_bytes - c * chunk < chunk ? r->in->size_bytes - c * chunk : chunk;
+        if (start > end || end > index_off || end - start > raw_len) {
+            fprintf(stderr, "Inode %u: corrupt index entry for chunk %" PRIu64 "\n", ino, c);
+            goto out;
+        }
+        //A chunk wanted whole goes straight to dst
+        uint64_t lo = c * chunk > off ? c * chunk : off;
+        uint64_t hi = c * chunk + raw_len < off + len ? c * chunk + raw_len : off + len;
+        uint8_t *target = lo == c * chunk && hi == c * chunk + raw_len ? dst + (lo - off) : raw;
+        if (end - start == raw_len) {
+            if (read_stored(r, start, raw_len, target) != 0) goto out;
+        } else {
+            if (read_stored(r, start, end - start, packed) != 0) goto out;
+            if (lz_decompress(packed, end - start, target, raw_len) != (int64_t)raw_len) {
+                fprintf(stderr, "Inode %u: chunk %" PRIu64 " does not decompress\n", ino, c);
+                goto out;
+            }
+        }
+        if (target == raw) memcpy(dst + (lo - off), raw + (lo - c * chunk), hi - lo);
+    }
+    status = 0;
+
+out:
+    free(index);
+    free(packed);
+    free(raw);
+    return status;
+}
+
+int fs_read_file(fs_image_t *fs, uint32_t ino, void *buf, uint64_t off, uint64_t len, uint64_t *got) {
+    *got = 0;
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+    if (off >= in.size_bytes || len == 0) return 0;
+    if (len > in.size_bytes - off) len = in.size_bytes - off;
+    if (in.reserved_0 & INODE_FL_INLINE) {
+        if (in.size_bytes > INODE_INLINE_MAX) {
+            fprintf(stderr, "Inode %u: inline data larger than the inode\n", ino);
+            return 1;
+        }
+        memcpy(buf, (const uint8_t *)in.direct + off, len);
+        *got = len;
+        return 0;
+    }
+
+    stored_reader_t r = { .fs = fs, .in = &in };
+    if (fs_inode_map(fs, &in, (extent_t **)&r.extents, &r.nextents) != 0) return 1;
+    //The chain covers every stored block of a compressed file, and the
+    //blocks the size needs of any other
+    if (in.reserved_0 & INODE_FL_COMPRESSED)
+        for (size_t e = 0; e < r.nextents; e++) r.csum_count += r.extents[e].len;
+    else
+        r.csum_count = (in.size_bytes + BS - 1) / BS;
+
+    int rc = in.reserved_0 & INODE_FL_COMPRESSED ? read_compressed(&r, ino, off, len, buf)
+                                                 : read_stored(&r, off, len, buf);
+    if (rc == 0) *got = len;
+    free(r.block);
+    free(r.crcs);
+    free((extent_t *)r.extents);
+    return rc;
+}
+
+int fs_read_source(FILE *src, void *buf, uint64_t size) {
+    //Running out early means the source shrank since it was sized; a short
+    //read would leave stale zeros in the tail
+    for (uint64_t got = 0; got < size; ) {
+        size_t n = fread((uint8_t *)buf + got, 1, size - got, src);
+        if (n == 0) {
+            if (ferror(src)) perror("Failed to read file");
+            else fprintf(stderr, "File shrank while being added\n");
+            return 1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+int fs_write_file(fs_image_t *fs, const char *file_name, FILE *file_to_add, uint64_t file_size, uint32_t *ino_out) {
+    if (file_size > 0 && file_size <= INODE_INLINE_MAX) {
+        uint8_t data[INODE_INLINE_MAX] = {0};
+        if (fs_read_source(file_to_add, data, file_size) != 0) return 1;
+        return fs_write_inline(fs, file_name, data, file_size, ino_out);
+    }
+
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint32_t ino;
+    if (fs_create_file(fs, file_name, file_size, &ino, &extents, &nextents) != 0) return 1;
+    if (ino_out) *ino_out = ino;
+
+    uint64_t blocks = (file_size + BS - 1) / BS;
+    uint32_t *sums = NULL;
+    if ((fs->sb.flags & SB_FEAT_DATA_CSUM) && blocks && !(sums = malloc(blocks * sizeof(*sums)))) {
+        perror("Failed to allocate checksum list");
+        free(extents);
+        return 1;
+    }
+    int rc = write_file_data(fs, file_to_add, file_size, extents, nextents, sums);
+    if (rc == 0 && sums) rc = fs_store_checksums(fs, ino, sums, blocks);
+    free(sums);
+    free(extents);
+    return rc;
+}
+
+// Fill in a new directory entry in the slot dir_reserve() made room for
+static void dir_add(fs_dir_t *d, const char *name, uint32_t ino, uint8_t type) {
+    int found;
+    dirent64_t *new_entry = dir_probe(d, name, &found);
+    d->dirty[((uint8_t *)new_entry - d->ents) / BS] = 1;
+    d->live++;
+    memset(new_entry, 0, sizeof(*new_entry));
+    new_entry->ino = ino;
+    new_entry->type = type;
+    strncpy(new_entry->name, name, sizeof(new_entry->name) - 1);
+    new_entry->name[sizeof(new_entry->name) - 1] = '\0';
+
+    //Update directory size, link count, and timestamps
+    d->inode.size_bytes += sizeof(dirent64_t);
+    d->inode.links = dir_links(d->live);  //New entry's .. points here
+    d->inode.mtime = time(NULL);
+    d->inode.ctime = time(NULL);
+    d->inode_dirty = 1;
+}
+
+// Name checks shared by everything that adds a directory entry; `shown`
+// is the name as the caller gave it
+static int dir_check_new(fs_image_t *fs, fs_dir_t *d, const char *name, const char *shown) {
+    if (strlen(name) > NAME_MAX_LEN) {
+        fprintf(stderr, "Error: Filename '%s' too long (max %u characters)\n", name, NAME_MAX_LEN);
+        return 1;
+    }
+
+    //Check if file already exists
+    int found;
+    dir_probe(d, name, &found);
+    if (found) {
+        if (d == &fs->root && strcmp(name, shown) == 0)
+            fprintf(stderr, "Error: File '%s' already exists in root directory\n", name);
+        else
+            fprintf(stderr, "Error: '%s' already exists\n", shown);
+        return 1;
+    }
+
+    if (dir_reserve(fs, d) != 0) {
+        fprintf(stderr, "No free directory entries for '%s'\n", shown);
+        return 1;
+    }
+    return 0;
+}
+
+int fs_link(fs_image_t *fs, fs_dir_t *d, const char *name, uint32_t ino, uint8_t type) {
+    if (dir_check_new(fs, d, name, name) != 0) return 1;
+    dir_add(d, name, ino, type);
+    return 0;
+}
+
+void fs_unlink_slot(fs_dir_t *d, size_t slot) {
+    //The name stays behind as a tombstone so hashed lookups keep probing
+    dirent64_t *e = (dirent64_t *)d->ents + slot;
+    if (e->ino == 0) return;
+    e->ino = 0;
+    d->dirty[slot / DIRENTS_PER_BLOCK] = 1;
+    d->live--;
+    d->inode.size_bytes -= sizeof(dirent64_t);
+    d->inode.links = dir_links(d->live);
+    d->inode.mtime = time(NULL);
+    d->inode.ctime = time(NULL);
+    d->inode_dirty = 1;
+}
+
+// New directory at path in inode slot `slot`, on the nblocks blocks of
+// extents: one linear block or a hashed directory of nblocks buckets
+static int dir_create(fs_image_t *fs, const char *path, uint32_t slot, const extent_t *extents, size_t nextents,
+                      uint32_t nblocks, uint32_t *ino_out) {
+    char leaf[NAME_MAX_LEN + 1];
+    fs_dir_t *parent = path_parent(fs, path, leaf);
+    if (!parent || dir_check_new(fs, parent, leaf, path) != 0) return 1;
+
+    fs_dir_t *d = calloc(1, sizeof(*d));
+    if (!d) {
+        perror("Failed to allocate directory");
+        return 1;
+    }
+    d->ino = slot + 1;
+    d->nblocks = nblocks;
+    d->ents = calloc(nblocks, BS);
+    d->blknos = malloc(nblocks * sizeof(uint32_t));
+    d->dirty = malloc(nblocks);
+    if (!d->ents || !d->blknos || !d->dirty) {
+        perror("Failed to allocate directory");
+        goto fail;
+    }
+    memset(d->dirty, 1, nblocks);
+    uint32_t b = 0;
+    for (size_t e = 0; e < nextents; e++)
+        for (uint32_t j = 0; j < extents[e].len; j++)
+            d->blknos[b++] = extents[e].start + j;
+
+    inode_t *in = &d->inode;
+    in->mode = 0040000;
+    in->links = 2;
+    in->size_bytes = 2 * sizeof(dirent64_t);
+    in->atime = in->mtime = in->ctime = time(NULL);
+    in->proj_id = PROJECT_ID;
+    if (nblocks == 1) {
+        in->direct[0] = d->blknos[0];
+    } else {
+        in->reserved_0 = INODE_FL_EXTENTS | INODE_FL_HASHED;
+        if (fs_set_extents(fs, in, extents, nextents, fs_inode_group(fs, slot)) != 0) goto fail;
+        fs->sb.flags |= SB_FEAT_DIR_INDEX;
+    }
+    d->inode_dirty = 1;
+
+    dirent64_t *dots = (dirent64_t *)d->ents;
+    dots[0] = (dirent64_t){ .ino = d->ino, .type = DIRENT_DIR, .name = "." };
+    dots[1] = (dirent64_t){ .ino = parent->ino, .type = DIRENT_DIR, .name = ".." };
+    d->live = 2;
+
+    if (dirs_insert(fs, d) != 0) goto fail;
+    dir_add(parent, leaf, d->ino, DIRENT_DIR);
+    fs->sb.flags |= SB_FEAT_SUBDIRS;
+    if (ino_out) *ino_out = d->ino;
+    return 0;
+
+fail:
+    dir_release(d);
+    free(d);
+    return 1;
+}
+
+int fs_mkdirs(fs_image_t *fs, const char *const *paths, const uint64_t *entries, size_t count, uint32_t *inos) {
+    if (count == 0) return 0;
+    uint32_t *nblocks = malloc(count * sizeof(*nblocks));
+    uint32_t *slots = malloc(count * sizeof(*slots));
+    extent_t *extents = NULL, *part = NULL;
+    size_t nextents = 0, taken = 0;
+    int status = 1;
+    if (!nblocks || !slots) {
+        perror("Failed to allocate directory list");
+        goto out;
+    }
+
+    //Each directory is made at the size its entries need, so it is never rebuilt
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        nblocks[i] = fs_dir_blocks(entries[i]);
+        total += nblocks[i];
+    }
+    if (fs->inode_bm.nfree < count) {
+        fprintf(stderr, "No free inodes available\n");
+        goto out;
+    }
+    if (fs->data_bm.nfree < total) {
+        fprintf(stderr, "Not enough free data blocks\n");
+        goto out;
+    }
+
+    //All inodes first, then all directory blocks as one allocation from the
+    //first one's group; until a directory is made they can all go back
+    uint64_t group = 0;
+    for (size_t i = 0; i < count; i++) {
+        int64_t slot = fs_alloc_inode(fs, nblocks[i]);
+        if (slot < 0) {
+            fprintf(stderr, "No free inodes available\n");
+            goto undo;
+        }
+        slots[i] = (uint32_t)slot;
+        taken = i + 1;
+        if (i == 0) group = fs_inode_group(fs, (uint64_t)slot);
+    }
+    if (fs_alloc_blocks(fs, group, total, &extents, &nextents) != 0) goto undo;
+    part = malloc(nextents * sizeof(*part));
+    if (!part) {
+        perror("Failed to allocate directory list");
+        free_runs(fs, extents, nextents);
+        goto undo;
+    }
+
+    //Hand the runs out in order
+    size_t e = 0;
+    uint32_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t npart = 0, first = e;
+        uint32_t offset = used;
+        for (uint32_t want = nblocks[i]; want > 0; ) {
+            uint32_t take = extents[e].len - used < want ? extents[e].len - used : want;
+            part[npart++] = (extent_t){ extents[e].start + used, take };
+            used += take;
+            want -= take;
+            if (used == extents[e].len) {
+                e++;
+                used = 0;
+            }
+        }
+        if (dir_create(fs, paths[i], slots[i], part, npart, nblocks[i], inos ? &inos[i] : NULL) != 0) {
+            //The directories already made keep theirs; this one and the rest go back
+            extent_t rest = { extents[first].start + offset, extents[first].len - offset };
+            free_runs(fs, &rest, 1);
+            free_runs(fs, extents + first + 1, nextents - first - 1);
+            for (size_t j = i; j < count; j++) fs_set_inode_used(fs, slots[j], 0);
+            goto out;
+        }
+    }
+    status = 0;
+    goto out;
+
+undo:
+    for (size_t i = 0; i < taken; i++) fs_set_inode_used(fs, slots[i], 0);
+out:
+    free(nblocks);
+    free(slots);
+    free(extents);
+    free(part);
+    return status;
+}
+
+int fs_mkdir(fs_image_t *fs, const char *path, uint64_t entries, int parents, uint32_t *ino_out) {
+    if (!parents) return fs_mkdirs(fs, &path, &entries, 1, ino_out);
+
+    //Walk down the path, creating each directory that is missing
+    char name[NAME_MAX_LEN + 1];
+    char *prefix = malloc(strlen(path) + 1);
+    if (!prefix) {
+        perror("Failed to allocate path");
+        return 1;
+    }
+    fs_dir_t *d = &fs->root;
+    const char *p = path;
+    int rc;
+    while ((rc = path_next(&p, name)) > 0) {
+        memcpy(prefix, path, (size_t)(p - path));
+        prefix[p - path] = '\0';
+        int found;
+        dirent64_t *e = dir_probe(d, name, &found);
+        uint32_t ino;
+        if (found && e->type != DIRENT_DIR) {
+            fprintf(stderr, "Error: '%s' exists and is not a directory\n", prefix);
+            rc = 1;
+            break;
+        }
+        if (found) {
+            ino = e->ino;
+        } else {
+            //Parents made on the way hold one entry, the last one what was asked for
+            uint64_t want = path_end(p) ? entries : 1;
+            const char *one = prefix;
+            if (fs_mkdirs(fs, &one, &want, 1, &ino) != 0) {
+                rc = 1;
+                break;
+            }
+        }
+        if (!(d = fs_dir(fs, ino))) {
+            rc = 1;
+            break;
+        }
+    }
+    //rc is left positive by a failure already reported above
+    if (rc < 0) path_report(p);
+    free(prefix);
+    if (rc != 0) return 1;
+    if (ino_out) *ino_out = d->ino;
+    return 0;
+}
+
+int fs_set_extents(fs_image_t *fs, inode_t *in, const extent_t *extents, size_t nextents, uint64_t goal) {
+    uint64_t blocks = 0;
+    for (size_t e = 0; e < nextents; e++) blocks += extents[e].len;
+
+    //Small files keep the classic direct[] map, larger ones use extents
+    if (blocks <= DIRECT_MAX && !(in->reserved_0 & INODE_FL_EXTENTS)) {
+        memset(in->direct, 0, sizeof(in->direct));
+        size_t i = 0;
+        for (size_t e = 0; e < nextents; e++)
+            for (uint32_t j = 0; j < extents[e].len; j++)
+                in->direct[i++] = extents[e].start + j;
+        return 0;
+    }
+
+    if (nextents > EXTENT_MAP_MAX) {
+        fprintf(stderr, "File too fragmented: needs %zu extents, maximum is %zu\n", nextents, EXTENT_MAP_MAX);
+        return 1;
+    }
+    size_t need = nextents > INODE_EXTENTS ? (nextents + EXTENT_BLOCK_MAX - 1) / EXTENT_BLOCK_MAX : 0;
+
+    //The current chain is reused as far as it goes; what it has beyond
+    //that is freed with the commit
+    uint32_t chain[EXTENT_CHAIN_MAX];
+    size_t have = 0;
+    if (in->reserved_2 && fs_extent_chain(fs, in, chain, &have) != 0) return 1;
+    for (size_t i = need; i < have; i++)
+        if (fs_defer_free(fs, chain[i], 1) != 0) return 1;
+    for (size_t i = have; i < need; i++) {
+        if (!(chain[i] = alloc_data_block(fs, goal))) {
+            fprintf(stderr, "Not enough free data blocks\n");
+            return 1;
+        }
+    }
+
+    memset(in->direct, 0, sizeof(in->direct));
+    in->reserved_0 |= INODE_FL_EXTENTS;
+    in->reserved_1 = (uint32_t)nextents;
+    in->reserved_2 = need ? chain[0] : 0;
+    if (!need) memcpy(in->direct, extents, nextents * sizeof(extent_t));
+
+    //Spilled map goes out with the rest of the metadata on commit
+    for (size_t i = 0; i < need; i++) {
+        extent_block_t *eb = (extent_block_t *)fs_block_new(fs, chain[i]);
+        if (!eb) return 1;
+        size_t first = i * EXTENT_BLOCK_MAX;
+        size_t n = nextents - first < EXTENT_BLOCK_MAX ? nextents - first : EXTENT_BLOCK_MAX;
+        eb->magic = EXTENT_MAGIC;
+        eb->count = (uint32_t)n;
+        eb->next = i + 1 < need ? chain[i + 1] : 0;
+        memcpy(eb->ext, extents + first, n * sizeof(extent_t));
+        extent_block_finalize(eb);
+    }
+    fs->sb.flags |= SB_FEAT_EXTENTS;
+    if (need > 1) fs->sb.flags |= SB_FEAT_EXTENT_CHAIN;
+    return 0;
+}
+
+// New file inode of file_size bytes with blocks_needed data blocks mapped
+static int create_file(fs_image_t *fs, const char *file_name, uint64_t file_size, uint64_t blocks_needed,
+                       uint32_t *ino_out, extent_t **extents_out, size_t *nextents_out) {
+    char leaf[NAME_MAX_LEN + 1];
+    fs_dir_t *dir = path_parent(fs, file_name, leaf);
+    if (!dir || dir_check_new(fs, dir, leaf, file_name) != 0) return 1;
+
+    if (fs->inode_bm.nfree == 0) {
+        fprintf(stderr, "No free inodes available\n");
+        return 1;
+    }
+
+    if (fs->data_bm.nfree < blocks_needed) {
+        fprintf(stderr, "Not enough free data blocks\n");
+        return 1;
+    }
+
+    //Inode first, so the data can be placed in the inode's group
+    int64_t free_inode = fs_alloc_inode(fs, blocks_needed);
+    if (free_inode < 0) {
+        fprintf(stderr, "No free inodes available\n");
+        return 1;
+    }
+    uint64_t goal = fs_inode_group(fs, (uint64_t)free_inode);
+
+    //Allocate data blocks as few contiguous runs as possible
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    if (fs_alloc_blocks(fs, goal, blocks_needed, &extents, &nextents) != 0) return 1;
+
+    //Create new file inode
+    inode_t new_inode = {0};
+    new_inode.mode = 0100000;
+    new_inode.links = 1;
+    new_inode.uid = 0;
+    new_inode.gid = 0;
+    new_inode.size_bytes = file_size;
+    new_inode.atime = time(NULL);
+    new_inode.mtime = time(NULL);
+    new_inode.ctime = time(NULL);
+    new_inode.proj_id = PROJECT_ID;
+    new_inode.uid16_gid16 = 0;
+    new_inode.xattr_ptr = 0;
+
+    if (fs_set_extents(fs, &new_inode, extents, nextents, goal) != 0 ||
+        fs_write_inode(fs, (uint32_t)free_inode, &new_inode) != 0) {
+        free(extents);
+        return 1;
+    }
+
+    //Add directory entry in the slot reserved above
+    dir_add(dir, leaf, (uint32_t)free_inode + 1, DIRENT_FILE); // Inodes are 1-indexed
+
+    if (ino_out) *ino_out = (uint32_t)free_inode + 1;
+    *extents_out = extents;
+    *nextents_out = nextents;
+    return 0;
+}
+
+int fs_create_file(fs_image_t *fs, const char *file_name, uint64_t file_size, uint32_t *ino_out,
+                   extent_t **extents_out, size_t *nextents_out) {
+    return create_file(fs, file_name, file_size, (file_size + BS - 1) / BS, ino_out, extents_out, nextents_out);
+}
+
+int fs_write_inline(fs_image_t *fs, const char *file_name, const void *data, uint64_t file_size, uint32_t *ino_out) {
+    if (file_size > INODE_INLINE_MAX) {
+        fprintf(stderr, "%s: %" PRIu64 " bytes do not fit in an inode\n", file_name, file_size);
+        return 1;
+    }
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint32_t ino;
+    if (create_file(fs, file_name, file_size, 0, &ino, &extents, &nextents) != 0) return 1;
+    free(extents);
+
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+    memset(in.direct, 0, sizeof(in.direct));
+    memcpy(in.direct, data, file_size);
+    in.reserved_0 |= INODE_FL_INLINE;
+    if (fs_write_inode(fs, ino - 1, &in) != 0) return 1;
+    fs->sb.flags |= SB_FEAT_INLINE;
+    if (ino_out) *ino_out = ino;
+    return 0;
+}
+
+int fs_create_compressed(fs_image_t *fs, const char *file_name, uint64_t file_size, uint32_t *ino_out,
+                         extent_t **extents_out, size_t *nextents_out) {
+    return create_file(fs, file_name, file_size, fs_compressed_bound(file_size), ino_out, extents_out, nextents_out);
+}
+
+int fs_finish_compressed(fs_image_t *fs, uint32_t ino, const extent_t *extents, size_t nextents,
+                         uint64_t used, int packed) {
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+
+    //Keep the first `used` blocks; the rest were never committed, so they
+    //can be handed straight back
+    extent_t *kept = nextents ? malloc(nextents * sizeof(*kept)) : NULL;
+    if (nextents && !kept) {
+        perror("Failed to allocate extent list");
+        return 1;
+    }
+    size_t nkept = 0;
+    uint64_t left = used;
+    for (size_t e = 0; e < nextents; e++) {
+        uint32_t keep = left < extents[e].len ? (uint32_t)left : extents[e].len;
+        if (keep) kept[nkept++] = (extent_t){ extents[e].start, keep };
+        for (uint32_t j = keep; j < extents[e].len; j++) free_data_block(fs, extents[e].start + j);
+        left -= keep;
+    }
+
+    if (packed) in.reserved_0 |= INODE_FL_COMPRESSED;
+    int rc = fs_set_extents(fs, &in, kept, nkept, fs_inode_group(fs, ino - 1));
+    if (rc == 0) rc = fs_write_inode(fs, ino - 1, &in);
+    if (rc == 0 && packed) fs->sb.flags |= SB_FEAT_COMPRESS;
+    free(kept);
+    return rc;
+}
+
+// Let go of data blocks `from` onwards of a map. A block the dedup index
+// lists loses a reference and goes with its last one; any other is freed.
+// Frees are deferred to the commit, adjacent blocks as one run.
+static int release_data(fs_image_t *fs, const extent_t *extents, size_t nextents, uint64_t from) {
+    int dedup = (fs->sb.flags & SB_FEAT_DEDUP) != 0;
+    if (dedup && fs_dedup_load(fs) != 0) return 1;
+    uint32_t run = 0, len = 0;
+    uint64_t pos = 0;
+    for (size_t e = 0; e < nextents; e++) {
+        for (uint32_t j = 0; j < extents[e].len; j++, pos++) {
+            uint32_t blkno = extents[e].start + j;
+            if (pos < from) continue;
+            dedup_entry_t *de = dedup ? dedup_find_block(fs, blkno) : NULL;
+            if (de) {
+                uint32_t left = de->refs - 1;
+                if (fs_dedup_set_refs(fs, blkno, left) != 0) return 1;
+                if (left) continue;
+            }
+            if (len && run + len == blkno) {
+                len++;
+                continue;
+            }
+            if (len && fs_defer_free(fs, run, len) != 0) return 1;
+            run = blkno;
+            len = 1;
+        }
+    }
+    return len ? fs_defer_free(fs, run, len) : 0;
+}
+
+// Release everything a file inode holds, leaving it with an empty map
+static int release_file(fs_image_t *fs, inode_t *in) {
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    if (fs_inode_map(fs, in, &extents, &nextents) != 0) return 1;
+    int rc = release_data(fs, extents, nextents, 0);
+    free(extents);
+    if (rc != 0) return 1;
+    if (drop_extent_chain(fs, in) != 0) return 1;
+    if ((in->reserved_0 & INODE_FL_CSUM) && fs_drop_checksums(fs, in) != 0) return 1;
+    in->reserved_0 &= ~(INODE_FL_EXTENTS | INODE_FL_COMPRESSED | INODE_FL_INLINE);
+    in->reserved_1 = in->reserved_2 = 0;
+    memset(in->direct, 0, sizeof(in->direct));
+    return 0;
+}
+
+int fs_remove(fs_image_t *fs, const char *path) {
+    char leaf[NAME_MAX_LEN + 1];
+    fs_dir_t *d = path_parent(fs, path, leaf);
+    if (!d) return 1;
+    int64_t slot = fs_dir_slot(d, leaf);
+    if (slot < 0) {
+        fprintf(stderr, "Error: '%s' not found\n", path);
+        return 1;
+    }
+    const dirent64_t *e = (const dirent64_t *)d->ents + slot;
+    if (e->type == DIRENT_DIR) {
+        fprintf(stderr, "Error: '%s' is a directory\n", path);
+        return 1;
+    }
+
+    uint32_t ino = e->ino;
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+    if (in.links > 1) {
+        in.links--;
+        in.ctime = time(NULL);
+    } else {
+        if (release_file(fs, &in) != 0) return 1;
+        memset(&in, 0, sizeof(in));
+        fs_set_inode_used(fs, ino - 1, 0);
+    }
+    if (fs_write_inode(fs, ino - 1, &in) != 0) return 1;
+    fs_unlink_slot(d, (size_t)slot);
+    return 0;
+}
+
+// Start giving file `ino` new contents: read and check its inode and
+// allocate `blocks` blocks for them (*extents, freed by the caller). The
+// file itself is left alone until replace_swap()
+static int replace_begin(fs_image_t *fs, uint32_t ino, uint64_t blocks, inode_t *in,
+                         extent_t **extents, size_t *nextents) {
+    if (fs_read_inode(fs, ino - 1, in) != 0) return 1;
+    if ((in->mode & 0170000) != 0100000) {
+        fprintf(stderr, "Inode %u is not a regular file\n", ino);
+        return 1;
+    }
+    return blocks ? fs_alloc_blocks(fs, fs_inode_group(fs, ino - 1), blocks, extents, nextents) : 0;
+}
+
+// Once the new contents are in their blocks: everything the inode held is
+// let go (freed by the commit that stops using it) and it takes the new
+// size, with an empty map. On failure the new blocks go back and the file
+// is left as it was.
+static int replace_swap(fs_image_t *fs, uint32_t ino, inode_t *in, uint64_t size,
+                        const extent_t *extents, size_t nextents) {
+    inode_t old = *in;
+    size_t deferred = fs->deferred_count;
+    if (release_file(fs, in) != 0) {
+        //Frees it queued before failing would take blocks the file still uses
+        fs->deferred_count = deferred;
+        *in = old;
+        free_runs(fs, extents, nextents);
+        return 1;
+    }
+    in->size_bytes = size;
+    in->mtime = in->ctime = time(NULL);
+    return fs_write_inode(fs, ino - 1, in);
+}
+
+int fs_replace_file(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size) {
+    uint64_t need = size > INODE_INLINE_MAX ? (size + BS - 1) / BS : 0;
+    inode_t in;
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint32_t *sums = NULL;
+    uint8_t data[INODE_INLINE_MAX];
+    int status = 1;
+    if (replace_begin(fs, ino, need, &in, &extents, &nextents) != 0) goto out;
+
+    //The new contents go to fresh blocks; the old ones keep the file's data
+    //until the commit that stops using them frees them
+    if (size > 0 && !need && fs_read_source(src, data, size) != 0) goto out;
+    if (need) {
+        if ((fs->sb.flags & SB_FEAT_DATA_CSUM) && !(sums = malloc(need * sizeof(*sums)))) {
+            perror("Failed to allocate checksum list");
+            free_runs(fs, extents, nextents);
+            goto out;
+        }
+        if (write_file_data(fs, src, size, extents, nextents, sums) != 0) {
+            free_runs(fs, extents, nextents);
+            goto out;
+        }
+    }
+    if (replace_swap(fs, ino, &in, size, extents, nextents) != 0) goto out;
+
+    if (size > 0 && !need) {
+        memcpy(in.direct, data, size);
+        in.reserved_0 |= INODE_FL_INLINE;
+        fs->sb.flags |= SB_FEAT_INLINE;
+    } else if (need && fs_set_extents(fs, &in, extents, nextents, fs_inode_group(fs, ino - 1)) != 0) {
+        goto out;
+    }
+    if (fs_write_inode(fs, ino - 1, &in) != 0) goto out;
+    if (sums && fs_store_checksums(fs, ino, sums, need) != 0) goto out;
+    status = 0;
+
+out:
+    free(extents);
+    free(sums);
+    return status;
+}
+
+// Claim up to `want` free data blocks right after blkno, within its group,
+// so a growing file's last run just gets longer. Returns how many.
+static uint32_t extend_run(fs_image_t *fs, uint32_t blkno, uint64_t want) {
+    uint64_t bit = blkno - fs->sb.data_region_start + 1;
+    group_t *grp = &fs->groups[(bit - 1) / fs->sb.blocks_per_group];
+    if (bit >= grp->data_end || is_bit_set(fs->data_bm.bits, bit)) return 0;
+    uint64_t end = bitmap_scan(&fs->data_bm, bit, 1);
+    if (end > grp->data_end) end = grp->data_end;
+    uint32_t n = (uint32_t)(end - bit < want ? end - bit : want);
+    for (uint32_t i = 1; i <= n; i++) fs_set_block_used(fs, blkno + i, 1);
+    return n;
+}
+
+// A block for the checksum chain of a growing file: the last free one of
+// group `goal`, away from the end of the file where its data continues
+static uint32_t alloc_high_block(fs_image_t *fs, uint64_t goal) {
+    group_t *grp = &fs->groups[goal];
+    for (uint64_t bit = grp->data_end; grp->free_blocks && bit-- > grp->data_start; ) {
+        if (is_bit_set(fs->data_bm.bits, bit)) continue;
+        uint32_t blkno = (uint32_t)(fs->sb.data_region_start + bit);
+        fs_set_block_used(fs, blkno, 1);
+        return blkno;
+    }
+    return alloc_data_block(fs, goal);
+}
+
+// Set the CRCs of data blocks [first, first + count) in the checksum chain
+// of `in`, which covers exactly the blocks before first or first + 1. The
+// last chain block is updated in place and filled up before a new one is
+// linked behind it, so earlier chain blocks are not touched.
+static int extend_checksums(fs_image_t *fs, inode_t *in, uint64_t goal, uint64_t first,
+                            const uint32_t *crcs, uint64_t count) {
+    uint64_t base = 0;
+    uint32_t blkno = (uint32_t)in->xattr_ptr;
+    csum_block_t *cb = NULL;
+    for (uint64_t hops = 0; blkno && hops < fs->sb.data_region_blocks; hops++) {
+        const csum_block_t *cur = load_csum_block(fs, blkno);
+        if (!cur) return 1;
+        uint32_t next = from_le32(cur->next);
+        if (!next) {
+            //Back to host order; finalize converts it again
+            if (!(cb = (csum_block_t *)fs_block_mut(fs, blkno))) return 1;
+            cb->magic = from_le32(cb->magic);
+            cb->count = from_le32(cb->count);
+            for (uint32_t i = 0; i < cb->count; i++) cb->crcs[i] = from_le32(cb->crcs[i]);
+            break;
+        }
+        base += from_le32(cur->count);
+        blkno = next;
+    }
+    if (!cb || first < base || first > base + cb->count) {
+        fprintf(stderr, "Checksum chain does not end at data block %" PRIu64 "\n", first);
+        return 1;
+    }
+
+    uint64_t done = 0;
+    for (;;) {
+        uint64_t at = first + done - base;
+        uint64_t n = count - done < CSUM_BLOCK_MAX - at ? count - done : CSUM_BLOCK_MAX - at;
+        memcpy(cb->crcs + at, crcs + done, n * sizeof(uint32_t));
+        if (at + n > cb->count) cb->count = (uint32_t)(at + n);
+        done += n;
+        if (done == count) break;
+
+        uint32_t next = alloc_high_block(fs, goal);
+        if (!next) {
+            fprintf(stderr, "Not enough free data blocks\n");
+            return 1;
+        }
+        cb->next = next;
+        base += cb->count;
+        csum_block_finalize(cb);
+        if (!(cb = (csum_block_t *)fs_block_new(fs, next))) return 1;
+        cb->magic = CSUM_MAGIC;
+    }
+    csum_block_finalize(cb);
+    return 0;
+}
+
+// Append to a compressed file. Chunks are compressed on their own, so the
+// whole chunks before the old end of file stay where they are and only the
+// last, partial one is compressed again with the new bytes behind it. The
+// new chunks, the index and the trailer go to new blocks after the ones the
+// kept chunks fill, starting with a copy of the block they end in, so no
+// block the file uses is written before fs_commit(). The file stays
+// compressed even if the new chunks do not shrink.
+static int append_compressed(fs_image_t *fs, uint32_t ino, inode_t *in, FILE *src, uint64_t len) {
+    uint64_t old_size = in->size_bytes, size = old_size + len;
+    uint64_t full = old_size / CZ_CHUNK, nchunks = (size + CZ_CHUNK - 1) / CZ_CHUNK;
+    uint64_t goal = fs_inode_group(fs, ino - 1);
+    stored_reader_t r = { .fs = fs, .in = in };
+    extent_t *fresh = NULL, *all = NULL;
+    size_t nfresh = 0, nall = 0;
+    uint64_t *index = malloc(nchunks * sizeof(*index));
+    uint8_t *raw = malloc(CZ_CHUNK), *comp = malloc(CZ_CHUNK), *head = malloc(BS);
+    uint32_t *sums = NULL;
+    stream_t st = { .fd = fileno(fs->img), .cap = 64 * BS };
+    size_t deferred = fs->deferred_count;
+    int status = 1;
+    st.buf = malloc(st.cap);
+    if (!index || !raw || !comp || !head || !st.buf) {
+        perror("Failed to allocate compression buffers");
+        goto out;
+    }
+    if (fs_inode_map(fs, in, (extent_t **)&r.extents, &r.nextents) != 0) goto out;
+    uint64_t stored = 0;
+    for (size_t e = 0; e < r.nextents; e++) stored += r.extents[e].len;
+    r.csum_count = stored;
+
+    //Where the kept chunks end, from the trailer and index
+    cz_trailer_t tr;
+    uint64_t old_chunks = (old_size + CZ_CHUNK - 1) / CZ_CHUNK;
+    if (stored * BS < sizeof(tr) + old_chunks * sizeof(uint64_t) ||
+        read_stored(&r, stored * BS - sizeof(tr), sizeof(tr), (uint8_t *)&tr) != 0)
+        goto out;
+    if (from_le32(tr.magic) != CZ_MAGIC || from_le32(tr.chunk_size) != CZ_CHUNK || from_le64(tr.nchunks) != old_chunks) {
+        fprintf(stderr, "Inode %u: corrupt compressed file trailer\n", ino);
+        goto out;
+    }
+    uint64_t index_off = stored * BS - sizeof(tr) - old_chunks * sizeof(uint64_t);
+    if (full && read_stored(&r, index_off, full * sizeof(uint64_t), (uint8_t *)index) != 0) goto out;
+    uint64_t end = full ? from_le64(index[full - 1]) : 0;
+    uint64_t kept = end / BS, tail = old_size - full * CZ_CHUNK;
+    if (end > index_off) {
+        fprintf(stderr, "Inode %u: corrupt index entry for chunk %" PRIu64 "\n", ino, full - 1);
+        goto out;
+    }
+    if (read_stored(&r, kept * BS, end % BS, head) != 0) goto out;
+    if (tail && read_compressed(&r, ino, full * CZ_CHUNK, tail, raw) != 0) goto out;
+
+    //Room for the rest stored as is; what the stream does not use is
+    //handed straight back, it was never committed
+    uint64_t bound = stream_blocks(end + (size - full * CZ_CHUNK), nchunks) - kept;
+    if (fs_alloc_blocks(fs, goal, bound, &fresh, &nfresh) != 0) goto out;
+    if ((in->reserved_0 & INODE_FL_CSUM) && !(sums = malloc((kept + bound) * sizeof(*sums)))) {
+        perror("Failed to allocate checksum list");
+        goto out;
+    }
+    st.extents = fresh;
+    st.nextents = nfresh;
+    st.sums.out = sums ? sums + kept : NULL;
+    if (fflush(fs->img) != 0) {
+        perror("Failed to flush image");
+        goto out;
+    }
+
+    //Stream offsets count from the start of the file's first block
+    if (stream_put(&st, head, end % BS) != 0) goto out;
+    for (uint64_t c = full; c < nchunks; c++) {
+        size_t n = size - c * CZ_CHUNK < CZ_CHUNK ? (size_t)(size - c * CZ_CHUNK) : CZ_CHUNK;
+        size_t have = c == full ? (size_t)tail : 0;
+        if (fread(raw + have, 1, n - have, src) != n - have) {
+            fprintf(stderr, "Failed to read %" PRIu64 " bytes to append\n", len);
+            goto out;
+        }
+        size_t clen = lz_compress(raw, n, comp, n - 1, LZ_ACCEL_DEFAULT);
+        if (stream_put(&st, clen ? comp : raw, clen ? clen : n) != 0) goto out;
+        index[c] = to_le64(kept * BS + st.pos);
+    }
+    uint64_t used = stream_blocks(kept * BS + st.pos, nchunks);
+    tr.nchunks = to_le64(nchunks);
+    if (stream_put(&st, NULL, used * BS - kept * BS - st.pos - nchunks * sizeof(uint64_t) - sizeof(tr)) != 0 ||
+        stream_put(&st, index, nchunks * sizeof(uint64_t)) != 0 || stream_put(&st, &tr, sizeof(tr)) != 0 ||
+        stream_flush(&st) != 0)
+        goto out;
+
+    //New map: the kept blocks, then the new ones the stream filled
+    if (!(all = malloc((r.nextents + nfresh) * sizeof(*all)))) {
+        perror("Failed to allocate extent list");
+        goto out;
+    }
+    for (size_t e = 0, pos = 0; e < r.nextents && pos < kept; pos += r.extents[e++].len)
+        all[nall++] = (extent_t){ r.extents[e].start,
+                                  kept - pos < r.extents[e].len ? (uint32_t)(kept - pos) : r.extents[e].len };
+    uint64_t left = used - kept;
+    for (size_t e = 0; e < nfresh; e++) {
+        uint32_t take = left < fresh[e].len ? (uint32_t)left : fresh[e].len;
+        for (uint32_t j = take; j < fresh[e].len; j++) free_data_block(fs, fresh[e].start + j);
+        fresh[e].len = take;
+        left -= take;
+        if (!take) continue;
+        if (nall && all[nall - 1].start + all[nall - 1].len == fresh[e].start) all[nall - 1].len += take;
+        else all[nall++] = (extent_t){ fresh[e].start, take };
+    }
+
+    if (sums && kept && fs_load_checksums(fs, in, 0, kept, sums) != 0) goto out;
+    if (release_data(fs, r.extents, r.nextents, kept) != 0 || fs_set_extents(fs, in, all, nall, goal) != 0) goto out;
+    in->size_bytes = size;
+    in->mtime = in->ctime = time(NULL);
+    if (fs_write_inode(fs, ino - 1, in) != 0) goto out;
+    //The chain is rebuilt whole: the stream's end moved, so its tail CRCs change
+    if (sums && fs_store_checksums(fs, ino, sums, used) != 0) goto out;
+    status = 0;
+
+out:
+    if (status != 0) {
+        free_runs(fs, fresh, nfresh);
+        fs->deferred_count = deferred;
+    }
+    free((extent_t *)r.extents);
+    free(r.block);
+    free(r.crcs);
+    free(fresh);
+    free(all);
+    free(index);
+    free(raw);
+    free(comp);
+    free(head);
+    free(sums);
+    free(st.buf);
+    return status;
+}
+
+// Append by rewriting: the file's contents and the new bytes go through a
+// temporary file into fs_replace_file(), for inline data that outgrows the
+// inode
+static int append_rewrite(fs_image_t *fs, uint32_t ino, uint64_t old_size, FILE *src, uint64_t len) {
+    FILE *tmp = tmpfile();
+    uint8_t *buf = malloc(CZ_CHUNK);
+    int status = 1;
+    if (!tmp || !buf) {
+        perror("Failed to stage appended file");
+        goto out;
+    }
+    for (uint64_t off = 0, got; off < old_size; off += got) {
+        uint64_t want = old_size - off < CZ_CHUNK ? old_size - off : CZ_CHUNK;
+        if (fs_read_file(fs, ino, buf, off, want, &got) != 0 || got == 0) goto out;
+        if (fwrite(buf, 1, got, tmp) != got) {
+            perror("Failed to stage appended file");
+            goto out;
+        }
+    }
+    for (uint64_t left = len; left > 0; ) {
+        size_t n = fread(buf, 1, left < CZ_CHUNK ? (size_t)left : CZ_CHUNK, src);
+        if (n == 0) {
+            fprintf(stderr, "Failed to read %" PRIu64 " bytes to append\n", len);
+            goto out;
+        }
+        if (fwrite(buf, 1, n, tmp) != n) {
+            perror("Failed to stage appended file");
+            goto out;
+        }
+        left -= n;
+    }
+    if (fflush(tmp) != 0 || fseek(tmp, 0, SEEK_SET) != 0) {
+        perror("Failed to stage appended file");
+        goto out;
+    }
+    status = fs_replace_file(fs, ino, tmp, old_size + len);
+
+out:
+    if (tmp) fclose(tmp);
+    free(buf);
+    return status;
+}
+
+int fs_append_file(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t len) {
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0) return 1;
+    if ((in.mode & 0170000) != 0100000) {
+        fprintf(stderr, "Inode %u is not a regular file\n", ino);
+        return 1;
+    }
+    uint64_t old_size = in.size_bytes, size = old_size + len;
+    if (len == 0) return 0;
+    if (old_size == 0) return fs_replace_file(fs, ino, src, len);
+
+    //Inline data that still fits grows inside the inode
+    if ((in.reserved_0 & INODE_FL_INLINE) && size <= INODE_INLINE_MAX) {
+        if (fread((uint8_t *)in.direct + old_size, 1, len, src) != len) {
+            fprintf(stderr, "Failed to read %" PRIu64 " bytes to append\n", len);
+            return 1;
+        }
+        in.size_bytes = size;
+        in.mtime = in.ctime = time(NULL);
+        return fs_write_inode(fs, ino - 1, &in);
+    }
+    if (in.reserved_0 & INODE_FL_INLINE) return append_rewrite(fs, ino, old_size, src, len);
+    if (in.reserved_0 & INODE_FL_COMPRESSED) return append_compressed(fs, ino, &in, src, len);
+
+    extent_t *map = NULL, *fresh = NULL, *all = NULL;
+    size_t nmap = 0, nfresh = 0, nall = 0;
+    uint32_t *sums = NULL;
+    uint8_t *tail_buf = NULL;
+    uint32_t moved_to = 0;
+    size_t deferred = fs->deferred_count;
+    int status = 1;
+    if (fs_inode_map(fs, &in, &map, &nmap) != 0) return 1;
+
+    //The last block is refilled where it is, unless dedup shares it, in
+    //which case its bytes move to a new block with the appended ones
+    uint64_t nblocks = (old_size + BS - 1) / BS, tail = old_size % BS;
+    uint32_t last = 0;
+    for (size_t e = 0, pos = 0; e < nmap && !last; pos += map[e++].len)
+        if (nblocks - 1 < pos + map[e].len) last = map[e].start + (uint32_t)(nblocks - 1 - pos);
+    if (!last) {
+        fprintf(stderr, "Inode %u maps fewer blocks than its size needs\n", ino);
+        goto out;
+    }
+    int moved = 0;
+    if (tail && (fs->sb.flags & SB_FEAT_DEDUP)) {
+        if (fs_dedup_load(fs) != 0) goto out;
+        moved = dedup_find_block(fs, last) != NULL;
+    }
+    uint64_t kept = moved ? nblocks - 1 : nblocks;
+    uint64_t fill = tail ? (BS - tail < len ? BS - tail : len) : 0;
+    uint64_t need = (size + BS - 1) / BS - kept;
+    uint64_t first = tail ? nblocks - 1 : nblocks; // first block whose CRC changes
+    uint64_t goal = (last - fs->sb.data_region_start) / fs->sb.blocks_per_group;
+
+    //New blocks continue the last run where the blocks after it are free
+    if (need) {
+        if (fs->data_bm.nfree < need) {
+            fprintf(stderr, "Not enough free data blocks\n");
+            goto out;
+        }
+        uint32_t ext = extend_run(fs, last, need);
+        extent_t grown = { last + 1, ext }, *rest = NULL;
+        size_t nrest = 0;
+        if (ext < need && fs_alloc_blocks(fs, goal, need - ext, &rest, &nrest) != 0) {
+            free_runs(fs, &grown, 1);
+            goto out;
+        }
+        if (!(fresh = malloc((nrest + 1) * sizeof(*fresh)))) {
+            perror("Failed to allocate extent list");
+            free_runs(fs, &grown, 1);
+            free_runs(fs, rest, nrest);
+            free(rest);
+            goto out;
+        }
+        if (ext) fresh[nfresh++] = (extent_t){ last + 1, ext };
+        if (nrest) memcpy(fresh + nfresh, rest, nrest * sizeof(*rest));
+        nfresh += nrest;
+        free(rest);
+    }
+
+    //New map: the blocks kept, then the new ones, adjacent runs merged
+    if (!(all = malloc((nmap + nfresh) * sizeof(*all)))) {
+        perror("Failed to allocate extent list");
+        goto out;
+    }
+    for (size_t e = 0, pos = 0; e < nmap && pos < kept; pos += map[e++].len)
+        all[nall++] = (extent_t){ map[e].start, kept - pos < map[e].len ? (uint32_t)(kept - pos) : map[e].len };
+    for (size_t e = 0; e < nfresh; e++) {
+        if (nall && all[nall - 1].start + all[nall - 1].len == fresh[e].start) all[nall - 1].len += fresh[e].len;
+        else all[nall++] = fresh[e];
+    }
+
+    if ((in.reserved_0 & INODE_FL_CSUM) && !(sums = malloc((kept + need - first) * sizeof(*sums)))) {
+        perror("Failed to allocate checksum list");
+        goto out;
+    }
+    if (tail) {
+        //Old tail bytes, then as much of the new data as fits, merged in a
+        //private buffer that only goes into the block cache once the rest
+        //has been written
+        const uint8_t *old = fs_block(fs, last);
+        if (!old) goto out;
+        if (!(tail_buf = malloc(BS))) {
+            perror("Failed to allocate file buffer");
+            goto out;
+        }
+        memcpy(tail_buf, old, tail);
+        memset(tail_buf + tail, 0, BS - tail);
+        if (fread(tail_buf + tail, 1, fill, src) != fill) {
+            fprintf(stderr, "Failed to read %" PRIu64 " bytes to append\n", len);
+            goto out;
+        }
+        if (sums) sums[0] = crc32(tail_buf, BS);
+        if (moved) {
+            moved_to = fresh[0].start++;
+            if (--fresh[0].len == 0) memmove(fresh, fresh + 1, --nfresh * sizeof(*fresh));
+        }
+    }
+    if (nfresh && write_file_data(fs, src, len - fill, fresh, nfresh, sums ? sums + (tail ? 1 : 0) : NULL) != 0)
+        goto out;
+
+    if (nmap && release_data(fs, map, nmap, kept) != 0) goto out;
+    if (fs_set_extents(fs, &in, all, nall, goal) != 0) goto out;
+    if (sums && extend_checksums(fs, &in, goal, first, sums, kept + need - first) != 0) goto out;
+
+    //Like the metadata, the merged block reaches the image (through the
+    //journal in place) only at fs_commit(), so the old last block and its
+    //checksum hold until then
+    if (tail) {
+        uint8_t *dst = moved ? fs_block_new(fs, moved_to) : fs_block_mut(fs, last);
+        if (!dst) goto out;
+        memcpy(dst, tail_buf, BS);
+    }
+    in.size_bytes = size;
+    in.mtime = in.ctime = time(NULL);
+    status = fs_write_inode(fs, ino - 1, &in);
+
+out:
+    if (status != 0) {
+        //Nothing new is kept: the claimed blocks go back and the old ones
+        //stay in use
+        free_runs(fs, fresh, nfresh);
+        if (moved_to) free_data_block(fs, moved_to);
+        fs->deferred_count = deferred;
+    }
+    free(map);
+    free(fresh);
+    free(all);
+    free(sums);
+    free(tail_buf);
+    return status;
+}
+
+// Descriptor and position of a source read with pread, with the image's
+// stdio buffer flushed since block-level writes bypass it
+static int pread_source(fs_image_t *fs, const char *file_name, FILE *src, int *fd, off_t *pos) {
+    *fd = fileno(src);
+    *pos = ftello(src);
+    if (*fd < 0 || *pos < 0) {
+        fprintf(stderr, "%s: not a seekable file\n", file_name);
+        return 1;
+    }
+    if (fflush(fs->img) != 0) {
+        perror("Failed to flush image");
+        return 1;
+    }
+    return 0;
+}
+
+// Compress file_size bytes of in_fd into the fs_compressed_bound() blocks
+// of extents and make them the map of inode `ino`, which holds none yet.
+// With `old`, ino is a file being replaced: it is swapped over only once
+// the data is written, and until then a failure hands the blocks back.
+static int compress_file(fs_image_t *fs, uint32_t ino, int in_fd, off_t src_pos, uint64_t file_size,
+                         const extent_t *extents, size_t nextents, inode_t *old) {
+    uint64_t bound = fs_compressed_bound(file_size), used = 0;
+    int packed = 0;
+    uint32_t *sums = NULL;
+    int rc = 1;
+    if ((fs->sb.flags & SB_FEAT_DATA_CSUM) && bound && !(sums = malloc(bound * sizeof(*sums))))
+        perror("Failed to allocate checksum list");
+    else
+        rc = compress_into_extents(fileno(fs->img), in_fd, (uint64_t)src_pos, file_size, extents, nextents,
+                                   &used, &packed, NULL, sums);
+    if (old) {
+        if (rc != 0) free_runs(fs, extents, nextents);
+        else rc = replace_swap(fs, ino, old, file_size, extents, nextents);
+    }
+    if (rc == 0) rc = fs_finish_compressed(fs, ino, extents, nextents, used, packed);
+    if (rc == 0 && sums) rc = fs_store_checksums(fs, ino, sums, used);
+    free(sums);
+    return rc;
+}
+
+int fs_write_file_compressed(fs_image_t *fs, const char *file_name, FILE *src, uint64_t file_size, uint32_t *ino_out) {
+    if (file_size <= INODE_INLINE_MAX) return fs_write_file(fs, file_name, src, file_size, ino_out);
+    int in_fd;
+    off_t src_pos;
+    if (pread_source(fs, file_name, src, &in_fd, &src_pos) != 0) return 1;
+
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint32_t ino;
+    if (fs_create_compressed(fs, file_name, file_size, &ino, &extents, &nextents) != 0) return 1;
+    if (ino_out) *ino_out = ino;
+    int rc = compress_file(fs, ino, in_fd, src_pos, file_size, extents, nextents, NULL);
+    free(extents);
+    return rc;
+}
+
+int fs_replace_compressed(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size) {
+    if (size <= INODE_INLINE_MAX) return fs_replace_file(fs, ino, src, size);
+    char name[32];
+    snprintf(name, sizeof(name), "Inode %u", ino);
+    int in_fd;
+    off_t src_pos;
+    if (pread_source(fs, name, src, &in_fd, &src_pos) != 0) return 1;
+
+    inode_t in;
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    int rc = replace_begin(fs, ino, fs_compressed_bound(size), &in, &extents, &nextents);
+    if (rc == 0) rc = compress_file(fs, ino, in_fd, src_pos, size, extents, nextents, &in);
+    free(extents);
+    return rc;
+}
+
+// Unique blocks waiting to be written: adjacent both in the image and in
+// the read buffer, so each run goes out with one pwrite
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    const uint8_t *data;
+} pending_run_t;
+
+static int flush_run(int img_fd, pending_run_t *run) {
+    for (ssize_t w, off = 0; off < (ssize_t)run->len * BS; off += w) {
+        w = pwrite(img_fd, run->data + off, (size_t)run->len * BS - (size_t)off, (off_t)run->start * BS + off);
+        if (w < 0 && errno == EINTR) w = 0;
+        else if (w < 0) {
+            perror("Failed to write file data");
+            return 1;
+        }
+    }
+    run->len = 0;
+    return 0;
+}
+
+// Indexed block with the same contents as p, 0 when there is none. A block
+// still waiting in `run` is compared in memory, anything else is read back.
+static uint32_t dedup_match(fs_image_t *fs, uint64_t hash, const uint8_t *p, const pending_run_t *run, uint8_t *tmp) {
+    for (size_t h = dedup_slot_of(hash, fs->dedup_cap); fs->dedup_by_hash[h]; h = (h + 1) & (fs->dedup_cap - 1)) {
+        dedup_entry_t *e = &fs->dedup[fs->dedup_by_hash[h] - 1];
+        if (e->hash != hash || !e->refs || e->refs == UINT32_MAX) continue;
+        const uint8_t *have = tmp;
+        if (e->blkno >= run->start && e->blkno < run->start + run->len)
+            have = run->data + (uint64_t)(e->blkno - run->start) * BS;
+        else if (read_data(fileno(fs->img), tmp, BS, (uint64_t)e->blkno * BS) != 0)
+            continue;
+        if (memcmp(have, p, BS) == 0) return e->blkno;
+    }
+    return 0;
+}
+
+// Write file_size bytes of in_fd through the dedup index into the blocks
+// of extents, one per data block, and make the blocks kept and the shared
+// ones the map of inode `ino`, which holds none yet. With `old`, ino is a
+// file being replaced: it is swapped over only once the data is written,
+// and until then a failure undoes the index changes and hands the blocks
+// back.
+static int dedup_file(fs_image_t *fs, uint32_t ino, int in_fd, off_t src_pos, uint64_t file_size,
+                      const extent_t *extents, size_t nextents, uint64_t *shared_out, inode_t *old) {
+    uint64_t blocks = (file_size + BS - 1) / BS;
+    size_t batch = 64;
+    uint32_t *map = malloc(blocks * sizeof(*map));
+    uint32_t *sums = (fs->sb.flags & SB_FEAT_DATA_CSUM) ? malloc(blocks * sizeof(*sums)) : NULL;
+    uint8_t *buf = malloc(batch * BS), *tmp = malloc(BS);
+    extent_t *kept = NULL;
+    int status = 1;
+    if (!map || ((fs->sb.flags & SB_FEAT_DATA_CSUM) && !sums) || !buf || !tmp) {
+        perror("Failed to allocate dedup buffers");
+        goto out;
+    }
+
+    //Shared blocks split the map into runs; stop sharing before it could
+    //outgrow the extent chain
+    size_t runs = 0, max_runs = nextents + 1 < EXTENT_MAP_MAX ? EXTENT_MAP_MAX - nextents - 1 : 0;
+    size_t e = 0;
+    uint32_t j = 0;
+    uint64_t done = 0; // blocks already counted in the index
+    pending_run_t run = { 0 };
+    for (uint64_t first = 0; first < blocks; first += batch) {
+        uint64_t nb = blocks - first < batch ? blocks - first : batch;
+        uint64_t want = file_size - first * BS < nb * BS ? file_size - first * BS : nb * BS, got = 0;
+        while (got < want) {
+            ssize_t r = pread(in_fd, buf + got, want - got, src_pos + (off_t)(first * BS + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r < 0) perror("Failed to read file");
+                else fprintf(stderr, "File shrank while being added\n");
+                goto undo;
+            }
+            got += (uint64_t)r;
+        }
+        memset(buf + got, 0, nb * BS - got);
+
+        for (uint64_t k = 0; k < nb; k++) {
+            uint64_t i = first + k;
+            const uint8_t *p = buf + k * BS;
+            uint32_t own = extents[e].start + j;
+            if (++j == extents[e].len) {
+                e++;
+                j = 0;
+            }
+            if (sums) sums[i] = crc32(p, BS);
+
+            uint64_t hash = block_hash(p);
+            uint32_t hit = runs < max_runs ? dedup_match(fs, hash, p, &run, tmp) : 0;
+            if (hit) {
+                dedup_find_block(fs, hit)->refs++;
+                fs->dedup_dirty = 1;
+                map[i] = hit;
+                (*shared_out)++;
+            } else {
+                if (run.len && (own != run.start + run.len || p != run.data + (uint64_t)run.len * BS) &&
+                    flush_run(fileno(fs->img), &run) != 0) goto undo;
+                if (!run.len) {
+                    run.start = own;
+                    run.data = p;
+                }
+                run.len++;
+                if (dedup_add(fs, hash, own) != 0) goto undo;
+                map[i] = own;
+            }
+            done = i + 1;
+            if (i == 0 || map[i] != map[i - 1] + 1) runs++;
+        }
+        if (run.len && flush_run(fileno(fs->img), &run) != 0) goto undo;
+    }
+    if (old && replace_swap(fs, ino, old, file_size, NULL, 0) != 0) goto undo;
+
+    //Allocated blocks a shared one stands in for were never committed
+    kept = malloc((runs ? runs : 1) * sizeof(*kept));
+    if (!kept) {
+        perror("Failed to allocate extent list");
+        goto out;
+    }
+    size_t nkept = 0;
+    e = 0;
+    j = 0;
+    for (uint64_t i = 0; i < blocks; i++) {
+        uint32_t own = extents[e].start + j;
+        if (++j == extents[e].len) {
+            e++;
+            j = 0;
+        }
+        if (map[i] != own) free_data_block(fs, own);
+        if (nkept && kept[nkept - 1].start + kept[nkept - 1].len == map[i]) kept[nkept - 1].len++;
+        else kept[nkept++] = (extent_t){ map[i], 1 };
+    }
+
+    inode_t in;
+    if (fs_read_inode(fs, ino - 1, &in) != 0 ||
+        fs_set_extents(fs, &in, kept, nkept, fs_inode_group(fs, ino - 1)) != 0 ||
+        fs_write_inode(fs, ino - 1, &in) != 0) goto out;
+    if (sums && fs_store_checksums(fs, ino, sums, blocks) != 0) goto out;
+    fs->sb.flags |= SB_FEAT_DEDUP;
+    status = 0;
+    goto out;
+
+undo:
+    //Newest first, so the file's own entries lose the references it added
+    //to them before they are dropped
+    for (uint64_t i = done; i-- > 0; ) {
+        uint32_t own = 0;
+        for (size_t x = 0, base = 0; x < nextents; base += extents[x++].len)
+            if (i < base + extents[x].len) {
+                own = extents[x].start + (uint32_t)(i - base);
+                break;
+            }
+        if (map[i] != own) dedup_find_block(fs, map[i])->refs--;
+        else fs_dedup_set_refs(fs, own, 0);
+    }
+    fs->dedup_dirty = 1;
+    if (old) free_runs(fs, extents, nextents);
+
+out:
+    free(map);
+    free(sums);
+    free(buf);
+    free(tmp);
+    free(kept);
+    return status;
+}
+
+int fs_write_file_dedup(fs_image_t *fs, const char *file_name, FILE *src, uint64_t file_size, uint32_t *ino_out,
+                        uint64_t *shared_out) {
+    *shared_out = 0;
+    if (file_size <= INODE_INLINE_MAX) return fs_write_file(fs, file_name, src, file_size, ino_out);
+    int in_fd;
+    off_t src_pos;
+    if (pread_source(fs, file_name, src, &in_fd, &src_pos) != 0 || fs_dedup_load(fs) != 0) return 1;
+
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint32_t ino;
+    if (create_file(fs, file_name, file_size, (file_size + BS - 1) / BS, &ino, &extents, &nextents) != 0) return 1;
+    if (ino_out) *ino_out = ino;
+    int rc = dedup_file(fs, ino, in_fd, src_pos, file_size, extents, nextents, shared_out, NULL);
+    free(extents);
+    return rc;
+}
+
+int fs_replace_dedup(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size, uint64_t *shared_out) {
+    *shared_out = 0;
+    if (size <= INODE_INLINE_MAX) return fs_replace_file(fs, ino, src, size);
+    char name[32];
+    snprintf(name, sizeof(name), "Inode %u", ino);
+    int in_fd;
+    off_t src_pos;
+    if (pread_source(fs, name, src, &in_fd, &src_pos) != 0 || fs_dedup_load(fs) != 0) return 1;
+
+    inode_t in;
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    int rc = replace_begin(fs, ino, (size + BS - 1) / BS, &in, &extents, &nextents);
+    if (rc == 0) rc = dedup_file(fs, ino, in_fd, src_pos, size, extents, nextents, shared_out, &in);
+    free(extents);
+    return rc;
+}
+
+// A metadata block staged for commit
+typedef struct {
+    uint64_t blkno;
+    uint8_t data[BS];
+} meta_block_t;
+
+// Commit record closing a journal; only a journal with a valid trailer is replayed
+#define JOURNAL_MAGIC 0x4D564A4Cu // 'MVJL'
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;
+    uint32_t pad;
+} journal_trailer_t;
+#pragma pack(pop)
+
+static int cmp_entry_blkno(const void *a, const void *b) {
+    uint64_t x = (*(const cache_entry_t *const *)a)->blkno;
+    uint64_t y = (*(const cache_entry_t *const *)b)->blkno;
+    return x < y ? -1 : x > y;
+}
+
+// Changed blocks of a directory, entries back in disk byte order
+static void stage_dir(const fs_dir_t *d, meta_block_t *blocks, size_t *n) {
+    for (uint32_t b = 0; b < d->nblocks; b++) {
+        if (!d->dirty[b]) continue;
+        blocks[*n].blkno = d->blknos[b];
+        memcpy(blocks[*n].data, d->ents + (size_t)b * BS, BS);
+        dirent64_t *entries = (dirent64_t *)blocks[(*n)++].data;
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].ino == 0) continue;
+            dirent_to_disk(&entries[i]);
+            dirent_checksum_finalize(&entries[i]);
+        }
+    }
+}
+
+// Collect every modified metadata block in commit order: cached inode table
+// and extent blocks, group descriptors, bitmaps, directories and finally
+// the superblock
+static int collect_metadata(fs_image_t *fs, meta_block_t **out, size_t *count) {
+    if (fs_write_inode(fs, 0, &fs->root.inode) != 0) return 1;
+    for (size_t i = 0; i < fs->dirs_cap; i++) {
+        const fs_dir_t *d = fs->dirs[i];
+        if (d && d->inode_dirty && fs_write_inode(fs, d->ino - 1, &d->inode) != 0) return 1;
+    }
+    if (dedup_flush(fs) != 0) return 1;
+
+    //Blocks dropped by this batch become free in the same commit
+    for (size_t i = 0; i < fs->deferred_count; i++)
+        for (uint32_t j = 0; j < fs->deferred_free[i].len; j++)
+            free_data_block(fs, fs->deferred_free[i].start + j);
+    fs->deferred_count = 0;
+
+    //Re-encode changed group descriptors
+    uint8_t *gdt_dirty = NULL;
+    if (fs->gdt) {
+        gdt_dirty = calloc(fs->sb.group_desc_blocks, 1);
+        if (!gdt_dirty) {
+            perror("Failed to allocate commit set");
+            return 1;
+        }
+        for (uint64_t g = 0; g < fs->sb.group_count; g++) {
+            if (!fs->group_dirty[g]) continue;
+            group_desc_t *gd = (group_desc_t *)fs->gdt + g;
+            gd->free_blocks = to_le32((uint32_t)fs->groups[g].free_blocks);
+            gd->free_inodes = to_le32((uint32_t)fs->groups[g].free_inodes);
+            gd->checksum = crc32(gd, offsetof(group_desc_t, checksum));
+            gdt_dirty[g / GROUP_DESCS_PER_BLOCK] = 1;
+        }
+    }
+
+    //Dirty cached blocks, in block order
+    size_t ncached = 0;
+    for (size_t i = 0; i < fs->cache_cap; i++) ncached += fs->cache[i].data && fs->cache[i].dirty;
+    cache_entry_t **cached = malloc((ncached ? ncached : 1) * sizeof(*cached));
+    if (!cached) {
+        perror("Failed to allocate commit set");
+        free(gdt_dirty);
+        return 1;
+    }
+    ncached = 0;
+    for (size_t i = 0; i < fs->cache_cap; i++)
+        if (fs->cache[i].data && fs->cache[i].dirty) cached[ncached++] = &fs->cache[i];
+    qsort(cached, ncached, sizeof(*cached), cmp_entry_blkno);
+
+    size_t cap = fs->root.nblocks + 1 + ncached;
+    for (size_t i = 0; i < fs->dirs_cap; i++)
+        if (fs->dirs[i]) cap += fs->dirs[i]->nblocks;
+    for (uint64_t b = 0; gdt_dirty && b < fs->sb.group_desc_blocks; b++) cap += gdt_dirty[b];
+    for (uint64_t b = 0; b < fs->inode_bm.nblocks; b++) cap += fs->inode_bm.dirty[b];
+    for (uint64_t b = 0; b < fs->data_bm.nblocks; b++) cap += fs->data_bm.dirty[b];
+    meta_block_t *blocks = calloc(cap, sizeof(*blocks));
+    if (!blocks) {
+        perror("Failed to allocate commit set");
+        free(gdt_dirty);
+        free(cached);
+        return 1;
+    }
+    size_t n = 0;
+
+    for (size_t i = 0; i < ncached; i++) {
+        blocks[n].blkno = cached[i]->blkno;
+        memcpy(blocks[n++].data, cached[i]->data, BS);
+    }
+    free(cached);
+
+    for (uint64_t b = 0; gdt_dirty && b < fs->sb.group_desc_blocks; b++) {
+        if (!gdt_dirty[b]) continue;
+        blocks[n].blkno = fs->sb.group_desc_start + b;
+        memcpy(blocks[n++].data, fs->gdt + b * BS, BS);
+    }
+    free(gdt_dirty);
+
+    //Only bitmap blocks that changed
+    for (uint64_t b = 0; b < fs->inode_bm.nblocks; b++) {
+        if (!fs->inode_bm.dirty[b]) continue;
+        blocks[n].blkno = fs->sb.inode_bitmap_start + b;
+        memcpy(blocks[n++].data, fs->inode_bm.bits + b * BS, BS);
+    }
+    for (uint64_t b = 0; b < fs->data_bm.nblocks; b++) {
+        if (!fs->data_bm.dirty[b]) continue;
+        blocks[n].blkno = fs->sb.data_bitmap_start + b;
+        memcpy(blocks[n++].data, fs->data_bm.bits + b * BS, BS);
+    }
+
+    stage_dir(&fs->root, blocks, &n);
+    for (size_t i = 0; i < fs->dirs_cap; i++)
+        if (fs->dirs[i]) stage_dir(fs->dirs[i], blocks, &n);
+
+    //Update superblock checksum after all modifications
+    superblock_t sb = fs->sb;
+    sb.mtime_epoch = time(NULL);
+    if (!(sb.flags & SB_FEAT_GROUPS)) {
+        //In-memory grouping of an older image is not persisted
+        sb.group_count = sb.blocks_per_group = sb.inodes_per_group = 0;
+    }
+    if (sb.flags & SB_FEAT_FREE_COUNTS) {
+        sb.free_blocks = fs->data_bm.nfree;
+        sb.free_inodes = fs->inode_bm.nfree;
+    }
+    superblock_to_disk(&sb);
+    superblock_crc_finalize(&sb);
+    blocks[n].blkno = 0;
+    memcpy(blocks[n++].data, &sb, sizeof(sb));
+
+    *out = blocks;
+    *count = n;
+    return 0;
+}
+
+// Write staged metadata blocks to their home locations as one batch. The
+// superblock goes last, behind an fsync of everything before it, and is
+// itself synced, so a superblock on disk never describes missing blocks.
+static int write_metadata(blkio_t *io, const meta_block_t *blocks, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        if (blocks[i].blkno != 0) blkio_write(io, blocks[i].data, BS, blocks[i].blkno * BS);
+    for (size_t i = 0; i < count; i++)
+        if (blocks[i].blkno == 0) blkio_write_ordered(io, blocks[i].data, BS, 0);
+    if (blkio_wait(io) != 0) {
+        perror("Failed to write metadata");
+        return 1;
+    }
+    return 0;
+}
+
+// Flush stdio buffers and force the file to stable storage
+static int sync_file(FILE *f) {
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror("Failed to sync");
+        return 1;
+    }
+    return 0;
+}
+
+// Force the directory entry of a newly created file to stable storage by
+// syncing the directory that holds it
+static int sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (slash == path ? 1 : (size_t)(slash - path)) : 1;
+    char *dir = malloc(len + 1);
+    if (!dir) {
+        perror("Failed to sync journal directory");
+        return 1;
+    }
+    memcpy(dir, slash ? path : ".", len);
+    dir[len] = '\0';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    int rc = fd < 0 || fsync(fd) != 0;
+    if (rc) perror("Failed to sync journal directory");
+    if (fd >= 0) close(fd);
+    free(dir);
+    return rc;
+}
+
+// Write the shadow copy of all metadata blocks followed by its commit
+// record. Its directory is synced too, so that after a crash during the
+// metadata writes the journal is still there to be replayed.
+static int journal_write(const char *journal_name, const meta_block_t *blocks, size_t count) {
+    FILE *jf = fopen(journal_name, "wb");
+    if (!jf) {
+        perror("Failed to create journal");
+        return 1;
+    }
+    if (fwrite(blocks, sizeof(*blocks), count, jf) != count) {
+        perror("Failed to write journal");
+        fclose(jf);
+        return 1;
+    }
+
+    journal_trailer_t tr = {0};
+    tr.magic = JOURNAL_MAGIC;
+    tr.count = (uint32_t)count;
+    tr.crc = crc32(blocks, count * sizeof(*blocks));
+    if (fwrite(&tr, sizeof(tr), 1, jf) != 1 || sync_file(jf) != 0) {
+        perror("Failed to commit journal");
+        fclose(jf);
+        return 1;
+    }
+    fclose(jf);
+    return sync_parent_dir(journal_name);
+}
+
+// A journal without a valid commit record means the image was never
+// touched, so it is simply discarded
+// Read journal_name: *state is FS_JOURNAL_NONE when there is none and
+// FS_JOURNAL_COMMITTED when it holds a valid commit record, whose blocks
+// (caller frees) are returned in *blocks
+static int journal_read(const char *journal_name, int *state, meta_block_t **blocks, size_t *count) {
+    *state = FS_JOURNAL_NONE;
+    *blocks = NULL;
+    *count = 0;
+    FILE *jf = fopen(journal_name, "rb");
+    if (!jf) {
+        if (errno == ENOENT) return 0;
+        perror("Failed to open journal");
+        return 1;
+    }
+
+    fseek(jf, 0, SEEK_END);
+    long jsize = ftell(jf);
+    journal_trailer_t tr = {0};
+    *state = FS_JOURNAL_INCOMPLETE;
+
+    if (jsize >= (long)sizeof(tr) && (jsize - sizeof(tr)) % sizeof(meta_block_t) == 0) {
+        size_t n = (jsize - sizeof(tr)) / sizeof(meta_block_t);
+        meta_block_t *b = malloc(n * sizeof(*b) + 1);
+        fseek(jf, 0, SEEK_SET);
+        if (b && fread(b, sizeof(*b), n, jf) == n &&
+            fread(&tr, sizeof(tr), 1, jf) == 1 &&
+            tr.magic == JOURNAL_MAGIC && tr.count == n &&
+            tr.crc == crc32(b, n * sizeof(*b))) {
+            *state = FS_JOURNAL_COMMITTED;
+            *blocks = b;
+            *count = n;
+        } else {
+            free(b);
+        }
+    }
+    fclose(jf);
+    return 0;
+}
+
+int fs_journal_pending(const char *journal_name) {
+    int state;
+    meta_block_t *blocks;
+    size_t count;
+    if (journal_read(journal_name, &state, &blocks, &count) != 0) return -1;
+    free(blocks);
+    return state;
+}
+
+int fs_journal_replay(const char *image_name, const char *journal_name) {
+    int state;
+    meta_block_t *blocks;
+    size_t count;
+    if (journal_read(journal_name, &state, &blocks, &count) != 0) return 1;
+    if (state == FS_JOURNAL_NONE) return 0;
+
+    if (state == FS_JOURNAL_COMMITTED) {
+        int fd = open(image_name, O_RDWR);
+        if (fd < 0) {
+            perror("Failed to open image for journal replay");
+            free(blocks);
+            return 1;
+        }
+        blkio_t io;
+        blkio_init(&io, fd, BLKIO_AUTO);
+        int rc = write_metadata(&io, blocks, count);
+        blkio_exit(&io);
+        close(fd);
+        if (rc != 0) {
+            free(blocks);
+            return 1;
+        }
+        printf("Replayed %zu metadata blocks from '%s'\n", count, journal_name);
+    } else {
+        printf("Discarded incomplete journal '%s'\n", journal_name);
+    }
+
+    free(blocks);
+    if (unlink(journal_name) != 0) {
+        perror("Failed to remove journal");
+        return 1;
+    }
+    return 0;
+}
+
+static int cmp_meta_blkno(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Mapped counterpart of write_metadata: copy every block into the shared
+// view, then msync the touched ranges, adjacent blocks as one range. The
+// superblock (always last in the commit set) is copied and synced last.
+static int write_metadata_mapped(fs_image_t *fs, const meta_block_t *blocks, size_t count, int flags) {
+    uint64_t *blknos = malloc((count ? count : 1) * sizeof(*blknos));
+    if (!blknos) {
+        perror("Failed to allocate commit set");
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i].blkno == 0) continue;
+        memcpy(fs->map_shared + blocks[i].blkno * BS, blocks[i].data, BS);
+        blknos[n++] = blocks[i].blkno;
+    }
+    qsort(blknos, n, sizeof(*blknos), cmp_meta_blkno);
+
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && blknos[j] == blknos[j - 1] + 1) j++;
+        if (msync(fs->map_shared + blknos[i] * BS, (j - i) * BS, flags) != 0) {
+            perror("Failed to sync metadata");
+            free(blknos);
+            return 1;
+        }
+        i = j;
+    }
+    free(blknos);
+
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i].blkno != 0) continue;
+        memcpy(fs->map_shared, blocks[i].data, BS);
+        if (msync(fs->map_shared, BS, flags) != 0) {
+            perror("Failed to sync superblock");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Everything in memory matches the image again
+static void clear_dirty(fs_image_t *fs) {
+    for (size_t i = 0; i < fs->cache_cap; i++) fs->cache[i].dirty = 0;
+    memset(fs->inode_bm.dirty, 0, fs->inode_bm.nblocks);
+    memset(fs->data_bm.dirty, 0, fs->data_bm.nblocks);
+    memset(fs->group_dirty, 0, fs->sb.group_count);
+    memset(fs->root.dirty, 0, fs->root.nblocks);
+    for (size_t i = 0; i < fs->dirs_cap; i++) {
+        if (!fs->dirs[i]) continue;
+        memset(fs->dirs[i]->dirty, 0, fs->dirs[i]->nblocks);
+        fs->dirs[i]->inode_dirty = 0;
+    }
+}
+
+int fs_commit(fs_image_t *fs, const char *journal_name) {
+    if (fs->read_only) {
+        fprintf(stderr, "Image is open read-only\n");
+        return 1;
+    }
+    meta_block_t *blocks = NULL;
+    size_t count = 0;
+    if (collect_metadata(fs, &blocks, &count) != 0) return 1;
+
+    int status = 1;
+    //Buffered data writes must reach the descriptor before the metadata
+    if (fflush(fs->img) != 0) {
+        perror("Failed to flush image");
+        goto out;
+    }
+    if (journal_name) {
+        //Data blocks must be on disk before the metadata that points at them
+        if (sync_file(fs->img) != 0) goto out;
+        if (journal_write(journal_name, blocks, count) != 0) goto out;
+    }
+
+    //Either way the metadata is durable before the journal goes: MS_SYNC
+    //for a mapping, the trailing superblock fsync otherwise
+    if (fs->map) {
+        if (write_metadata_mapped(fs, blocks, count, journal_name ? MS_SYNC : MS_ASYNC) != 0) goto out;
+    } else if (write_metadata(&fs->io, blocks, count) != 0) {
+        goto out;
+    }
+
+    if (journal_name) {
+        if (unlink(journal_name) != 0) {
+            perror("Failed to remove journal");
+            goto out;
+        }
+    }
+    clear_dirty(fs);
+    status = 0;
+
+out:
+    free(blocks);
+    return status;
+}
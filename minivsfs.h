@@ -0,0 +1,615 @@
+// MiniVSFS on-disk format and image handle shared by the MiniVSFS tools.
+// An fs_image_t keeps the superblock, bitmaps, group descriptors and the
+// directories it uses in memory and caches every other metadata block it
+// touches; fs_commit() writes each changed block back exactly once.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "blkio.h"
+#include "crc32.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define PROJECT_ID 9u
+#define NAME_MAX_LEN 57u
+#define BITS_PER_BLOCK ((uint64_t)BS * 8)
+#define SB_MAGIC 0x4D565346u // 'MVSF'
+
+//little-endian conversion
+static inline uint16_t to_le16(uint16_t x) {
+    return ((x & 0x00FFu) << 8) | ((x & 0xFF00u) >> 8);
+}
+static inline uint32_t to_le32(uint32_t x) {
+    return ((x & 0x000000FFu) << 24) |
+           ((x & 0x0000FF00u) << 8)  |
+           ((x & 0x00FF0000u) >> 8)  |
+           ((x & 0xFF000000u) >> 24);
+}
+static inline uint64_t to_le64(uint64_t x) {
+    return ((uint64_t)to_le32((uint32_t)(x & 0xFFFFFFFFu)) << 32) |
+           (uint64_t)to_le32((uint32_t)(x >> 32));
+}
+
+static inline uint16_t from_le16(uint16_t x) { return to_le16(x); }
+static inline uint32_t from_le32(uint32_t x) { return to_le32(x); }
+static inline uint64_t from_le64(uint64_t x) { return to_le64(x); }
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+    // SB_FEAT_GROUPS
+    uint64_t group_desc_start;
+    uint64_t group_desc_blocks;
+    uint64_t group_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    // SB_FEAT_FREE_COUNTS
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+    // SB_FEAT_DEDUP
+    uint64_t dedup_index;
+    uint64_t dedup_entries;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) <= BS, "superblock must fit in one block");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t ino;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
+
+// Extent mapping: flagged per inode in reserved_0 and per image in
+// superblock flags. Up to INODE_EXTENTS runs live in direct[]; longer
+// maps spill into a chain of extent blocks, each naming the next, of at
+// most EXTENT_CHAIN_MAX blocks. reserved_1 holds the extent count and
+// reserved_2 the first extent block (0 while the map is inline).
+// SB_FEAT_EXTENT_CHAIN marks an image where a chain has a second block.
+#define SB_FEAT_EXTENTS   0x1u
+#define SB_FEAT_DIR_INDEX 0x2u
+#define SB_FEAT_EXTENT_CHAIN 0x200u
+#define INODE_FL_EXTENTS  0x1u
+#define INODE_FL_HASHED   0x2u
+#define INODE_EXTENTS     6
+#define EXTENT_MAGIC      0x4D564558u // 'MVEX'
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} extent_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;
+    uint32_t next;               // next block of the chain, 0 in the last
+    extent_t ext[(BS - 16) / sizeof(extent_t)];
+} extent_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_t) * INODE_EXTENTS == sizeof(((inode_t *)0)->direct), "inline extents must fill direct[]");
+_Static_assert(sizeof(extent_block_t) == BS, "extent block size mismatch");
+#define EXTENT_BLOCK_MAX (sizeof(((extent_block_t *)0)->ext) / sizeof(extent_t))
+#define EXTENT_CHAIN_MAX 16
+#define EXTENT_MAP_MAX   (EXTENT_BLOCK_MAX * EXTENT_CHAIN_MAX)
+
+// Data checksums: an INODE_FL_CSUM inode keeps one CRC32 per data block, in
+// file order, in a chain of checksum blocks starting at xattr_ptr. Each CRC
+// covers the whole block including the zero padding after the file's end,
+// so a reader can check exactly the blocks it touches. Files written to an
+// SB_FEAT_DATA_CSUM image get them.
+#define SB_FEAT_DATA_CSUM 0x10u
+#define INODE_FL_CSUM     0x4u
+#define CSUM_MAGIC        0x4D56434Bu // 'MVCK'
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;
+    uint32_t next;               // next block of the chain, 0 in the last
+    uint32_t crcs[(BS - 16) / sizeof(uint32_t)];
+} csum_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(csum_block_t) == BS, "checksum block size mismatch");
+#define CSUM_BLOCK_MAX (sizeof(((csum_block_t *)0)->crcs) / sizeof(uint32_t))
+
+// Compressed files (INODE_FL_COMPRESSED): the data blocks hold a stream of
+// chunks, each CZ_CHUNK bytes of file data compressed on its own (lz.h) or
+// stored as is when that does not make it smaller, then the chunk index
+// and a trailer, ending exactly at the end of the last block. Index entry
+// i (64-bit, disk byte order) is the stream offset where chunk i ends, so
+// a read finds any chunk from two entries. size_bytes stays the file size;
+// data checksums cover the stored blocks.
+#define SB_FEAT_COMPRESS    0x20u
+#define INODE_FL_COMPRESSED 0x8u
+#define CZ_MAGIC            0x4D56435Au // 'MVCZ'
+#define CZ_CHUNK            65536u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t nchunks;
+    uint32_t chunk_size;
+    uint32_t magic;
+} cz_trailer_t;
+#pragma pack(pop)
+_Static_assert(sizeof(cz_trailer_t) == 16, "compression trailer size mismatch");
+
+// Inline data (INODE_FL_INLINE): a file of at most INODE_INLINE_MAX bytes
+// keeps them in direct[] as is, with no data blocks, so the inode CRC
+// covers them and reading them takes no I/O past the inode table.
+#define SB_FEAT_INLINE   0x40u
+#define INODE_FL_INLINE  0x10u
+#define INODE_INLINE_MAX sizeof(((inode_t *)0)->direct)
+
+// Block deduplication: data blocks written in dedup mode are listed in a
+// content index, a chain of index blocks from sb.dedup_index holding
+// sb.dedup_entries entries. Each entry names a block, a 64-bit hash of its
+// contents and the number of file block references to it; files share an
+// indexed block by mapping it, and only indexed blocks may be shared.
+// Blocks not in the index have exactly one reference, as always.
+#define SB_FEAT_DEDUP 0x80u
+#define DEDUP_MAGIC   0x4D564444u // 'MVDD'
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t hash;
+    uint32_t blkno;
+    uint32_t refs;
+} dedup_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;                // CRC32 of ent[0..count) as stored
+    uint32_t next;               // next index block, 0 at the end
+    dedup_entry_t ent[(BS - 16) / sizeof(dedup_entry_t)];
+} dedup_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dedup_block_t) == BS, "dedup index block size mismatch");
+#define DEDUP_BLOCK_MAX (sizeof(((dedup_block_t *)0)->ent) / sizeof(dedup_entry_t))
+
+// Block groups: data block i and inode i belong to groups i / blocks_per_group
+// and i / inodes_per_group. A group's bitmap bits, inode table slice and data
+// blocks are contiguous ranges; the descriptor table after the superblock
+// holds each group's free counters. Images without SB_FEAT_GROUPS get the
+// same grouping in memory only.
+#define SB_FEAT_GROUPS 0x4u
+
+// Free data block and inode totals kept in the superblock, so usage can be
+// reported without reading the bitmaps
+#define SB_FEAT_FREE_COUNTS 0x8u
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t flags;
+    uint32_t checksum;
+} group_desc_t;
+#pragma pack(pop)
+_Static_assert(sizeof(group_desc_t) == 16, "group descriptor size mismatch");
+#define GROUP_DESCS_PER_BLOCK (BS / sizeof(group_desc_t))
+
+// Hashed directories (INODE_FL_HASHED) are a power-of-two number of
+// extent-mapped blocks used as hash buckets. A name lives in the first
+// block, starting at FNV-1a(name) mod bucket count, that had a free slot
+// when it was inserted; lookups stop at the first block that has a
+// never-used slot. "." and ".." stay in slots 0 and 1 of block 0.
+// Directories are rebuilt at twice the size past 3/4 occupancy.
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+#define DIR_LOAD_NUM 3
+#define DIR_LOAD_DEN 4
+
+// Subdirectories: a directory inode (mode 040000) anywhere below the root,
+// laid out exactly like the root directory, linear or hashed. Its "."
+// names itself and ".." its parent, and as for the root its link count is
+// its number of live entries, saturating at DIR_LINKS_MAX for directories
+// with more (like ext4's dir_nlink). Entry types tell files from directories.
+#define SB_FEAT_SUBDIRS 0x100u
+#define DIRENT_FILE 1
+#define DIRENT_DIR  2
+#define DIR_LINKS_MAX UINT16_MAX
+
+// Link count of a directory with `live` entries
+static inline uint16_t dir_links(uint64_t live) {
+    return live < DIR_LINKS_MAX ? (uint16_t)live : DIR_LINKS_MAX;
+}
+
+// Byte order conversion and checksums of the on-disk structures
+void superblock_to_host(superblock_t *sb);
+void superblock_to_disk(superblock_t *sb);
+void inode_to_host(inode_t *in);
+void inode_to_disk(inode_t *in);
+void dirent_to_host(dirent64_t *de);
+void dirent_to_disk(dirent64_t *de);
+void group_desc_to_disk(group_desc_t *gd);    // also seals the descriptor CRC
+void superblock_crc_finalize(superblock_t *sb);
+void inode_crc_finalize(inode_t *ino);
+void dirent_checksum_finalize(dirent64_t *de);
+void extent_block_finalize(extent_block_t *eb); // host -> disk order plus CRC
+void csum_block_finalize(csum_block_t *cb);
+void dedup_block_finalize(dedup_block_t *db);     // host -> disk order plus CRC
+
+// Allocation bitmap scanned 64 bits at a time. Only the first nbits bits
+// are ever handed out; hint is where the next search starts. The backing
+// buffer spans whole blocks, and changed blocks are flagged in dirty so
+// only those are written back.
+typedef struct {
+    uint8_t *bits;
+    uint64_t nbits;
+    uint64_t hint;
+    uint64_t nfree;              // clear bits below nbits
+    uint64_t nblocks;            // blocks backing bits
+    uint8_t *dirty;              // one flag per backing block
+} bitmap_t;
+
+void set_bit(uint8_t *bitmap, uint64_t bit);
+void clear_bit(uint8_t *bitmap, uint64_t bit);
+int is_bit_set(const uint8_t *bitmap, uint64_t bit);
+uint64_t bitmap_scan(const bitmap_t *bm, uint64_t from, int value);
+uint64_t bitmap_count_free(const bitmap_t *bm, uint64_t lo, uint64_t hi);
+uint64_t bitmap_alloc_run(bitmap_t *bm, uint64_t lo, uint64_t hi, uint64_t want, uint64_t *start);
+int64_t bitmap_alloc(bitmap_t *bm, uint64_t lo, uint64_t hi);
+void bitmap_free(bitmap_t *bm, uint64_t bit);
+
+// In-memory state of one block group
+typedef struct {
+    uint64_t data_start, data_end;   // data bitmap bits of the group
+    uint64_t ino_start, ino_end;     // inode bitmap bits of the group
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+} group_t;
+
+// One cached metadata block, kept in disk byte order
+typedef struct {
+    uint64_t blkno;
+    uint8_t *data;               // NULL for an empty slot
+    int dirty;
+} cache_entry_t;
+
+// A directory held in memory: its inode and every block of entries. The
+// root is loaded at open, others on first use; changed blocks and the inode
+// go back out on commit.
+typedef struct {
+    uint32_t ino;                // 1-based
+    inode_t inode;               // host byte order
+    uint8_t *ents;               // directory blocks, entries in host byte order
+    uint32_t *blknos;            // block number of each directory block
+    uint8_t *dirty;              // one flag per directory block
+    uint32_t nblocks;            // 1 while linear, bucket count once hashed
+    uint64_t live;               // live entries including . and ..
+    int inode_dirty;
+} fs_dir_t;
+
+// Open image. Everything is loaded or cached once, modified in memory, and
+// written back by fs_commit(). Fields are exposed for the tools; embedders
+// should stick to the fs_* functions.
+typedef struct {
+    FILE *img;
+    blkio_t io;                  // metadata reads and commit writes on img's descriptor
+    superblock_t sb;
+    bitmap_t inode_bm;
+    bitmap_t data_bm;
+    group_t *groups;
+    uint8_t *gdt;                // descriptor table blocks, disk byte order (SB_FEAT_GROUPS)
+    uint8_t *group_dirty;        // one flag per group
+    uint64_t inode_goal;         // group the next file inode search starts in
+    cache_entry_t *cache;        // open-addressed by block number
+    size_t cache_cap;            // power of two
+    size_t cache_count;
+    fs_dir_t root;
+    fs_dir_t **dirs;             // other directories loaded so far, open-addressed by inode number
+    size_t dirs_cap;             // power of two
+    size_t ndirs;
+    extent_t *deferred_free;     // blocks released once the new metadata commits
+    size_t deferred_count;
+    size_t deferred_cap;
+    uint8_t *map;                // FS_OPEN_MMAP: private view metadata is edited in
+    uint8_t *map_shared;         // FS_OPEN_MMAP: shared view commits are copied to
+    uint64_t map_len;
+    int read_only;               // FS_OPEN_RDONLY
+    dedup_entry_t *dedup;        // index entries, host byte order; refs 0 once dropped
+    size_t dedup_count;          // entries including dropped ones
+    size_t dedup_live;
+    uint32_t *dedup_by_hash;     // open-addressed entry numbers + 1, by hash
+    uint32_t *dedup_by_blk;      // ... by block number
+    size_t dedup_cap;            // slots of each table, power of two
+    uint32_t *dedup_chain;       // index blocks the entries were loaded from
+    size_t dedup_nchain;
+    int dedup_loaded;
+    int dedup_dirty;
+} fs_image_t;
+
+// Access bitmaps, group descriptors, inode table and extent blocks as views
+// of a copy-on-write mapping of the image instead of reading them with stdio.
+// Commits copy the changed blocks into a shared mapping and msync them.
+#define FS_OPEN_MMAP 0x1u
+
+// Use pread/pwrite for metadata I/O even where io_uring is available
+#define FS_OPEN_PSYNC 0x2u
+
+// Open the image read-only, for tools that never commit
+#define FS_OPEN_RDONLY 0x4u
+
+// Open an image read-write and load its metadata. On failure the handle
+// still has to be released with fs_close().
+int fs_open(fs_image_t *fs, const char *path, unsigned flags);
+
+// Release the handle without writing anything back
+void fs_close(fs_image_t *fs);
+
+// Metadata block cache. fs_block() reads through the cache, fs_block_mut()
+// also marks the block for write-back, and fs_block_new() returns a zeroed
+// dirty block without reading it (for freshly allocated blocks).
+uint8_t *fs_block(fs_image_t *fs, uint64_t blkno);
+uint8_t *fs_block_mut(fs_image_t *fs, uint64_t blkno);
+uint8_t *fs_block_new(fs_image_t *fs, uint64_t blkno);
+
+// Allocate a file inode (0-based slot), preferring a group with room for
+// blocks_hint data blocks. Returns -1 when no inode is free.
+int64_t fs_alloc_inode(fs_image_t *fs, uint64_t blocks_hint);
+
+// Group an inode slot belongs to, the natural goal for its data blocks
+uint64_t fs_inode_group(const fs_image_t *fs, uint64_t slot);
+
+// Allocate `count` data blocks as few contiguous runs as possible, starting
+// in group `goal`. Adjacent runs are merged; the caller owns the list.
+int fs_alloc_blocks(fs_image_t *fs, uint64_t goal, uint64_t count, extent_t **out, size_t *nout);
+
+// Mark a data block (by block number) or an inode slot used or free, keeping
+// the group counters in step. Meant for repairs; files allocate through
+// fs_alloc_inode() and fs_alloc_blocks().
+void fs_set_block_used(fs_image_t *fs, uint32_t blkno, int used);
+void fs_set_inode_used(fs_image_t *fs, uint32_t slot, int used);
+
+// Point an inode at the data blocks in extents: direct[] for a small
+// classic file, otherwise inline extents or a chain of extent blocks
+// (reusing the inode's current ones, more allocated near group `goal`,
+// spare ones freed at commit). The caller still writes the inode with
+// fs_write_inode().
+int fs_set_extents(fs_image_t *fs, inode_t *in, const extent_t *extents, size_t nextents, uint64_t goal);
+
+// Release blocks only once the metadata that stops using them is committed,
+// so a crash before the commit never sees them reused
+int fs_defer_free(fs_image_t *fs, uint32_t start, uint32_t len);
+
+// Read or store an inode by 0-based slot (host byte order)
+int fs_read_inode(fs_image_t *fs, uint32_t slot, inode_t *out);
+int fs_write_inode(fs_image_t *fs, uint32_t slot, const inode_t *in);
+
+// Extent map of an extent-mapped inode (host byte order); caller frees *out
+int fs_load_extents(fs_image_t *fs, const inode_t *in, extent_t **out, size_t *nout);
+
+// Extent blocks of an extent-mapped inode in chain order, into blknos
+// (room for EXTENT_CHAIN_MAX); none for a map kept in direct[]
+int fs_extent_chain(fs_image_t *fs, const inode_t *in, uint32_t *blknos, size_t *n);
+
+// Data blocks of a file inode as extents, from direct[] or its extent map,
+// with physically adjacent runs merged (none for inline data); caller frees *out
+int fs_inode_map(fs_image_t *fs, const inode_t *in, extent_t **out, size_t *nout);
+
+// Give file inode `ino` the per-block data CRCs in crcs (as filled in by
+// fs_write_extents()), replacing any it had. The checksum blocks go out
+// with the rest of the metadata on commit.
+int fs_store_checksums(fs_image_t *fs, uint32_t ino, const uint32_t *crcs, uint64_t count);
+
+// Release an inode's checksum chain once the commit lands and clear
+// INODE_FL_CSUM; the caller writes the inode
+int fs_drop_checksums(fs_image_t *fs, inode_t *in);
+
+// CRCs of data blocks [first, first + count) of an INODE_FL_CSUM inode,
+// following the chain no further than the last block asked for
+int fs_load_checksums(fs_image_t *fs, const inode_t *in, uint64_t first, uint64_t count, uint32_t *out);
+
+// Read up to len bytes of file inode `ino` from offset off into buf; *got
+// is short only at end of file. Just the blocks the range touches are
+// read and, for a checksummed file, verified; a compressed file only has
+// the chunks that hold the range decompressed.
+int fs_read_file(fs_image_t *fs, uint32_t ino, void *buf, uint64_t off, uint64_t len, uint64_t *got);
+
+// Paths name entries from the root down, components separated by '/';
+// empty and "." components are skipped, so "/a//b" is "a/b". Every call
+// below that takes a name for a new file accepts a path whose parent
+// directories exist.
+
+// Inode number at path, 0 when there is none. "" is the root.
+uint32_t fs_lookup(fs_image_t *fs, const char *path);
+
+// Directory inode `ino` (1-based), loaded on first use and kept until
+// fs_close(). NULL, with a message, when it is not a readable directory.
+fs_dir_t *fs_dir(fs_image_t *fs, uint32_t ino);
+
+// Slot of the entry a lookup of `name` in d finds (counted as in
+// fs_unlink_slot), -1 when there is none
+int64_t fs_dir_slot(fs_dir_t *d, const char *name);
+
+// Add an entry of the given DIRENT_* type to d for an existing inode
+int fs_link(fs_image_t *fs, fs_dir_t *d, const char *name, uint32_t ino, uint8_t type);
+
+// Remove entry number `slot` of d, counting entries across the directory
+// blocks. The inode and its blocks are left alone.
+void fs_unlink_slot(fs_dir_t *d, size_t slot);
+
+// Create directory path, with room for `entries` entries so that filling
+// it never rebuilds it. With parents, missing parents are created and an
+// existing directory is not an error (mkdir -p).
+int fs_mkdir(fs_image_t *fs, const char *path, uint64_t entries, int parents, uint32_t *ino_out);
+
+// Blocks a new directory with room for `entries` entries besides "." and
+// ".." takes: one linear block, or the hash buckets they need
+uint32_t fs_dir_blocks(uint64_t entries);
+
+// Make room in d for `entries` entries besides "." and ".." now,
+// rebuilding it at most once instead of letting it double repeatedly as
+// they are added. A directory that already has the room is left alone.
+int fs_dir_grow(fs_image_t *fs, fs_dir_t *d, uint64_t entries);
+
+// Create count directories in one batch, each sized for entries[i] entries.
+// A parent must exist already or come earlier in paths. Inodes are taken in
+// one pass and all directory blocks in one allocation, so a tree's
+// directories sit together; like every directory they are written once,
+// by fs_commit(). inos, when not NULL, gets the new inode numbers.
+int fs_mkdirs(fs_image_t *fs, const char *const *paths, const uint64_t *entries, size_t count, uint32_t *inos);
+
+// Create file `name` holding `size` bytes read from src. Data blocks are
+// written immediately; the inode, directory and bitmaps only reach the
+// image on fs_commit(). Stores the new inode number.
+int fs_write_file(fs_image_t *fs, const char *name, FILE *src, uint64_t size, uint32_t *ino_out);
+
+// Metadata half of fs_write_file: allocate and link a `size`-byte file and
+// return its data extents (caller frees) without writing any data. The
+// blocks must be filled, e.g. with fs_write_extents(), before fs_commit().
+int fs_create_file(fs_image_t *fs, const char *name, uint64_t size, uint32_t *ino_out,
+                   extent_t **extents, size_t *nextents);
+
+// Read exactly `size` bytes of a source file into buf. Fails, with a
+// message, on a read error or if the file ends early.
+int fs_read_source(FILE *src, void *buf, uint64_t size);
+
+// New file holding its size (at most INODE_INLINE_MAX) bytes of data in the
+// inode. fs_write_file() and fs_write_file_compressed() use it for files
+// that small; fs_create_file() always maps blocks.
+int fs_write_inline(fs_image_t *fs, const char *name, const void *data, uint64_t size, uint32_t *ino_out);
+
+// Compressed counterparts of fs_create_file(), fs_write_extents() and
+// fs_write_file(). fs_create_compressed() reserves fs_compressed_bound()
+// blocks, the most the stream can take. fs_compress_extents() writes the
+// stream and reports the blocks it used; a file that would not get smaller
+// is written plainly instead (*packed = 0). fs_finish_compressed() then
+// trims the map to those blocks and flags the inode.
+uint64_t fs_compressed_bound(uint64_t size);
+int fs_create_compressed(fs_image_t *fs, const char *name, uint64_t size, uint32_t *ino_out,
+                         extent_t **extents, size_t *nextents);
+int fs_compress_extents(int img_fd, int src_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                        uint64_t *used, int *packed, uint32_t *crc_out, uint32_t *block_crcs);
+int fs_finish_compressed(fs_image_t *fs, uint32_t ino, const extent_t *extents, size_t nextents,
+                         uint64_t used, int packed);
+int fs_write_file_compressed(fs_image_t *fs, const char *name, FILE *src, uint64_t size, uint32_t *ino_out);
+
+// Load the dedup index into memory; done on first use by the dedup calls.
+// The index goes back out with the rest of the metadata on commit.
+int fs_dedup_load(fs_image_t *fs);
+
+// Set the reference count of an indexed block; 0 drops it from the index.
+// Returns 1 when the block is not indexed.
+int fs_dedup_set_refs(fs_image_t *fs, uint32_t blkno, uint32_t refs);
+
+// fs_write_file() in dedup mode: each data block is hashed as it is read
+// and looked up in the index. A block whose contents are already in the
+// image is mapped instead of written (*shared_out counts those); any
+// other is written and indexed for later files.
+int fs_write_file_dedup(fs_image_t *fs, const char *name, FILE *src, uint64_t size, uint32_t *ino_out,
+                        uint64_t *shared_out);
+
+// Remove the file at path: its entry goes, and with its last link the
+// inode and every block it holds (data, extent block, checksum chain) are
+// freed. A block the dedup index lists loses one reference and is only
+// freed with its last. Blocks are freed by fs_commit(), so none of them
+// is reused before the old version is gone. Directories are refused.
+int fs_remove(fs_image_t *fs, const char *path);
+
+// Give file `ino` the `size` bytes read from src, keeping its inode and
+// entries. The new contents are written to newly allocated blocks and the
+// old ones are freed by fs_commit(), so until then, crash or failure, the
+// file still reads as before. They are stored plainly (or inline), with
+// fresh checksums on a SB_FEAT_DATA_CSUM image. fs_replace_compressed() and
+// fs_replace_dedup() store them as fs_write_file_compressed() and
+// fs_write_file_dedup() would.
+int fs_replace_file(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size);
+int fs_replace_compressed(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size);
+int fs_replace_dedup(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t size, uint64_t *shared_out);
+
+// Append `len` bytes read from src to file `ino`. The bytes first fill the
+// slack of its last block and the rest go to new blocks that continue the
+// file's last run when the blocks after it are free. Only the inode, the
+// extent map and the end of the checksum chain change. The refilled last
+// block goes through the block cache and is written by fs_commit() (into
+// the journal first in place), so the old one stays intact until then. A
+// last block the dedup index shares is copied to a new one instead, and
+// inline data past INODE_INLINE_MAX is rewritten through fs_replace_file().
+// A compressed file keeps its whole chunks; its partial last chunk and the
+// new bytes are compressed into new blocks behind them, with a new index.
+// A failed append leaves the file as it was and gives back the blocks it took.
+int fs_append_file(fs_image_t *fs, uint32_t ino, FILE *src, uint64_t len);
+
+// Copy `size` bytes of src_fd into the extents with pread/pwrite and zero
+// the rest of the last block, failing if src_fd ends first; *crc_out gets
+// the CRC32 of the file data.
+// block_crcs, when not NULL, gets one CRC per data block for
+// fs_store_checksums(), summed from the same buffer the copy goes through.
+// Touches no fs_image_t state, so files can be written from many threads.
+int fs_write_extents(int img_fd, int src_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                     uint32_t *crc_out, uint32_t *block_crcs);
+
+// Stream the first `size` bytes stored in the extents to out_fd at its
+// current position (a file, pipe or terminal): one in-kernel copy per run
+// where the kernel supports it, a pread/write loop otherwise. With
+// block_crcs (from fs_load_checksums()) every block is read through a
+// buffer and checked against its CRC before any of it is written out.
+int fs_read_extents(int img_fd, int out_fd, uint64_t size, const extent_t *extents, size_t nextents,
+                    const uint32_t *block_crcs);
+
+// Write every changed metadata block back exactly once. With a journal
+// name the new metadata is first made durable in the journal, so a crash
+// at any point leaves either the old or the new image.
+int fs_commit(fs_image_t *fs, const char *journal_name);
+
+// Finish an interrupted journaled commit, or discard a journal without a
+// valid commit record. A missing journal is not an error.
+int fs_journal_replay(const char *image_name, const char *journal_name);
+
+// What fs_journal_replay() would find, without touching anything: one of
+// the FS_JOURNAL_* states, or -1 (with a message) if it cannot be read.
+#define FS_JOURNAL_NONE       0
+#define FS_JOURNAL_INCOMPLETE 1 // discarded on replay; the image is unchanged
+#define FS_JOURNAL_COMMITTED  2 // replayed; the image may be half-updated until then
+int fs_journal_pending(const char *journal_name);
+
+#endif
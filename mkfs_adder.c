@@ -1,363 +1,323 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c minivsfs.c blkio.c crc32.c lz.c -o mkfs_adder
 #define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700 // realpath
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
-
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#define PROJECT_ID 9u
-
-//little-endian conversion
-static inline uint16_t to_le16(uint16_t x) {
-    return ((x & 0x00FFu) << 8) | ((x & 0xFF00u) >> 8);
-}
-static inline uint32_t to_le32(uint32_t x) {
-    return ((x & 0x000000FFu) << 24) |
-           ((x & 0x0000FF00u) << 8)  |
-           ((x & 0x00FF0000u) >> 8)  |
-           ((x & 0xFF000000u) >> 24);
-}
-static inline uint64_t to_le64(uint64_t x) {
-    return ((uint64_t)to_le32((uint32_t)(x & 0xFFFFFFFFu)) << 32) |
-           (uint64_t)to_le32((uint32_t)(x >> 32));
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "minivsfs.h"
+
+// Append a name to a growable list
+static int push_name(const char ***list, size_t *count, size_t *cap, char *name) {
+    if (!name) {
+        perror("Failed to store name");
+        return 1;
+    }
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        const char **grown = realloc(*list, new_cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow name list");
+            free(name);
+            return 1;
+        }
+        *list = grown;
+        *cap = new_cap;
+    }
+    (*list)[(*count)++] = name;
+    return 0;
 }
 
-static inline uint16_t from_le16(uint16_t x) { return to_le16(x); }
-static inline uint32_t from_le32(uint32_t x) { return to_le32(x); }
-static inline uint64_t from_le64(uint64_t x) { return to_le64(x); }
-
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) <= BS, "superblock must fit in one block");
-
-#pragma pack(push, 1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push, 1)
+// A file of the batch: the host file and the path it gets in the image,
+// which is `path` itself or, for a file of a --tree, the end of it
 typedef struct {
-    uint32_t ino;
-    uint8_t type;
-    char name[58];
-    uint8_t checksum;
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
-
-// CRC32 helpers
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+    char *path;
+    const char *name;
+} batch_file_t;
+
+// Append a host file to the batch; its image path starts name_at bytes in
+static int push_file(batch_file_t **list, size_t *count, size_t *cap, char *path, size_t name_at) {
+    if (!path) {
+        perror("Failed to store name");
+        return 1;
     }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-
-void superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *)sb, BS - 4);
-    sb->checksum = s;
-}
-
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
-
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
-}
-
-// Conversion functions
-void superblock_to_host(superblock_t *sb) {
-    sb->magic = from_le32(sb->magic);
-    sb->version = from_le32(sb->version);
-    sb->block_size = from_le32(sb->block_size);
-    sb->total_blocks = from_le64(sb->total_blocks);
-    sb->inode_count = from_le64(sb->inode_count);
-    sb->inode_bitmap_start = from_le64(sb->inode_bitmap_start);
-    sb->inode_bitmap_blocks = from_le64(sb->inode_bitmap_blocks);
-    sb->data_bitmap_start = from_le64(sb->data_bitmap_start);
-    sb->data_bitmap_blocks = from_le64(sb->data_bitmap_blocks);
-    sb->inode_table_start = from_le64(sb->inode_table_start);
-    sb->inode_table_blocks = from_le64(sb->inode_table_blocks);
-    sb->data_region_start = from_le64(sb->data_region_start);
-    sb->data_region_blocks = from_le64(sb->data_region_blocks);
-    sb->root_inode = from_le64(sb->root_inode);
-    sb->mtime_epoch = from_le64(sb->mtime_epoch);
-    sb->flags = from_le32(sb->flags);
-    sb->checksum = from_le32(sb->checksum);
-}
-
-void superblock_to_disk(superblock_t *sb) {
-    sb->magic              = to_le32(sb->magic);
-    sb->version            = to_le32(sb->version);
-    sb->block_size         = to_le32(sb->block_size);
-    sb->total_blocks       = to_le64(sb->total_blocks);
-    sb->inode_count        = to_le64(sb->inode_count);
-    sb->inode_bitmap_start = to_le64(sb->inode_bitmap_start);
-    sb->inode_bitmap_blocks= to_le64(sb->inode_bitmap_blocks);
-    sb->data_bitmap_start  = to_le64(sb->data_bitmap_start);
-    sb->data_bitmap_blocks = to_le64(sb->data_bitmap_blocks);
-    sb->inode_table_start  = to_le64(sb->inode_table_start);
-    sb->inode_table_blocks = to_le64(sb->inode_table_blocks);
-    sb->data_region_start  = to_le64(sb->data_region_start);
-    sb->data_region_blocks = to_le64(sb->data_region_blocks);
-    sb->root_inode         = to_le64(sb->root_inode);
-    sb->mtime_epoch        = to_le64(sb->mtime_epoch);
-    sb->flags              = to_le32(sb->flags);
-}
-
-void inode_to_host(inode_t *in) {
-    in->mode = from_le16(in->mode);
-    in->links = from_le16(in->links);
-    in->uid = from_le32(in->uid);
-    in->gid = from_le32(in->gid);
-    in->size_bytes = from_le64(in->size_bytes);
-    in->atime = from_le64(in->atime);
-    in->mtime = from_le64(in->mtime);
-    in->ctime = from_le64(in->ctime);
-    for (int i = 0; i < 12; i++) in->direct[i] = from_le32(in->direct[i]);
-    in->reserved_0 = from_le32(in->reserved_0);
-    in->reserved_1 = from_le32(in->reserved_1);
-    in->reserved_2 = from_le32(in->reserved_2);
-    in->proj_id = from_le32(in->proj_id);
-    in->uid16_gid16 = from_le32(in->uid16_gid16);
-    in->xattr_ptr = from_le64(in->xattr_ptr);
-    in->inode_crc = from_le64(in->inode_crc);
-}
-
-void inode_to_disk(inode_t *in) {
-    in->mode = to_le16(in->mode);
-    in->links = to_le16(in->links);
-    in->uid = to_le32(in->uid);
-    in->gid = to_le32(in->gid);
-    in->size_bytes = to_le64(in->size_bytes);
-    in->atime = to_le64(in->atime);
-    in->mtime = to_le64(in->mtime);
-    in->ctime = to_le64(in->ctime);
-    for (int i = 0; i < 12; i++) in->direct[i] = to_le32(in->direct[i]);
-    in->reserved_0 = to_le32(in->reserved_0);
-    in->reserved_1 = to_le32(in->reserved_1);
-    in->reserved_2 = to_le32(in->reserved_2);
-    in->proj_id = to_le32(in->proj_id);
-    in->uid16_gid16 = to_le32(in->uid16_gid16);
-    in->xattr_ptr = to_le64(in->xattr_ptr);
-}
-
-void dirent_to_host(dirent64_t *de) {
-    de->ino = from_le32(de->ino);
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        batch_file_t *grown = realloc(*list, new_cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow name list");
+            free(path);
+            return 1;
+        }
+        *list = grown;
+        *cap = new_cap;
+    }
+    (*list)[(*count)++] = (batch_file_t){ path, path + name_at };
+    return 0;
 }
 
-void dirent_to_disk(dirent64_t *de) {
-    de->ino = to_le32(de->ino);
-}
+// Read a whole line-oriented manifest of file names into the batch list
+int load_manifest(const char *manifest_name, batch_file_t **files, size_t *count, size_t *cap) {
+    FILE *mf = fopen(manifest_name, "r");
+    if (!mf) {
+        perror("Failed to open manifest");
+        return 1;
+    }
 
-// Find first free bit in bitmap
-int find_free_bit(uint8_t *bitmap, int bitmap_size) {
-    for (int i = 0; i < bitmap_size; i++) {
-        if (bitmap[i] != 0xFF) {
-            for (int j = 0; j < 8; j++) {
-                if (!(bitmap[i] & (1 << j))) {
-                    return i * 8 + j;
-                }
-            }
+    // getline so a long path is one entry, not several
+    char *line = NULL;
+    size_t line_cap = 0;
+    int status = 0;
+    while (getline(&line, &line_cap, mf) >= 0) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        if (push_file(files, count, cap, strdup(line), 0) != 0) {
+            status = 1;
+            break;
         }
     }
-    return -1;
-}
-
-// Set bit in bitmap
-void set_bit(uint8_t *bitmap, int bit) {
-    int byte = bit / 8;
-    int offset = bit % 8;
-    bitmap[byte] |= (1 << offset);
-}
+    if (status == 0 && ferror(mf)) {
+        perror("Failed to read manifest");
+        status = 1;
+    }
 
-// Clear bit in bitmap
-void clear_bit(uint8_t *bitmap, int bit) {
-    int byte = bit / 8;
-    int offset = bit % 8;
-    bitmap[byte] &= ~(1 << offset);
+    free(line);
+    fclose(mf);
+    return status;
 }
 
-// Check if bit is set
-int is_bit_set(uint8_t *bitmap, int bit) {
-    int byte = bit / 8;
-    int offset = bit % 8;
-    return (bitmap[byte] & (1 << offset)) != 0;
-}
+// One directory of a host tree being imported
+typedef struct {
+    char *path;                  // on the host
+    const char *name;            // in the image: the end of path
+    uint64_t entries;            // files and directories it will hold
+    int top;                     // named by --tree; may exist in the image already
+} tree_dir_t;
 
-int main(int argc, char *argv[]) {
-    crc32_init();
-    
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s --input <input.img> --output <output.img> --file <filename>\n", argv[0]);
-        return 1;
+// Directories of the trees being imported, each parent before its children
+typedef struct {
+    tree_dir_t *dirs;
+    size_t count;
+    size_t cap;
+} tree_t;
+
+// Record the directory `path` and everything below it: subdirectories go
+// into the tree, regular files onto the batch list. Anything else is
+// skipped. Image paths are what follows the first name_at bytes of a path.
+static int walk_tree(const char *path, size_t name_at, int top, tree_t *t, batch_file_t **files, size_t *count,
+                     size_t *cap) {
+    if (t->count == t->cap) {
+        size_t new_cap = t->cap ? t->cap * 2 : 16;
+        tree_dir_t *grown = realloc(t->dirs, new_cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow directory list");
+            return 1;
+        }
+        t->dirs = grown;
+        t->cap = new_cap;
     }
-
-    const char *input_name = NULL;
-    const char *output_name = NULL;
-    const char *file_name = NULL;
-
-    //Parse command line args
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--input") == 0) input_name = argv[++i];
-        else if (strcmp(argv[i], "--output") == 0) output_name = argv[++i];
-        else if (strcmp(argv[i], "--file") == 0) file_name = argv[++i];
+    size_t self = t->count;
+    t->dirs[self] = (tree_dir_t){ .path = strdup(path), .top = top };
+    if (!t->dirs[self].path) {
+        perror("Failed to store directory name");
+        return 1;
     }
+    t->dirs[self].name = t->dirs[self].path + name_at;
+    t->count++;
 
-    if (!input_name || !output_name || !file_name) {
-        fprintf(stderr, "Missing required arguments\n");
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
         return 1;
     }
 
-    //Check filename length before any processing
-    if (strlen(file_name) > 57) {
-        fprintf(stderr, "Error: Filename '%s' too long (max 57 characters)\n", file_name);
-        return 1;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        size_t len = strlen(path) + strlen(de->d_name) + 2;
+        char *child = malloc(len);
+        if (!child) {
+            perror("Failed to store file name");
+            goto fail;
+        }
+        snprintf(child, len, "%s/%s", path, de->d_name);
+        struct stat st;
+        if (lstat(child, &st) != 0) {
+            perror(child);
+            free(child);
+            goto fail;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int rc = walk_tree(child, name_at, 0, t, files, count, cap);
+            free(child);
+            if (rc != 0) goto fail;
+        } else if (S_ISREG(st.st_mode)) {
+            if (push_file(files, count, cap, child, name_at) != 0) goto fail;
+        } else {
+            printf("Skipping '%s': not a regular file or directory\n", child);
+            free(child);
+            continue;
+        }
+        t->dirs[self].entries++;
     }
+    closedir(dir);
+    return 0;
+
+fail:
+    closedir(dir);
+    return 1;
+}
 
-    //Open input file system image
-    FILE *input_img = fopen(input_name, "rb");
-    if (!input_img) {
-        perror("Failed to open input image");
+// --tree: the directory lands in the image under its own name, whatever
+// host path reaches it, like mkfs_builder --from-dir names entries
+static int import_tree(const char *arg, tree_t *t, batch_file_t **files, size_t *count, size_t *cap) {
+    char *root = realpath(arg, NULL);
+    if (!root) {
+        perror(arg);
         return 1;
     }
+    const char *base = strrchr(root, '/') + 1;
+    int rc = 1;
+    if (!*base) fprintf(stderr, "Error: --tree %s has no name to import it under\n", arg);
+    else rc = walk_tree(root, (size_t)(base - root), 1, t, files, count, cap);
+    free(root);
+    return rc;
+}
 
-    //Create output file
-    FILE *output_img = fopen(output_name, "wb");
-    if (!output_img) {
-        perror("Failed to create output image");
-        fclose(input_img);
-        return 1;
+// Whether every component of an image path fits in a directory entry
+static int path_fits(const char *path) {
+    for (const char *p = path; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len > NAME_MAX_LEN) return 0;
+        p += len;
+        p += strspn(p, "/");
     }
+    return 1;
+}
 
-    //Copy input file to output file first
-    uint8_t copy_buffer[BS];
-    size_t bytes_read;
-    rewind(input_img);
-    while ((bytes_read = fread(copy_buffer, 1, BS, input_img)) > 0) {
-        if (fwrite(copy_buffer, 1, bytes_read, output_img) != bytes_read) {
-            perror("Failed to copy input to output");
-            fclose(input_img);
-            fclose(output_img);
-            return 1;
+// Create the directories of the imported trees, then any directory a
+// --mkdir or a file path needs that is still missing. Directories that
+// exist are reused; the new ones are made in one batch, every directory
+// at the size its entries need.
+static int make_dirs(fs_image_t *fs, const tree_t *t, const char **mkdirs, size_t nmkdirs,
+                     const batch_file_t *files, size_t count) {
+    const char **below = malloc((t->count ? t->count : 1) * sizeof(*below));
+    uint64_t *below_entries = malloc((t->count ? t->count : 1) * sizeof(*below_entries));
+    size_t nbelow = 0;
+    int status = 1;
+    if (!below || !below_entries) {
+        perror("Failed to allocate directory list");
+        goto out;
+    }
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->dirs[i].top) {
+            //A top that exists already is grown once to hold the tree
+            uint32_t ino;
+            fs_dir_t *d;
+            if (fs_mkdir(fs, t->dirs[i].name, t->dirs[i].entries, 1, &ino) != 0 || !(d = fs_dir(fs, ino)) ||
+                fs_dir_grow(fs, d, t->dirs[i].entries) != 0)
+                goto out;
+            continue;
+        }
+        //Below the top, a directory already in the image (a tree imported
+        //again with --replace) is reused like the top
+        uint32_t ino = fs_lookup(fs, t->dirs[i].name);
+        if (ino) {
+            fs_dir_t *d = fs_dir(fs, ino);
+            if (!d || fs_dir_grow(fs, d, t->dirs[i].entries) != 0) goto out;
+            continue;
         }
+        below[nbelow] = t->dirs[i].name;
+        below_entries[nbelow++] = t->dirs[i].entries;
     }
-    fclose(input_img);
-
-    
-    FILE *modify_img = fopen(output_name, "rb+");
-    if (!modify_img) {
-        perror("Failed to open output image for modification");
-        fclose(output_img);
-        return 1;
+    if (fs_mkdirs(fs, below, below_entries, nbelow, NULL) != 0) goto out;
+    if (nbelow) printf("Created %zu directories\n", nbelow);
+
+    for (size_t i = 0; i < nmkdirs; i++)
+        if (fs_mkdir(fs, mkdirs[i], 0, 1, NULL) != 0) goto out;
+
+    //Parents of files named on their own, as mkdir -p would
+    for (size_t i = 0; i < count; i++) {
+        const char *slash = strrchr(files[i].name, '/');
+        if (!slash) continue;
+        char *parent = strndup(files[i].name, (size_t)(slash - files[i].name));
+        if (!parent) {
+            perror("Failed to allocate path");
+            goto out;
+        }
+        int rc = fs_lookup(fs, parent) ? 0 : fs_mkdir(fs, parent, 0, 1, NULL);
+        free(parent);
+        if (rc != 0) goto out;
     }
-    fclose(output_img);
+    status = 0;
 
-    //Read superblock from output file
-    superblock_t sb;
-    if (fread(&sb, sizeof(sb), 1, modify_img) != 1) {
-        perror("Failed to read superblock");
-        fclose(modify_img);
-        return 1;
-    }
-    superblock_to_host(&sb);
+out:
+    free(below);
+    free(below_entries);
+    return status;
+}
 
-    //Verify magic number
-    if (sb.magic != 0x4D565346) {
-        fprintf(stderr, "Invalid filesystem magic number\n");
-        fclose(modify_img);
-        return 1;
+// Reject a batch that cannot fit using only the free counters, before any
+// bitmap is touched. Extent map blocks are not counted, and compressed
+// sizes are not known yet, so add_file still checks each file on its own.
+// New directories count one inode and at least one block each; updates of
+// files already in the image need update_blocks more.
+int check_space(const fs_image_t *fs, const batch_file_t *files, size_t count, uint64_t dirs, int compress,
+                uint64_t update_blocks) {
+    uint64_t blocks = dirs + update_blocks;
+    for (size_t i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(files[i].path, &st) != 0 || access(files[i].path, R_OK) != 0) {
+            perror(files[i].path);
+            return 1;
+        }
+        if ((uint64_t)st.st_size > INODE_INLINE_MAX) blocks += ((uint64_t)st.st_size + BS - 1) / BS;
     }
-
-    //Read inode bitmap
-    uint8_t inode_bitmap[BS];
-    fseek(modify_img, sb.inode_bitmap_start * BS, SEEK_SET);
-    if (fread(inode_bitmap, BS, 1, modify_img) != 1) {
-        perror("Failed to read inode bitmap");
-        fclose(modify_img);
+    if (count + dirs > fs->inode_bm.nfree) {
+        fprintf(stderr, "Not enough free inodes: %zu files, %" PRIu64 " directories, %" PRIu64 " free\n", count,
+                dirs, fs->inode_bm.nfree);
         return 1;
     }
-
-    //Read data bitmap
-    uint8_t data_bitmap[BS];
-    fseek(modify_img, sb.data_bitmap_start * BS, SEEK_SET);
-    if (fread(data_bitmap, BS, 1, modify_img) != 1) {
-        perror("Failed to read data bitmap");
-        fclose(modify_img);
+    if (!compress && blocks > fs->data_bm.nfree) {
+        fprintf(stderr, "Not enough free data blocks: need %" PRIu64 ", %" PRIu64 " free\n",
+                blocks, fs->data_bm.nfree);
         return 1;
     }
+    return 0;
+}
 
-    //Find free inode
-    int free_inode = find_free_bit(inode_bitmap, BS);
-    if (free_inode == -1) {
-        fprintf(stderr, "No free inodes available\n");
-        fclose(modify_img);
-        return 1;
-    }
+// Data blocks a file takes in the image, which is less than its size
+// needs when it is stored compressed
+static uint64_t stored_blocks(fs_image_t *fs, uint32_t ino) {
+    inode_t in;
+    extent_t *extents = NULL;
+    size_t nextents = 0;
+    uint64_t blocks = 0;
+    if (fs_read_inode(fs, ino - 1, &in) == 0 && fs_inode_map(fs, &in, &extents, &nextents) == 0)
+        for (size_t e = 0; e < nextents; e++) blocks += extents[e].len;
+    free(extents);
+    return blocks;
+}
+
+// How add_file stores data
+enum { STORE_PLAIN, STORE_COMPRESS, STORE_DEDUP };
 
-    //Open the file to add
-    FILE *file_to_add = fopen(file_name, "rb");
+// Add one host file to the image under its own name
+int add_file(fs_image_t *fs, const batch_file_t *file, int store) {
+    const char *file_name = file->name;
+    FILE *file_to_add = fopen(file->path, "rb");
     if (!file_to_add) {
         perror("Failed to open file to add");
-        fclose(modify_img);
         return 1;
     }
 
@@ -366,213 +326,511 @@ int main(int argc, char *argv[]) {
     uint64_t file_size = ftell(file_to_add);
     fseek(file_to_add, 0, SEEK_SET);
 
-    //Calculate required data blocks
-    uint64_t blocks_needed = (file_size + BS - 1) / BS;
-    if (blocks_needed > DIRECT_MAX) {
-        fprintf(stderr, "File too large: requires %lu blocks, maximum is %d\n", blocks_needed, DIRECT_MAX);
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
-    }
+    uint32_t ino;
+    uint64_t shared = 0;
+    int rc;
+    if (store == STORE_COMPRESS) rc = fs_write_file_compressed(fs, file_name, file_to_add, file_size, &ino);
+    else if (store == STORE_DEDUP) rc = fs_write_file_dedup(fs, file_name, file_to_add, file_size, &ino, &shared);
+    else rc = fs_write_file(fs, file_name, file_to_add, file_size, &ino);
+    fclose(file_to_add);
+    if (rc != 0) return 1;
+
+    printf("File '%s' added successfully to inode %u\n", file_name, ino);
+    if (store == STORE_DEDUP)
+        printf("File size: %" PRIu64 " bytes, %" PRIu64 " blocks, %" PRIu64 " shared\n", file_size,
+               stored_blocks(fs, ino), shared);
+    else
+        printf("File size: %" PRIu64 " bytes, %" PRIu64 " blocks\n", file_size, stored_blocks(fs, ino));
+    return 0;
+}
 
-    //Find free data blocks
-    uint32_t data_blocks[DIRECT_MAX] = {0};
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        int free_block = find_free_bit(data_bitmap, BS);
-        if (free_block == -1) {
-            fprintf(stderr, "Not enough free data blocks\n");
-            fclose(file_to_add);
-            fclose(modify_img);
-            return 1;
-        }
-        data_blocks[i] = sb.data_region_start + free_block;
-        set_bit(data_bitmap, free_block);
+// A file of the batch that is in the image already (--replace, --append)
+typedef struct {
+    char *path;                  // host file
+    const char *name;            // image path
+    uint32_t ino;
+    uint64_t old_size; // size in the image
+    uint64_t size;     // size on the host
+} update_t;
+
+// Data blocks updating a file to `size` bytes allocates. A replacement is
+// written to new blocks in full; an append adds blocks to a plain file
+// (plus one when its shared last block has to be copied), rewrites an
+// inline one, and rewrites a compressed one from its last chunk on, stored
+// as is at worst, with the whole index.
+static uint64_t update_blocks(const fs_image_t *fs, const inode_t *in, uint64_t size, int append) {
+    uint64_t blocks = size > INODE_INLINE_MAX ? (size + BS - 1) / BS : 0;
+    if (!append || in->size_bytes == 0 || (in->reserved_0 & INODE_FL_INLINE)) return blocks;
+    if (in->reserved_0 & INODE_FL_COMPRESSED) {
+        uint64_t rest = size - in->size_bytes / CZ_CHUNK * CZ_CHUNK;
+        uint64_t meta = (size + CZ_CHUNK - 1) / CZ_CHUNK * sizeof(uint64_t) + sizeof(cz_trailer_t);
+        return (BS + rest + meta + BS - 1) / BS;
     }
+    blocks -= (in->size_bytes + BS - 1) / BS;
+    if ((fs->sb.flags & SB_FEAT_DEDUP) && in->size_bytes % BS) blocks++;
+    return blocks;
+}
 
-    //Read root inode
-    inode_t root_inode;
-    fseek(modify_img, sb.inode_table_start * BS, SEEK_SET);
-    if (fread(&root_inode, sizeof(root_inode), 1, modify_img) != 1) {
-        perror("Failed to read root inode");
-        fclose(file_to_add);
-        fclose(modify_img);
+// --replace / --append: move the files of the batch that exist already to
+// their own list, checking every one and summing the blocks their updates
+// need, so that nothing is written before the whole batch is known to fit
+static int plan_updates(fs_image_t *fs, batch_file_t *files, size_t *count, int append, update_t **out,
+                        size_t *nout, uint64_t *blocks) {
+    update_t *ups = malloc((*count ? *count : 1) * sizeof(*ups));
+    if (!ups) {
+        perror("Failed to allocate update list");
         return 1;
     }
-    inode_to_host(&root_inode);
+    size_t kept = 0, n = 0;
+    for (size_t i = 0; i < *count; i++) {
+        uint32_t ino = fs_lookup(fs, files[i].name);
+        if (ino) ups[n++] = (update_t){ files[i].path, files[i].name, ino, 0, 0 };
+        else files[kept++] = files[i];
+    }
+    *count = kept;
+    *out = ups;
+    *nout = n;
+
+    *blocks = 0;
+    for (size_t i = 0; i < n; i++) {
+        inode_t in;
+        struct stat st;
+        if (fs_read_inode(fs, ups[i].ino - 1, &in) != 0) return 1;
+        if ((in.mode & 0170000) != 0100000) {
+            fprintf(stderr, "Error: '%s' exists and is not a regular file\n", ups[i].name);
+            return 1;
+        }
+        if (stat(ups[i].path, &st) != 0 || access(ups[i].path, R_OK) != 0) {
+            perror(ups[i].path);
+            return 1;
+        }
+        ups[i].old_size = in.size_bytes;
+        ups[i].size = (uint64_t)st.st_size;
+        if (append && ups[i].size < ups[i].old_size) {
+            fprintf(stderr, "Error: '%s' is shorter than its copy in the image; use --replace\n", ups[i].name);
+            return 1;
+        }
+        *blocks += update_blocks(fs, &in, ups[i].size, append);
+    }
+    return 0;
+}
 
-    //Read root directory block
-    uint8_t root_dir_block[BS];
-    fseek(modify_img, root_inode.direct[0] * BS, SEEK_SET);
-    if (fread(root_dir_block, BS, 1, modify_img) != 1) {
-        perror("Failed to read root directory");
-        fclose(file_to_add);
-        fclose(modify_img);
+// Bring a file of the image up to date with the host file of its name,
+// keeping its inode. With `append` the host file is taken to have grown
+// and only the bytes past the image copy are written; otherwise the file
+// is rewritten and stored the way add_file would store it.
+static int update_file(fs_image_t *fs, const update_t *u, int append, int store) {
+    FILE *src = fopen(u->path, "rb");
+    if (!src) {
+        perror("Failed to open file to add");
         return 1;
     }
+    uint64_t shared = 0;
+    int rc = fseeko(src, append ? (off_t)u->old_size : 0, SEEK_SET);
+    if (rc != 0) perror(u->path);
+    else if (append) rc = fs_append_file(fs, u->ino, src, u->size - u->old_size);
+    else if (store == STORE_COMPRESS) rc = fs_replace_compressed(fs, u->ino, src, u->size);
+    else if (store == STORE_DEDUP) rc = fs_replace_dedup(fs, u->ino, src, u->size, &shared);
+    else rc = fs_replace_file(fs, u->ino, src, u->size);
+    fclose(src);
+    if (rc != 0) return 1;
+
+    if (append)
+        printf("File '%s': %" PRIu64 " bytes appended to inode %u\n", u->name, u->size - u->old_size, u->ino);
+    else
+        printf("File '%s' replaced in inode %u\n", u->name, u->ino);
+    if (store == STORE_DEDUP && !append)
+        printf("File size: %" PRIu64 " bytes, %" PRIu64 " blocks, %" PRIu64 " shared\n", u->size,
+               stored_blocks(fs, u->ino), shared);
+    else
+        printf("File size: %" PRIu64 " bytes, %" PRIu64 " blocks\n", u->size, stored_blocks(fs, u->ino));
+    return 0;
+}
 
-    
-    dirent64_t *entries = (dirent64_t *)root_dir_block;
-    size_t max_entries = BS / sizeof(dirent64_t);
-    int free_entry = -1;
-    int file_exists = 0;
+// One file of a parallel batch: placed by the main thread, filled by a worker
+typedef struct {
+    const char *path;            // host file
+    const char *name;            // image path
+    uint64_t size;
+    uint32_t ino;
+    extent_t *extents;
+    size_t nextents;
+    uint32_t crc;
+    uint32_t *block_crcs;        // SB_FEAT_DATA_CSUM: stored once the workers are done
+    uint64_t used;               // blocks the data took
+    int packed;                  // stored compressed
+    int inline_data;             // small enough for the inode, written up front
+} ingest_job_t;
 
-    for (size_t i = 0; i < max_entries; i++) {
-        dirent_to_host(&entries[i]);
-        
-        //Check if file already exists
-        if (entries[i].ino != 0 && strcmp(entries[i].name, file_name) == 0) {
-            file_exists = 1;
+typedef struct {
+    ingest_job_t *jobs;
+    size_t count;
+    atomic_size_t next;
+    atomic_int failed;
+    int img_fd;
+    int compress;
+} ingest_queue_t;
+
+// Worker: take the next unclaimed file and copy it into its blocks
+static void *ingest_worker(void *arg) {
+    ingest_queue_t *q = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&q->next, 1);
+        if (i >= q->count || atomic_load(&q->failed)) break;
+        ingest_job_t *job = &q->jobs[i];
+        if (job->inline_data) continue;
+
+        int src_fd = open(job->path, O_RDONLY);
+        if (src_fd < 0) {
+            perror(job->path);
+            atomic_store(&q->failed, 1);
             break;
         }
-        
-        //Find first free entry
-        if (entries[i].ino == 0 && free_entry == -1) {
-            free_entry = i;
+        int rc;
+        if (q->compress) {
+            rc = fs_compress_extents(q->img_fd, src_fd, job->size, job->extents, job->nextents, &job->used,
+                                     &job->packed, &job->crc, job->block_crcs);
+        } else {
+            rc = fs_write_extents(q->img_fd, src_fd, job->size, job->extents, job->nextents, &job->crc,
+                                  job->block_crcs);
+            job->used = (job->size + BS - 1) / BS;
+        }
+        close(src_fd);
+        if (rc != 0) {
+            atomic_store(&q->failed, 1);
+            break;
         }
     }
+    return NULL;
+}
 
-    if (file_exists) {
-        fprintf(stderr, "Error: File '%s' already exists in root directory\n", file_name);
-        fclose(file_to_add);
-        fclose(modify_img);
+// Store a file small enough for inline data while the batch is placed;
+// there are no blocks for a worker to fill
+static int add_inline(fs_image_t *fs, ingest_job_t *job) {
+    uint8_t data[INODE_INLINE_MAX] = {0};
+    FILE *src = fopen(job->path, "rb");
+    if (!src) {
+        perror(job->path);
         return 1;
     }
+    int rc = fs_read_source(src, data, job->size);
+    fclose(src);
+    if (rc != 0) return 1;
+    if (fs_write_inline(fs, job->name, data, job->size, &job->ino) != 0) return 1;
+    job->crc = crc32(data, (size_t)job->size);
+    job->inline_data = 1;
+    return 0;
+}
 
-    if (free_entry == -1) {
-        fprintf(stderr, "No free directory entries in root\n");
-        fclose(file_to_add);
-        fclose(modify_img);
+// Add a batch with `jobs` threads. Inodes, bitmaps and dirents are assigned
+// serially up front; the workers only read the sources and pwrite the data
+// into the preassigned extents, each computing its file's CRC32. Compressed
+// files get room for their worst case and give back the unused blocks after.
+int add_files_parallel(fs_image_t *fs, const batch_file_t *files, size_t count, int jobs, int compress) {
+    ingest_queue_t q = { .count = count, .img_fd = fileno(fs->img), .compress = compress };
+    q.jobs = calloc(count, sizeof(*q.jobs));
+    if (!q.jobs) {
+        perror("Failed to allocate job list");
         return 1;
     }
+    atomic_init(&q.next, 0);
+    atomic_init(&q.failed, 0);
+
+    int status = 1;
+    size_t placed = 0;
+    for (; placed < count; placed++) {
+        ingest_job_t *job = &q.jobs[placed];
+        struct stat st;
+        if (stat(files[placed].path, &st) != 0) {
+            perror(files[placed].path);
+            goto out;
+        }
+        job->path = files[placed].path;
+        job->name = files[placed].name;
+        job->size = (uint64_t)st.st_size;
+        if (job->size > 0 && job->size <= INODE_INLINE_MAX) {
+            if (add_inline(fs, job) != 0) goto out;
+            continue;
+        }
+        if ((compress ? fs_create_compressed : fs_create_file)(fs, job->name, job->size, &job->ino,
+                                                              &job->extents, &job->nextents) != 0) goto out;
+        uint64_t blocks = compress ? fs_compressed_bound(job->size) : (job->size + BS - 1) / BS;
+        if ((fs->sb.flags & SB_FEAT_DATA_CSUM) && blocks &&
+            !(job->block_crcs = malloc(blocks * sizeof(*job->block_crcs)))) {
+            perror("Failed to allocate checksum list");
+            goto out;
+        }
+    }
 
-    //Create new file inode
-    inode_t new_inode = {0};
-    new_inode.mode = 0100000; 
-    new_inode.links = 1;
-    new_inode.uid = 0;
-    new_inode.gid = 0;
-    new_inode.size_bytes = file_size;
-    new_inode.atime = time(NULL);
-    new_inode.mtime = time(NULL);
-    new_inode.ctime = time(NULL);
-    memcpy(new_inode.direct, data_blocks, sizeof(uint32_t) * DIRECT_MAX);
-    new_inode.proj_id = PROJECT_ID;
-    new_inode.uid16_gid16 = 0;
-    new_inode.xattr_ptr = 0;
-
-    inode_to_disk(&new_inode);
-    inode_crc_finalize(&new_inode);
-
-    //Write new inode to inode table
-    fseek(modify_img, sb.inode_table_start * BS + free_inode * INODE_SIZE, SEEK_SET);
-    if (fwrite(&new_inode, sizeof(new_inode), 1, modify_img) != 1) {
-        perror("Failed to write new inode");
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
+    //Nothing may sit in the image's stdio buffer while workers pwrite
+    if (fflush(fs->img) != 0) {
+        perror("Failed to flush image");
+        goto out;
+    }
+
+    pthread_t *threads = malloc((size_t)jobs * sizeof(*threads));
+    if (!threads) {
+        perror("Failed to allocate worker threads");
+        goto out;
+    }
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, ingest_worker, &q) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            atomic_store(&q.failed, 1);
+            break;
+        }
+    }
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    if (started == 0 || atomic_load(&q.failed)) goto out;
+
+    for (size_t i = 0; i < count; i++) {
+        ingest_job_t *job = &q.jobs[i];
+        if (job->inline_data) continue;
+        if (compress &&
+            fs_finish_compressed(fs, job->ino, job->extents, job->nextents, job->used, job->packed) != 0)
+            goto out;
+        if (job->block_crcs && job->used && fs_store_checksums(fs, job->ino, job->block_crcs, job->used) != 0)
+            goto out;
+    }
+    for (size_t i = 0; i < count; i++) {
+        printf("File '%s' added successfully to inode %u\n", q.jobs[i].name, q.jobs[i].ino);
+        printf("File size: %" PRIu64 " bytes, %" PRIu64 " blocks, CRC32 %08x\n",
+               q.jobs[i].size, q.jobs[i].used, q.jobs[i].crc);
     }
+    status = 0;
+
+out:
+    for (size_t i = 0; i < count; i++) {
+        free(q.jobs[i].extents);
+        free(q.jobs[i].block_crcs);
+    }
+    free(q.jobs);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
 
-    //Mark inode as allocated
-    set_bit(inode_bitmap, free_inode);
-    fseek(modify_img, sb.inode_bitmap_start * BS, SEEK_SET);
-    if (fwrite(inode_bitmap, BS, 1, modify_img) != 1) {
-        perror("Failed to update inode bitmap");
-        fclose(file_to_add);
-        fclose(modify_img);
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s --input <input.img> (--output <output.img> | --in-place) --file <path> [--file <path> ...] [--manifest <list.txt>] [--tree <dir> ...] [--mkdir <path> ...] [--remove <path> ...] [--replace | --append] [--mmap] [--jobs <n>] [--io <uring|psync>] [--compress | --dedup]\n", argv[0]);
         return 1;
     }
 
-    //Write file data to data blocks
-    uint8_t file_buffer[BS];
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        size_t bytes_read = fread(file_buffer, 1, BS, file_to_add);
-        if (bytes_read < BS && ferror(file_to_add)) {
-            perror("Failed to read file");
-            fclose(file_to_add);
-            fclose(modify_img);
-            return 1;
+    const char *input_name = NULL;
+    const char *output_name = NULL;
+    batch_file_t *files = NULL;
+    size_t file_count = 0, file_cap = 0;
+    const char **mkdirs = NULL;
+    size_t mkdir_count = 0, mkdir_cap = 0;
+    const char **removes = NULL;
+    size_t remove_count = 0, remove_cap = 0;
+    int replace = 0, append = 0;
+    update_t *updates = NULL;
+    size_t update_count = 0;
+    uint64_t update_need = 0;
+    tree_t tree = {0};
+    int in_place = 0;
+    int jobs = 1;
+    int compress = 0;
+    int dedup = 0;
+    unsigned open_flags = 0;
+    char journal_name[4096];
+    int status = 1;
+
+    //Parse command line args, --file may be repeated
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--in-place") == 0) {
+            in_place = 1;
+            continue;
         }
-        
-        //Pad last block with zeros if needed
-        if (bytes_read < BS) {
-            memset(file_buffer + bytes_read, 0, BS - bytes_read);
-        }
-        
-        fseek(modify_img, data_blocks[i] * BS, SEEK_SET);
-        if (fwrite(file_buffer, BS, 1, modify_img) != 1) {
-            perror("Failed to write file data");
-            fclose(file_to_add);
-            fclose(modify_img);
-            return 1;
+        if (strcmp(argv[i], "--mmap") == 0) {
+            open_flags |= FS_OPEN_MMAP;
+            continue;
+        }
+        if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--replace") == 0) {
+            replace = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--append") == 0) {
+            append = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            goto out_args;
+        }
+        if (strcmp(argv[i], "--input") == 0) input_name = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0) output_name = argv[++i];
+        else if (strcmp(argv[i], "--file") == 0) {
+            if (push_file(&files, &file_count, &file_cap, strdup(argv[++i]), 0) != 0) goto out_args;
+        }
+        else if (strcmp(argv[i], "--tree") == 0) {
+            if (import_tree(argv[++i], &tree, &files, &file_count, &file_cap) != 0) goto out_args;
+        }
+        else if (strcmp(argv[i], "--mkdir") == 0) {
+            if (push_name(&mkdirs, &mkdir_count, &mkdir_cap, strdup(argv[++i])) != 0) goto out_args;
+        }
+        else if (strcmp(argv[i], "--remove") == 0) {
+            if (push_name(&removes, &remove_count, &remove_cap, strdup(argv[++i])) != 0) goto out_args;
+        }
+        else if (strcmp(argv[i], "--manifest") == 0) {
+            if (load_manifest(argv[++i], &files, &file_count, &file_cap) != 0) goto out_args;
+        }
+        else if (strcmp(argv[i], "--io") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "psync") == 0) open_flags |= FS_OPEN_PSYNC;
+            else if (strcmp(name, "uring") != 0) {
+                fprintf(stderr, "Error: Unknown I/O backend '%s'\n", name);
+                goto out_args;
+            }
+        }
+        else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) {
+                fprintf(stderr, "Error: --jobs must be at least 1\n");
+                goto out_args;
+            }
         }
     }
 
-    //Update data bitmap
-    fseek(modify_img, sb.data_bitmap_start * BS, SEEK_SET);
-    if (fwrite(data_bitmap, BS, 1, modify_img) != 1) {
-        perror("Failed to update data bitmap");
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
+    if (!input_name || (!output_name && !in_place) || file_count + tree.count + mkdir_count + remove_count == 0) {
+        fprintf(stderr, "Missing required arguments\n");
+        goto out_args;
     }
 
-    //Add directory entry
-    dirent64_t new_entry = {0};
-    new_entry.ino = free_inode + 1; // Inodes are 1-indexed
-    new_entry.type = 1; 
-    strncpy(new_entry.name, file_name, sizeof(new_entry.name) - 1);
-    new_entry.name[sizeof(new_entry.name) - 1] = '\0';
-    
-    dirent_to_disk(&new_entry);
-    dirent_checksum_finalize(&new_entry);
-
-    memcpy(&entries[free_entry], &new_entry, sizeof(new_entry));
-    fseek(modify_img, root_inode.direct[0] * BS, SEEK_SET);
-    if (fwrite(root_dir_block, BS, 1, modify_img) != 1) {
-        perror("Failed to update root directory");
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
+    if (in_place && output_name) {
+        fprintf(stderr, "Error: --in-place and --output are mutually exclusive\n");
+        goto out_args;
     }
 
-    //Update root inode size, link count, and timestamps
-    root_inode.size_bytes += sizeof(dirent64_t);
-    root_inode.links += 1;  //New file's .. points to root
-    root_inode.mtime = time(NULL);
-    root_inode.ctime = time(NULL);
-    
-    inode_to_disk(&root_inode);
-    inode_crc_finalize(&root_inode);
-    
-    fseek(modify_img, sb.inode_table_start * BS, SEEK_SET);
-    if (fwrite(&root_inode, sizeof(root_inode), 1, modify_img) != 1) {
-        perror("Failed to update root inode");
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
+    if (replace && append) {
+        fprintf(stderr, "Error: --replace and --append are mutually exclusive\n");
+        goto out_args;
     }
 
-    //Update superblock checksum after all modifications
-    sb.mtime_epoch = time(NULL);
-    superblock_to_disk(&sb);
-    superblock_crc_finalize(&sb);
-    
-    
-    fseek(modify_img, 0, SEEK_SET);
-    if (fwrite(&sb, sizeof(sb), 1, modify_img) != 1) {
-        perror("Failed to update superblock");
-        fclose(file_to_add);
-        fclose(modify_img);
-        return 1;
+    //Every block looks up and extends the one index, so dedup runs serially
+    if (dedup && (compress || jobs > 1)) {
+        fprintf(stderr, "Error: --dedup cannot be combined with --compress or --jobs\n");
+        goto out_args;
     }
 
-    
-    fclose(file_to_add);
-    fclose(modify_img);
+    //Check filename length before any processing; every directory on a
+    //file's path becomes a directory in the image
+    for (size_t i = 0; i < file_count; i++) {
+        if (!path_fits(files[i].name)) {
+            fprintf(stderr, "Error: Filename '%s' too long (max %u characters per component)\n", files[i].name,
+                    NAME_MAX_LEN);
+            goto out_args;
+        }
+    }
 
-    printf("File '%s' added successfully to inode %d\n", file_name, free_inode + 1);
-    printf("File size: %lu bytes, %lu blocks\n", file_size, blocks_needed);
-    printf("Output saved to: %s\n", output_name);
+    fs_image_t fs = {0};
+    if (in_place) {
+        //Finish or discard a commit interrupted by a crash before reading metadata
+        snprintf(journal_name, sizeof(journal_name), "%s.journal", input_name);
+        if (fs_journal_replay(input_name, journal_name) != 0) goto out_args;
+
+        output_name = input_name;
+    } else {
+        //Open input file system image
+        FILE *input_img = fopen(input_name, "rb");
+        if (!input_img) {
+            perror("Failed to open input image");
+            goto out_args;
+        }
 
-    return 0;
+        //Create output file
+        FILE *output_img = fopen(output_name, "wb");
+        if (!output_img) {
+            perror("Failed to create output image");
+            fclose(input_img);
+            goto out_args;
+        }
+
+        //Copy input file to output file once for the whole batch. All-zero
+        //blocks are skipped so a sparse image stays sparse.
+        static const uint8_t zero_block[BS];
+        uint8_t copy_buffer[BS];
+        size_t bytes_read;
+        uint64_t copied = 0;
+        rewind(input_img);
+        while ((bytes_read = fread(copy_buffer, 1, BS, input_img)) > 0) {
+            copied += bytes_read;
+            if (bytes_read == BS && memcmp(copy_buffer, zero_block, BS) == 0) {
+                fseek(output_img, BS, SEEK_CUR);
+                continue;
+            }
+            if (fwrite(copy_buffer, 1, bytes_read, output_img) != bytes_read) {
+                perror("Failed to copy input to output");
+                fclose(input_img);
+                fclose(output_img);
+                goto out_args;
+            }
+        }
+        fclose(input_img);
+        if (fflush(output_img) != 0 || ftruncate(fileno(output_img), (off_t)copied) != 0) {
+            perror("Failed to copy input to output");
+            fclose(output_img);
+            goto out_args;
+        }
+        fclose(output_img);
+    }
+
+    if (fs_open(&fs, output_name, open_flags) != 0) goto out_fs;
+
+    //Removals first, so a name can be removed and added again in one run
+    for (size_t i = 0; i < remove_count; i++) {
+        if (fs_remove(&fs, removes[i]) != 0) goto out_fs;
+        printf("Removed '%s'\n", removes[i]);
+    }
+    //Everything is checked before the first file is written
+    if ((replace || append) &&
+        plan_updates(&fs, files, &file_count, append, &updates, &update_count, &update_need) != 0)
+        goto out_fs;
+    if (check_space(&fs, files, file_count, tree.count, compress, update_need) != 0) goto out_fs;
+    if (make_dirs(&fs, &tree, mkdirs, mkdir_count, files, file_count) != 0) goto out_fs;
+
+    for (size_t i = 0; i < update_count; i++)
+        if (update_file(&fs, &updates[i], append, dedup ? STORE_DEDUP : compress ? STORE_COMPRESS : STORE_PLAIN) != 0)
+            goto out_fs;
+
+    if (jobs > 1 && file_count > 0) {
+        if (add_files_parallel(&fs, files, file_count, jobs, compress) != 0) goto out_fs;
+    } else {
+        for (size_t i = 0; i < file_count; i++) {
+            if (add_file(&fs, &files[i], dedup ? STORE_DEDUP : compress ? STORE_COMPRESS : STORE_PLAIN) != 0) goto out_fs;
+        }
+    }
+
+    if (fs_commit(&fs, in_place ? journal_name : NULL) != 0) goto out_fs;
+
+    if (in_place) printf("Updated %s in place\n", input_name);
+    else printf("Output saved to: %s\n", output_name);
+    printf("Free: %" PRIu64 " blocks, %" PRIu64 " inodes\n", fs.data_bm.nfree, fs.inode_bm.nfree);
+    status = 0;
+
+out_fs:
+    fs_close(&fs);
+out_args:
+    for (size_t i = 0; i < file_count; i++) free(files[i].path);
+    free(files);
+    for (size_t i = 0; i < update_count; i++) free(updates[i].path);
+    free(updates);
+    for (size_t i = 0; i < mkdir_count; i++) free((void *)mkdirs[i]);
+    free(mkdirs);
+    for (size_t i = 0; i < remove_count; i++) free((void *)removes[i]);
+    free(removes);
+    for (size_t i = 0; i < tree.count; i++) free(tree.dirs[i].path);
+    free(tree.dirs);
+    return status;
 }
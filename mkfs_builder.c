@@ -1,182 +1,263 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o mkfs_builder
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c minivsfs.c blkio.c crc32.c lz.c -o mkfs_builder
 #define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "minivsfs.h"
+
+#define MIN_SIZE_KIB 180u
+#define MAX_SIZE_KIB ((uint64_t)UINT32_MAX * (BS / 1024)) // block numbers are 32-bit
+#define MIN_INODES 128u
+#define MAX_INODES ((uint64_t)UINT32_MAX - 1)            // inode numbers are 32-bit
+
+// One directory or regular file of a --from-dir source tree
+typedef struct {
+    char *host;                  // path on the host
+    char *name;                  // path in the image, relative to the source
+    uint64_t size;               // bytes of a file, entries of a directory
+    int dir;
+} tree_node_t;
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define PROJECT_ID 9u
-
-//little-endian conversion
-static inline uint16_t to_le16(uint16_t x) {
-    return ((x & 0x00FFu) << 8) | ((x & 0xFF00u) >> 8);
-}
-static inline uint32_t to_le32(uint32_t x) {
-    return ((x & 0x000000FFu) << 24) |
-           ((x & 0x0000FF00u) << 8)  |
-           ((x & 0x00FF0000u) >> 8)  |
-           ((x & 0xFF000000u) >> 24);
-}
-static inline uint64_t to_le64(uint64_t x) {
-    return ((uint64_t)to_le32((uint32_t)(x & 0xFFFFFFFFu)) << 32) |
-           (uint64_t)to_le32((uint32_t)(x >> 32));
-}
-
-#pragma pack(push, 1)
+// The source tree in walk order, each directory before what it holds
+typedef struct {
+    tree_node_t *nodes;
+    size_t count;
+    size_t cap;
+    size_t ndirs;
+    uint64_t root_entries;
+    uint64_t file_bytes;
+    uint64_t data_blocks;        // blocks the files and directories need
+} tree_plan_t;
+
+// Block counts of each metadata region of an image
 typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
+    uint64_t inode_table_blocks;
     uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
     uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) <= BS, "superblock must fit in one block");
-
-#pragma pack(push, 1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t ino;
-    uint8_t type;
-    char name[58];
-    uint8_t checksum;
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
-
-// CRC32 helpers
-uint32_t CRC32_TAB[256];
-void crc32_init(void) {
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; j++)
-            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
-        CRC32_TAB[i] = c;
+    uint64_t group_desc_blocks;
+    uint64_t meta_blocks;        // all of the above plus the superblock
+} layout_t;
+
+// Bitmaps take as many blocks as their bit counts need. The data bitmap
+// and group descriptor table sizes depend on the data region, which
+// shrinks as they grow, so iterate until they settle. One group spans
+// exactly one data bitmap block.
+static void plan_layout(uint64_t total_blocks, uint64_t inode_count, layout_t *l) {
+    l->inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS;
+    l->inode_bitmap_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    l->data_bitmap_blocks = 1;
+    l->group_desc_blocks = 1;
+    for (;;) {
+        l->meta_blocks = 1 + l->group_desc_blocks + l->inode_bitmap_blocks + l->data_bitmap_blocks +
+                         l->inode_table_blocks;
+        if (l->meta_blocks >= total_blocks) break;
+        uint64_t need = (total_blocks - l->meta_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        uint64_t need_gd = (need + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+        if (need <= l->data_bitmap_blocks && need_gd <= l->group_desc_blocks) break;
+        if (need > l->data_bitmap_blocks) l->data_bitmap_blocks = need;
+        if (need_gd > l->group_desc_blocks) l->group_desc_blocks = need_gd;
     }
 }
-uint32_t crc32(const void* data, size_t n) {
-    const uint8_t* p = (const uint8_t*)data;
-    uint32_t c = 0xFFFFFFFFu;
-    for (size_t i = 0; i < n; i++)
-        c = CRC32_TAB[(c ^ p[i]) & 0xFF] ^ (c >> 8);
-    return c ^ 0xFFFFFFFFu;
-}
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *)sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-void inode_crc_finalize(inode_t* ino) {
-    uint8_t tmp[INODE_SIZE];
-    memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
+
+// Append a node; its paths are freed if that fails
+static int add_node(tree_plan_t *p, char *host, char *name, uint64_t size, int dir) {
+    if (p->count == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        tree_node_t *grown = realloc(p->nodes, cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow tree list");
+            free(host);
+            free(name);
+            return 1;
+        }
+        p->nodes = grown;
+        p->cap = cap;
+    }
+    p->nodes[p->count++] = (tree_node_t){ host, name, size, dir };
+    return 0;
 }
 
-// Manual LE conversion for structs
-void superblock_to_le(superblock_t *sb) {
-    sb->magic              = to_le32(sb->magic);
-    sb->version            = to_le32(sb->version);
-    sb->block_size         = to_le32(sb->block_size);
-    sb->total_blocks       = to_le64(sb->total_blocks);
-    sb->inode_count        = to_le64(sb->inode_count);
-    sb->inode_bitmap_start = to_le64(sb->inode_bitmap_start);
-    sb->inode_bitmap_blocks= to_le64(sb->inode_bitmap_blocks);
-    sb->data_bitmap_start  = to_le64(sb->data_bitmap_start);
-    sb->data_bitmap_blocks = to_le64(sb->data_bitmap_blocks);
-    sb->inode_table_start  = to_le64(sb->inode_table_start);
-    sb->inode_table_blocks = to_le64(sb->inode_table_blocks);
-    sb->data_region_start  = to_le64(sb->data_region_start);
-    sb->data_region_blocks = to_le64(sb->data_region_blocks);
-    sb->root_inode         = to_le64(sb->root_inode);
-    sb->mtime_epoch        = to_le64(sb->mtime_epoch);
-    sb->flags              = to_le32(sb->flags);
+// Planning pass: record everything below host directory `host` (image
+// path `name`, "" for the source itself) and add up the data blocks it
+// will take. Symlinks and special files are skipped.
+static int walk_source(tree_plan_t *p, const char *host, const char *name, int data_csum, uint64_t *entries) {
+    DIR *dir = opendir(host);
+    if (!dir) {
+        perror(host);
+        return 1;
+    }
+    *entries = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (strlen(de->d_name) > NAME_MAX_LEN) {
+            fprintf(stderr, "Error: Filename '%s' too long (max %u characters)\n", de->d_name, NAME_MAX_LEN);
+            goto fail;
+        }
+        size_t hlen = strlen(host) + strlen(de->d_name) + 2, nlen = strlen(name) + strlen(de->d_name) + 2;
+        char *child_host = malloc(hlen), *child_name = malloc(nlen);
+        if (!child_host || !child_name) {
+            perror("Failed to store path");
+            free(child_host);
+            free(child_name);
+            goto fail;
+        }
+        snprintf(child_host, hlen, "%s/%s", host, de->d_name);
+        snprintf(child_name, nlen, "%s%s%s", name, *name ? "/" : "", de->d_name);
+        struct stat st;
+        if (lstat(child_host, &st) != 0) {
+            perror(child_host);
+            free(child_host);
+            free(child_name);
+            goto fail;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            printf("Skipping '%s': not a regular file or directory\n", child_host);
+            free(child_host);
+            free(child_name);
+            continue;
+        }
+        (*entries)++;
+        if (S_ISDIR(st.st_mode)) {
+            size_t self = p->count;
+            if (add_node(p, child_host, child_name, 0, 1) != 0) goto fail;
+            p->ndirs++;
+            uint64_t below;
+            if (walk_source(p, p->nodes[self].host, p->nodes[self].name, data_csum, &below) != 0) goto fail;
+            p->nodes[self].size = below;
+            p->data_blocks += fs_dir_blocks(below);
+            continue;
+        }
+        uint64_t size = (uint64_t)st.st_size;
+        if (add_node(p, child_host, child_name, size, 0) != 0) goto fail;
+        uint64_t blocks = size > INODE_INLINE_MAX ? (size + BS - 1) / BS : 0;
+        p->file_bytes += size;
+        p->data_blocks += blocks;
+        if (data_csum) p->data_blocks += (blocks + CSUM_BLOCK_MAX - 1) / CSUM_BLOCK_MAX;
+    }
+    closedir(dir);
+    return 0;
+
+fail:
+    closedir(dir);
+    return 1;
 }
-void inode_to_le(inode_t *in) {
-    in->mode        = to_le16(in->mode);
-    in->links       = to_le16(in->links);
-    in->uid         = to_le32(in->uid);
-    in->gid         = to_le32(in->gid);
-    in->size_bytes  = to_le64(in->size_bytes);
-    in->atime       = to_le64(in->atime);
-    in->mtime       = to_le64(in->mtime);
-    in->ctime       = to_le64(in->ctime);
-    for (int i = 0; i < 12; i++) in->direct[i] = to_le32(in->direct[i]);
-    in->reserved_0  = to_le32(in->reserved_0);
-    in->reserved_1  = to_le32(in->reserved_1);
-    in->reserved_2  = to_le32(in->reserved_2);
-    in->proj_id     = to_le32(in->proj_id);
-    in->uid16_gid16 = to_le32(in->uid16_gid16);
-    in->xattr_ptr   = to_le64(in->xattr_ptr);
+
+// Write pass: create every directory of the plan in one batch, at its
+// final size, then stream the files into blocks allocated in walk order.
+// The metadata is built in memory and written by a single commit.
+static int import_tree(const char *image_name, unsigned open_flags, const tree_plan_t *p) {
+    fs_image_t fs = {0};
+    const char **paths = malloc((p->ndirs ? p->ndirs : 1) * sizeof(*paths));
+    uint64_t *entries = malloc((p->ndirs ? p->ndirs : 1) * sizeof(*entries));
+    int status = 1;
+    if (!paths || !entries) {
+        perror("Failed to allocate directory list");
+        goto out;
+    }
+    size_t ndirs = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (!p->nodes[i].dir) continue;
+        paths[ndirs] = p->nodes[i].name;
+        entries[ndirs++] = p->nodes[i].size;
+    }
+
+    if (fs_open(&fs, image_name, open_flags) != 0) goto out;
+    if (fs_dir_grow(&fs, &fs.root, p->root_entries) != 0) goto out;
+    if (fs_mkdirs(&fs, paths, entries, ndirs, NULL) != 0) goto out;
+    for (size_t i = 0; i < p->count; i++) {
+        const tree_node_t *n = &p->nodes[i];
+        if (n->dir) continue;
+        FILE *src = fopen(n->host, "rb");
+        if (!src) {
+            perror(n->host);
+            goto out;
+        }
+        uint32_t ino;
+        int rc = fs_write_file(&fs, n->name, src, n->size, &ino);
+        fclose(src);
+        if (rc != 0) goto out;
+    }
+    if (fs_commit(&fs, NULL) != 0) goto out;
+    printf("Imported %zu files in %zu directories, %" PRIu64 " bytes\n", p->count - p->ndirs, p->ndirs,
+           p->file_bytes);
+    printf("Free: %" PRIu64 " blocks, %" PRIu64 " inodes\n", fs.data_bm.nfree, fs.inode_bm.nfree);
+    status = 0;
+
+out:
+    fs_close(&fs);
+    free(paths);
+    free(entries);
+    return status;
 }
-void dirent_to_le(dirent64_t *de) {
-    de->ino = to_le32(de->ino);
+
+// A non-zero run of blocks to emit; everything else is left as a hole
+typedef struct {
+    uint64_t blkno;
+    const uint8_t *data;
+    uint64_t nblocks;
+} out_block_t;
+
+// Write all runs as one batch of requests. The superblock run (block 0)
+// goes last, ordered behind an fsync of the rest, and is synced itself.
+int write_blocks(blkio_t *io, const out_block_t *blocks, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        if (blocks[i].blkno != 0)
+            blkio_write(io, blocks[i].data, blocks[i].nblocks * BS, blocks[i].blkno * BS);
+    for (size_t i = 0; i < count; i++)
+        if (blocks[i].blkno == 0) blkio_write_ordered(io, blocks[i].data, blocks[i].nblocks * BS, 0);
+    if (blkio_wait(io) != 0) {
+        perror("write");
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
     crc32_init();
 
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s --image <out.img> --size-kib <180..4096> --inodes <128..512>\n", argv[0]);
+    if (argc < 5 || argc > 12) {
+        fprintf(stderr, "Usage: %s --image <out.img> --size-kib <%u..%" PRIu64 "> --inodes <%u..%" PRIu64 "> [--io <uring|psync>] [--data-csum]\n",
+                argv[0], MIN_SIZE_KIB, MAX_SIZE_KIB, MIN_INODES, MAX_INODES);
+        fprintf(stderr, "       %s --image <out.img> --from-dir <dir> [--size-kib <n>] [--inodes <n>] [--io <uring|psync>] [--data-csum]\n",
+                argv[0]);
         fprintf(stderr, "Note: Size must be a multiple of 4\n");
         return 1;
     }
 
     const char* image_name = NULL;
+    const char* from_dir = NULL;
     uint64_t size_kib = 0;
     uint64_t inode_count = 0;
+    int backend = BLKIO_AUTO;
+    int data_csum = 0;
 
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--image") == 0) image_name = argv[++i];
+        if (strcmp(argv[i], "--data-csum") == 0) data_csum = 1;
+        else if (i + 1 == argc) break;
+        else if (strcmp(argv[i], "--image") == 0) image_name = argv[++i];
         else if (strcmp(argv[i], "--size-kib") == 0) size_kib = strtoull(argv[++i], NULL, 10);
         else if (strcmp(argv[i], "--inodes") == 0) inode_count = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--from-dir") == 0) from_dir = argv[++i];
+        else if (strcmp(argv[i], "--io") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "uring") == 0) backend = BLKIO_URING;
+            else if (strcmp(name, "psync") == 0) backend = BLKIO_PSYNC;
+            else {
+                fprintf(stderr, "Error: Unknown I/O backend '%s'\n", name);
+                return 1;
+            }
+        }
     }
 
     //validation with error messages
@@ -185,36 +266,95 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    if (size_kib < 180 || size_kib > 4096) {
-        fprintf(stderr, "Error: Size must be between 180 and 4096 KiB (got %lu)\n", size_kib);
-        return 1;
+    //Planning pass: with --from-dir whatever size and inode count is not
+    //given comes from the source tree
+    tree_plan_t plan = {0};
+    uint64_t plan_blocks = 0;
+    int status = 1;
+    if (from_dir) {
+        if (walk_source(&plan, from_dir, "", data_csum, &plan.root_entries) != 0) goto out;
+        //The root directory is grown once to its final size; its first
+        //block stays in use until the commit releases it
+        plan_blocks = 1 + plan.data_blocks;
+        if (plan.root_entries + 2 > DIRENTS_PER_BLOCK) plan_blocks += fs_dir_blocks(plan.root_entries);
+
+        uint64_t per_block = BS / INODE_SIZE;
+        if (!inode_count) {
+            inode_count = (1 + plan.count + per_block - 1) / per_block * per_block;
+            if (inode_count < MIN_INODES) inode_count = MIN_INODES;
+        } else if (inode_count < 1 + plan.count) {
+            fprintf(stderr, "Error: '%s' needs %zu inodes (got %" PRIu64 ")\n", from_dir, 1 + plan.count, inode_count);
+            goto out;
+        }
+        if (!size_kib) {
+            //A margin covers extent blocks of files split at group boundaries
+            uint64_t want = plan_blocks + plan_blocks / 64 + 16, total = want;
+            layout_t l;
+            for (;;) {
+                plan_layout(total, inode_count, &l);
+                if (total > l.meta_blocks && total - l.meta_blocks >= want) break;
+                total = want + l.meta_blocks;
+            }
+            size_kib = total * (BS / 1024);
+            if (size_kib < MIN_SIZE_KIB) size_kib = MIN_SIZE_KIB;
+        }
+    }
+
+    if (size_kib < MIN_SIZE_KIB || size_kib > MAX_SIZE_KIB) {
+        fprintf(stderr, "Error: Size must be between %u and %" PRIu64 " KiB (got %" PRIu64 ")\n",
+                MIN_SIZE_KIB, MAX_SIZE_KIB, size_kib);
+        goto out;
     }
 
     if (size_kib % 4 != 0) {
-        fprintf(stderr, "Error: Size must be a multiple of 4 (got %lu)\n", size_kib);
-        fprintf(stderr, "Valid sizes: 180, 184, 188, 192, ..., 4092, 4096\n");
-        return 1;
+        fprintf(stderr, "Error: Size must be a multiple of 4 (got %" PRIu64 ")\n", size_kib);
+        fprintf(stderr, "Valid sizes: 180, 184, 188, 192, ...\n");
+        goto out;
     }
 
-    if (inode_count < 128 || inode_count > 512) {
-        fprintf(stderr, "Error: Inode count must be between 128 and 512 (got %lu)\n", inode_count);
-        return 1;
+    if (inode_count < MIN_INODES || inode_count > MAX_INODES) {
+        fprintf(stderr, "Error: Inode count must be between %u and %" PRIu64 " (got %" PRIu64 ")\n",
+                MIN_INODES, MAX_INODES, inode_count);
+        goto out;
     }
 
-    
     uint64_t total_blocks = (size_kib * 1024u) / BS;
-    uint64_t inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS;
-    uint64_t inode_bitmap_start  = 1;
-    uint64_t inode_bitmap_blocks = 1;
-    uint64_t data_bitmap_start   = 2;
-    uint64_t data_bitmap_blocks  = 1;
-    uint64_t inode_table_start   = 3;
+    layout_t layout;
+    plan_layout(total_blocks, inode_count, &layout);
+    uint64_t inode_table_blocks  = layout.inode_table_blocks;
+    uint64_t inode_bitmap_blocks = layout.inode_bitmap_blocks;
+    uint64_t data_bitmap_blocks  = layout.data_bitmap_blocks;
+    uint64_t group_desc_blocks   = layout.group_desc_blocks;
+    uint64_t meta_blocks         = layout.meta_blocks;
+
+    if (meta_blocks >= total_blocks) {
+        fprintf(stderr, "Error: %" PRIu64 " inodes need %" PRIu64 " metadata blocks, image only has %" PRIu64 "\n",
+                inode_count, meta_blocks, total_blocks);
+        goto out;
+    }
+
+    uint64_t group_desc_start    = 1;
+    uint64_t inode_bitmap_start  = group_desc_start + group_desc_blocks;
+    uint64_t data_bitmap_start   = inode_bitmap_start + inode_bitmap_blocks;
+    uint64_t inode_table_start   = data_bitmap_start + data_bitmap_blocks;
     uint64_t data_region_start   = inode_table_start + inode_table_blocks;
     uint64_t data_region_blocks  = total_blocks - data_region_start;
+    if (from_dir && data_region_blocks < plan_blocks) {
+        fprintf(stderr, "Error: '%s' needs %" PRIu64 " data blocks, the image only has %" PRIu64 "\n", from_dir,
+                plan_blocks, data_region_blocks);
+        goto out;
+    }
+
+    //Inodes are spread evenly over the groups in whole inode table blocks
+    uint64_t blocks_per_group = BITS_PER_BLOCK;
+    uint64_t group_count = (data_region_blocks + blocks_per_group - 1) / blocks_per_group;
+    uint64_t inodes_per_block = BS / INODE_SIZE;
+    uint64_t inodes_per_group = (inode_count + group_count - 1) / group_count;
+    inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
 
 
     superblock_t sb = {0};
-    sb.magic              = 0x4D565346u; // 'MVSF'
+    sb.magic              = SB_MAGIC;
     sb.version            = 1;
     sb.block_size         = BS;
     sb.total_blocks       = total_blocks;
@@ -229,34 +369,34 @@ int main(int argc, char* argv[]) {
     sb.data_region_blocks = data_region_blocks;
     sb.root_inode         = ROOT_INO;
     sb.mtime_epoch        = (uint64_t)time(NULL);
-    sb.flags              = 0;
+    sb.flags              = SB_FEAT_GROUPS | SB_FEAT_FREE_COUNTS | (data_csum ? SB_FEAT_DATA_CSUM : 0);
+    sb.group_desc_start   = group_desc_start;
+    sb.group_desc_blocks  = group_desc_blocks;
+    sb.group_count        = group_count;
+    sb.blocks_per_group   = blocks_per_group;
+    sb.inodes_per_group   = inodes_per_group;
+    sb.free_blocks        = data_region_blocks - 1; // root directory block
+    sb.free_inodes        = inode_count - 1;        // root inode
 
     // Convert to LE and finalize checksum
-    superblock_to_le(&sb);
+    superblock_to_disk(&sb);
     superblock_crc_finalize(&sb);
 
-    FILE *img = fopen(image_name, "wb");
-    if (!img) { perror("fopen"); return 1; }
-
-    uint8_t block[BS];
+    //Only the superblock, bitmaps, root inode block and root directory block
+    //hold data. The file is sized with ftruncate so the rest stays a hole on
+    //filesystems that support sparse files and reads back as zeros.
+    static uint8_t sb_block[BS], inode_bitmap[BS], data_bitmap[BS], inode_block[BS], root_dir[BS];
 
     //Block 0: Superblock
-    memset(block, 0, BS);
-    memcpy(block, &sb, sizeof(sb));
-    fwrite(block, BS, 1, img);
+    memcpy(sb_block, &sb, sizeof(sb));
 
-    //Block 1: Inode bitmap (mark inode #1 used)
-    memset(block, 0, BS);
-    block[0] |= 0x01;
-    fwrite(block, BS, 1, img);
+    //Inode bitmap (mark inode #1 used), only its first block is non-zero
+    inode_bitmap[0] |= 0x01;
 
-    //Block 2: Data bitmap (mark first data block used)
-    memset(block, 0, BS);
-    block[0] |= 0x01;
-    fwrite(block, BS, 1, img);
+    //Data bitmap (mark first data block used), likewise
+    data_bitmap[0] |= 0x01;
 
     //Inode table: first block contains root inode
-    memset(block, 0, BS);
     inode_t root = {0};
     root.mode        = 0040000; 
     root.links       = 2;
@@ -271,47 +411,97 @@ int main(int argc, char* argv[]) {
     root.uid16_gid16 = 0;
     root.xattr_ptr   = 0;
 
-    inode_to_le(&root);
+    inode_to_disk(&root);
     inode_crc_finalize(&root);
-    memcpy(block, &root, sizeof(root));
-    fwrite(block, BS, 1, img);
-
-    //Remaining inode table blocks zeroed
-    memset(block, 0, BS);
-    for (uint64_t i = 1; i < inode_table_blocks; i++)
-        fwrite(block, BS, 1, img);
+    memcpy(inode_block, &root, sizeof(root));
 
     //Data region: first block is root directory
-    memset(block, 0, BS);
     dirent64_t dot = {0};
     dot.ino  = ROOT_INO;
     dot.type = 2; 
     strncpy(dot.name, ".", sizeof(dot.name));
-    dirent_to_le(&dot);
+    dirent_to_disk(&dot);
     dirent_checksum_finalize(&dot);
-    memcpy(block, &dot, sizeof(dot));
+    memcpy(root_dir, &dot, sizeof(dot));
 
     dirent64_t dotdot = {0};
     dotdot.ino  = ROOT_INO;
     dotdot.type = 2;
     strncpy(dotdot.name, "..", sizeof(dotdot.name));
-    dirent_to_le(&dotdot);
+    dirent_to_disk(&dotdot);
     dirent_checksum_finalize(&dotdot);
-    memcpy(block + sizeof(dot), &dotdot, sizeof(dotdot));
+    memcpy(root_dir + sizeof(dot), &dotdot, sizeof(dotdot));
+
+    //Group descriptors: every group starts empty except for the root inode
+    //and root directory block in group 0
+    uint8_t *gdt = calloc(group_desc_blocks, BS);
+    if (!gdt) {
+        perror("malloc");
+        goto out;
+    }
+    for (uint64_t g = 0; g < group_count; g++) {
+        uint64_t first_block = g * blocks_per_group;
+        uint64_t first_inode = g * inodes_per_group;
+        group_desc_t gd = {0};
+        gd.free_blocks = (uint32_t)(data_region_blocks - first_block < blocks_per_group ?
+                                    data_region_blocks - first_block : blocks_per_group);
+        gd.free_inodes = (uint32_t)(first_inode >= inode_count ? 0 :
+                                    inode_count - first_inode < inodes_per_group ?
+                                    inode_count - first_inode : inodes_per_group);
+        if (g == 0) {
+            gd.free_blocks--;
+            gd.free_inodes--;
+        }
+        group_desc_to_disk(&gd);
+        memcpy(gdt + g * sizeof(gd), &gd, sizeof(gd));
+    }
 
-    fwrite(block, BS, 1, img);
+    out_block_t blocks[6];
+    size_t nblocks = 0;
+    blocks[nblocks++] = (out_block_t){ 0, sb_block, 1 };
+    blocks[nblocks++] = (out_block_t){ group_desc_start, gdt, group_desc_blocks };
+    blocks[nblocks++] = (out_block_t){ inode_bitmap_start, inode_bitmap, 1 };
+    blocks[nblocks++] = (out_block_t){ data_bitmap_start,  data_bitmap, 1 };
+    blocks[nblocks++] = (out_block_t){ inode_table_start,  inode_block, 1 };
+    blocks[nblocks++] = (out_block_t){ data_region_start,  root_dir, 1 };
+
+    int fd = open(image_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        free(gdt);
+        goto out;
+    }
 
-    //Remaining data blocks zeroed
-    memset(block, 0, BS);
-    for (uint64_t i = 1; i < data_region_blocks; i++)
-        fwrite(block, BS, 1, img);
+    blkio_t io;
+    blkio_init(&io, fd, backend);
+    if (ftruncate(fd, (off_t)(total_blocks * BS)) != 0) {
+        perror("ftruncate");
+    } else if (write_blocks(&io, blocks, nblocks) == 0) {
+        status = 0;
+    }
+    blkio_exit(&io);
+    free(gdt);
 
-    fclose(img);
+    if (close(fd) != 0) {
+        perror("close");
+        status = 1;
+    }
+    if (status != 0) goto out;
 
     printf("Filesystem image '%s' created successfully.\n", image_name);
     printf("Total blocks: %" PRIu64 "\n", total_blocks);
     printf("Inode count: %" PRIu64 "\n", inode_count);
     printf("Data region starts at block: %" PRIu64 "\n", data_region_start);
-
-    return 0;
+    printf("Block groups: %" PRIu64 " (%" PRIu64 " blocks, %" PRIu64 " inodes each)\n",
+           group_count, blocks_per_group, inodes_per_group);
+    if (from_dir) status = import_tree(image_name, backend == BLKIO_PSYNC ? FS_OPEN_PSYNC : 0, &plan);
+    else printf("Free: %" PRIu64 " blocks, %" PRIu64 " inodes\n", data_region_blocks - 1, inode_count - 1);
+
+out:
+    for (size_t i = 0; i < plan.count; i++) {
+        free(plan.nodes[i].host);
+        free(plan.nodes[i].name);
+    }
+    free(plan.nodes);
+    return status;
 }
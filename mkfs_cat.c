@@ -0,0 +1,343 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_cat.c minivsfs.c blkio.c crc32.c lz.c -o mkfs_cat
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "minivsfs.h"
+
+// Live entries of a directory other than "." and "..", in directory order.
+// The entries are copied first: fn may load other directories.
+static int for_each_entry(fs_image_t *fs, uint32_t dir_ino, int (*fn)(fs_image_t *, const dirent64_t *, void *),
+                          void *arg) {
+    fs_dir_t *d = fs_dir(fs, dir_ino);
+    if (!d) return 1;
+    dirent64_t *entries = malloc(d->live * sizeof(*entries));
+    if (!entries && d->live) {
+        perror("Failed to allocate directory listing");
+        return 1;
+    }
+    size_t n = 0;
+    const dirent64_t *all = (const dirent64_t *)d->ents;
+    for (size_t i = 2; i < (size_t)d->nblocks * DIRENTS_PER_BLOCK; i++)
+        if (all[i].ino != 0 && n < d->live) entries[n++] = all[i];
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; i++) rc = fn(fs, &entries[i], arg);
+    free(entries);
+    return rc;
+}
+
+typedef struct {
+    char path[4096];             // of the directory being listed, "" for the root
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+} listing_t;
+
+// One line per entry, directories followed by their contents
+static int list_entry(fs_image_t *fs, const dirent64_t *e, void *arg) {
+    listing_t *l = arg;
+    inode_t in;
+    if (fs_read_inode(fs, e->ino - 1, &in) != 0) return 1;
+    extent_t *extents;
+    size_t nextents;
+    if (fs_inode_map(fs, &in, &extents, &nextents) != 0) return 1;
+    uint64_t stored = 0;
+    for (size_t i = 0; i < nextents; i++) stored += (uint64_t)extents[i].len * BS;
+    free(extents);
+    int dir = e->type == DIRENT_DIR;
+    printf("%10u %14" PRIu64 " %14" PRIu64 " %6zu  %s%s%s\n", e->ino, in.size_bytes, stored, nextents, l->path,
+           e->name, dir ? "/" : "");
+    if (!dir) {
+        l->files++;
+        l->bytes += in.size_bytes;
+        return 0;
+    }
+
+    l->dirs++;
+    size_t len = strlen(l->path);
+    if (len + strlen(e->name) + 2 > sizeof(l->path)) {
+        fprintf(stderr, "Path too long under '%s'\n", l->path);
+        return 1;
+    }
+    sprintf(l->path + len, "%s/", e->name);
+    int rc = for_each_entry(fs, e->ino, list_entry, l);
+    l->path[len] = '\0';
+    return rc;
+}
+
+static int regular_file(fs_image_t *fs, uint32_t ino, inode_t *in) {
+    if (fs_read_inode(fs, ino - 1, in) != 0) return 0;
+    if ((in->mode & 0170000) != 0100000) {
+        fprintf(stderr, "Inode %u is not a regular file\n", ino);
+        return 0;
+    }
+    return 1;
+}
+
+// Write bytes [off, off + len) of a file to out_fd. Only the blocks in the
+// range are read, and on a checksummed file only those are verified.
+static int copy_range_out(fs_image_t *fs, uint32_t ino, int out_fd, uint64_t off, uint64_t len) {
+    inode_t in;
+    if (!regular_file(fs, ino, &in)) return 1;
+    size_t chunk = 1u << 20;
+    uint8_t *buf = malloc(chunk);
+    if (!buf) {
+        perror("Failed to allocate file buffer");
+        return 1;
+    }
+    int rc = 1;
+    while (len > 0) {
+        uint64_t got;
+        if (fs_read_file(fs, ino, buf, off, len < chunk ? len : chunk, &got) != 0) goto out;
+        if (got == 0) break; // past end of file
+        for (size_t done = 0; done < got; ) {
+            ssize_t w = write(out_fd, buf + done, (size_t)got - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) {
+                perror("Failed to write file data");
+                goto out;
+            }
+            done += (size_t)w;
+        }
+        off += got;
+        len -= got;
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
+
+// Stream one file's data to out_fd, a run of adjacent blocks at a time.
+// With verify, a checksummed file is checked block by block on the way.
+// A compressed file is decompressed chunk by chunk, always verified, and
+// inline data comes straight from the inode.
+static int copy_out(fs_image_t *fs, uint32_t ino, int out_fd, int verify, uint64_t *size_out) {
+    inode_t in;
+    if (!regular_file(fs, ino, &in)) return 1;
+    if (in.reserved_0 & (INODE_FL_COMPRESSED | INODE_FL_INLINE)) {
+        if (size_out) *size_out = in.size_bytes;
+        return copy_range_out(fs, ino, out_fd, 0, in.size_bytes);
+    }
+    extent_t *extents;
+    size_t nextents;
+    if (fs_inode_map(fs, &in, &extents, &nextents) != 0) return 1;
+    uint32_t *crcs = NULL;
+    uint64_t blocks = (in.size_bytes + BS - 1) / BS;
+    int rc = 1;
+    if (verify && (in.reserved_0 & INODE_FL_CSUM) && blocks) {
+        crcs = malloc(blocks * sizeof(*crcs));
+        if (!crcs) {
+            perror("Failed to allocate checksum list");
+            goto out;
+        }
+        if (fs_load_checksums(fs, &in, 0, blocks, crcs) != 0) goto out;
+    }
+    rc = fs_read_extents(fileno(fs->img), out_fd, in.size_bytes, extents, nextents, crcs);
+    if (size_out) *size_out = in.size_bytes;
+
+out:
+    free(crcs);
+    free(extents);
+    return rc;
+}
+
+typedef struct {
+    int verify;
+    int dir_fd;
+    uint64_t files;
+    uint64_t bytes;
+} extract_t;
+
+// Write a file into the current output directory, or recreate a directory
+// there with everything below it
+static int extract_entry(fs_image_t *fs, const dirent64_t *e, void *arg) {
+    extract_t *x = arg;
+    //Names come from the image; never let one escape the output directory
+    if (strchr(e->name, '/') || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+        fprintf(stderr, "Skipping unsafe name '%s'\n", e->name);
+        return 0;
+    }
+    if (e->type == DIRENT_DIR) {
+        if (mkdirat(x->dir_fd, e->name, 0755) != 0 && errno != EEXIST) {
+            perror(e->name);
+            return 1;
+        }
+        int parent_fd = x->dir_fd;
+        x->dir_fd = openat(parent_fd, e->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (x->dir_fd < 0) {
+            perror(e->name);
+            x->dir_fd = parent_fd;
+            return 1;
+        }
+        int rc = for_each_entry(fs, e->ino, extract_entry, x);
+        close(x->dir_fd);
+        x->dir_fd = parent_fd;
+        return rc;
+    }
+    int fd = openat(x->dir_fd, e->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        perror(e->name);
+        return 1;
+    }
+    uint64_t size = 0;
+    int rc = copy_out(fs, e->ino, fd, x->verify, &size);
+    if (close(fd) != 0 && rc == 0) {
+        perror(e->name);
+        rc = 1;
+    }
+    if (rc != 0) return 1;
+    x->files++;
+    x->bytes += size;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    const char *image_name = NULL;
+    const char *extract_dir = NULL;
+    const char **names = NULL;
+    size_t name_count = 0;
+    int list = 0;
+    int verify = 1;
+    uint64_t range_off = 0, range_len = UINT64_MAX;
+    unsigned open_flags = FS_OPEN_RDONLY;
+    int status = 1;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s --image <image.img> (--ls | --cat <path> [--cat <path> ...] [--offset <bytes>] [--length <bytes>] | --extract <dir> [--file <path> ...]) [--no-verify] [--io <uring|psync>]\n", argv[0]);
+        return 1;
+    }
+
+    names = malloc((size_t)argc * sizeof(*names));
+    if (!names) {
+        perror("Failed to allocate name list");
+        return 1;
+    }
+    int cat = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ls") == 0) {
+            list = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-verify") == 0) {
+            verify = 0;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            goto out_args;
+        }
+        if (strcmp(argv[i], "--image") == 0) image_name = argv[++i];
+        else if (strcmp(argv[i], "--cat") == 0) {
+            cat = 1;
+            names[name_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--file") == 0) names[name_count++] = argv[++i];
+        else if (strcmp(argv[i], "--extract") == 0) extract_dir = argv[++i];
+        else if (strcmp(argv[i], "--offset") == 0) range_off = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--length") == 0) range_len = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--io") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "psync") == 0) open_flags |= FS_OPEN_PSYNC;
+            else if (strcmp(name, "uring") != 0) {
+                fprintf(stderr, "Error: Unknown I/O backend '%s'\n", name);
+                goto out_args;
+            }
+        }
+    }
+
+    if (!image_name || list + cat + (extract_dir != NULL) != 1 || (cat && extract_dir)) {
+        fprintf(stderr, "Exactly one of --ls, --cat or --extract is required, with --image\n");
+        goto out_args;
+    }
+    if (list && name_count) {
+        fprintf(stderr, "Error: --ls takes no file names\n");
+        goto out_args;
+    }
+    int ranged = range_off != 0 || range_len != UINT64_MAX;
+    if (ranged && !cat) {
+        fprintf(stderr, "Error: --offset and --length only apply to --cat\n");
+        goto out_args;
+    }
+
+    fs_image_t fs = {0};
+    if (fs_open(&fs, image_name, open_flags) != 0) goto out_fs;
+
+    if (list) {
+        listing_t l = {0};
+        printf("%10s %14s %14s %6s  %s\n", "inode", "size", "stored", "runs", "name");
+        if (for_each_entry(&fs, ROOT_INO, list_entry, &l) != 0) goto out_fs;
+        if (l.dirs) printf("%" PRIu64 " files in %" PRIu64 " directories, %" PRIu64 " bytes\n", l.files, l.dirs + 1, l.bytes);
+        else printf("%" PRIu64 " files, %" PRIu64 " bytes\n", l.files, l.bytes);
+    } else if (cat) {
+#ifdef F_SETPIPE_SZ
+        //A pipe (or fails harmlessly): larger buffer, fewer sendfile calls
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, 1 << 20);
+#endif
+        for (size_t i = 0; i < name_count; i++) {
+            uint32_t ino = fs_lookup(&fs, names[i]);
+            if (!ino) {
+                fprintf(stderr, "No such file '%s'\n", names[i]);
+                goto out_fs;
+            }
+            //A range always goes through fs_read_file, which checks what it reads
+            int rc = ranged ? copy_range_out(&fs, ino, STDOUT_FILENO, range_off, range_len)
+                            : copy_out(&fs, ino, STDOUT_FILENO, verify, NULL);
+            if (rc != 0) goto out_fs;
+        }
+    } else {
+        if (mkdir(extract_dir, 0755) != 0 && errno != EEXIST) {
+            perror(extract_dir);
+            goto out_fs;
+        }
+        extract_t x = { .verify = verify, .dir_fd = open(extract_dir, O_RDONLY | O_DIRECTORY) };
+        if (x.dir_fd < 0) {
+            perror(extract_dir);
+            goto out_fs;
+        }
+        int rc = 0;
+        if (name_count == 0) {
+            rc = for_each_entry(&fs, ROOT_INO, extract_entry, &x);
+        } else {
+            //A named file or directory lands in the output directory under its last component
+            for (size_t i = 0; i < name_count && rc == 0; i++) {
+                dirent64_t e = {0};
+                inode_t in;
+                size_t len = strlen(names[i]);
+                while (len > 1 && names[i][len - 1] == '/') len--;
+                const char *base = names[i] + len;
+                while (base > names[i] && base[-1] != '/') base--;
+                e.ino = fs_lookup(&fs, names[i]);
+                if (!e.ino || e.ino == ROOT_INO || len - (size_t)(base - names[i]) > NAME_MAX_LEN ||
+                    fs_read_inode(&fs, e.ino - 1, &in) != 0) {
+                    fprintf(stderr, "No such file '%s'\n", names[i]);
+                    rc = 1;
+                    break;
+                }
+                memcpy(e.name, base, len - (size_t)(base - names[i]));
+                e.type = (in.mode & 0170000) == 0040000 ? DIRENT_DIR : DIRENT_FILE;
+                rc = extract_entry(&fs, &e, &x);
+            }
+        }
+        close(x.dir_fd);
+        if (rc != 0) goto out_fs;
+        printf("Extracted %" PRIu64 " files, %" PRIu64 " bytes to %s\n", x.files, x.bytes, extract_dir);
+    }
+    status = 0;
+
+out_fs:
+    fs_close(&fs);
+out_args:
+    free(names);
+    return status;
+}
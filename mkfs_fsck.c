@@ -0,0 +1,1281 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_fsck.c minivsfs.c blkio.c crc32.c lz.c -o mkfs_fsck
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "minivsfs.h"
+
+// Exit status, as for fsck(8)
+#define FSCK_OK          0
+#define FSCK_CORRECTED   1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+#define REPORT_LIMIT 20   // lines printed per kind of problem
+#define SCAN_CHUNK   64   // inode table blocks a worker claims at a time
+
+enum { P_SUPER, P_GROUP, P_DIRENT, P_INODE, P_LINKS, P_ORPHAN, P_SHARED, P_IBITMAP, P_DBITMAP, P_ROOT, P_DATA,
+       P_DEDUP, P_KINDS };
+static const char *kind_names[P_KINDS] = {
+    "superblock", "group descriptor", "directory entry", "inode", "link count",
+    "unlinked inode", "shared block", "inode bitmap", "data bitmap", "root directory", "file data",
+    "dedup index",
+};
+static uint64_t found[P_KINDS];
+
+// Per-inode scan results
+#define IS_USED     0x01  // marked in the inode bitmap
+#define IS_KEPT     0x02  // valid map, its blocks count as referenced
+#define IS_BAD_CRC  0x04
+#define IS_SHORT    0x08  // fewer blocks than the size needs
+#define IS_EXCESS   0x10  // more blocks than the size needs
+#define IS_LINKS    0x20  // link count differs from the directory
+#define IS_SHARED   0x40  // references a block another inode also references
+#define IS_BAD_CSUM 0x80  // checksum chain unreadable, dropped on repair
+#define IS_BAD_DATA 0x100 // data blocks fail their checksums (--verify-data)
+#define IS_BAD_CZ   0x200 // compressed file without a valid trailer
+#define IS_DIR      0x400 // directory reached from the root
+#define IS_BAD_DIR  0x800 // directory whose entries cannot be read
+
+enum { BAD_NONE, BAD_EMPTY, BAD_MODE, BAD_EXTENT_COUNT, BAD_EXTENT_BLOCK, BAD_RANGE, BAD_HOLE, BAD_INLINE,
+       BAD_DIR, BAD_UNREACHED };
+static const char *bad_names[] = {
+    "", "empty", "not a regular file", "inline extent count out of range",
+    "corrupt extent block", "block number outside the data region", "hole in the direct block list",
+    "inline data larger than the inode", "unreadable directory", "directory not reachable from the root",
+};
+
+// Directory entry repairs
+#define DE_DROP    1
+#define DE_RELINK  2  // not where a lookup finds it, re-add under the same name
+#define DE_REWRITE 3  // checksum or type only
+#define DE_DOTS    4  // "." or ".." to be restored
+
+// A directory reached from the root, checked in pass 2
+typedef struct {
+    fs_dir_t *d;
+    uint32_t parent;            // inode ".." must name
+    uint8_t *de_act;            // DE_* per slot
+} dir_check_t;
+
+typedef struct {
+    fs_image_t fs;
+    int fd;
+    int repair;
+    int verify_data;            // read checksummed files' data and check it
+    uint32_t *ilinks;           // directory entries per inode slot
+    uint16_t *flags;            // IS_* per inode slot
+    uint8_t *bad;               // BAD_* per inode slot
+    dir_check_t *dirs;          // directories reached so far, the root first
+    size_t ndirs;
+    size_t dirs_cap;
+    _Atomic uint64_t *seen;     // data region blocks referenced by kept inodes
+    _Atomic uint64_t *dup;      // ... referenced more than once
+    uint64_t words;             // length of seen and dup
+    dedup_entry_t *dedup;       // dedup index entries, host byte order
+    size_t ndedup;
+    int dedup_bad;              // index unreadable: its blocks count as shared, dropped on repair
+    uint64_t *indexed;          // data region blocks the index lists, never counted as dup
+    _Atomic uint32_t *refs;     // references to each indexed block
+    int scan_dups;              // second scan: flag inodes touching dup blocks
+    atomic_uint_fast64_t next;  // next inode table chunk
+    atomic_int failed;
+    uint64_t unfixed;
+} fsck_t;
+
+static void problem(int kind, const char *fmt, ...) {
+    if (found[kind]++ >= REPORT_LIMIT) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    putchar('\n');
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Whether the last mapped block of a compressed file ends in a trailer
+// that matches the file size and fits the blocks; -1 on a read error
+static int compressed_ok(fsck_t *c, const inode_t *in, const extent_t *ext, size_t n, uint64_t blocks) {
+    if (blocks == 0) return 0;
+    cz_trailer_t tr;
+    uint64_t end = ((uint64_t)ext[n - 1].start + ext[n - 1].len) * BS;
+    if (pread_full(c->fd, &tr, sizeof(tr), end - sizeof(tr)) != 0) return -1;
+    uint64_t chunk = from_le32(tr.chunk_size), nchunks = from_le64(tr.nchunks);
+    return from_le32(tr.magic) == CZ_MAGIC && chunk >= BS && chunk <= (16u << 20) &&
+           nchunks == (in->size_bytes + chunk - 1) / chunk &&
+           nchunks <= (blocks * BS - sizeof(tr)) / sizeof(uint64_t);
+}
+
+// Classic direct[] list as extents; -1 when a pointer follows a hole
+static int direct_extents(const inode_t *in, extent_t *ext, size_t *n) {
+    int ended = 0;
+    *n = 0;
+    for (int i = 0; i < DIRECT_MAX; i++) {
+        uint32_t b = in->direct[i];
+        if (!b) {
+            ended = 1;
+            continue;
+        }
+        if (ended) return -1;
+        if (*n && ext[*n - 1].start + ext[*n - 1].len == b) ext[*n - 1].len++;
+        else ext[(*n)++] = (extent_t){ b, 1 };
+    }
+    return 0;
+}
+
+// Block map of an inode (host byte order), read straight from the image so
+// workers never touch the handle's cache, and the extent blocks it spans
+// (EXTENT_CHAIN_MAX at most) in chain. Returns a BAD_* reason.
+static int read_map(fsck_t *c, const inode_t *in, extent_t *ext, size_t *n, uint64_t *blocks, uint32_t *chain,
+                    size_t *nchain) {
+    const superblock_t *sb = &c->fs.sb;
+    uint64_t lo = sb->data_region_start, hi = lo + sb->data_region_blocks;
+
+    if (in->reserved_0 & INODE_FL_INLINE) {
+        *n = 0;
+        *nchain = 0;
+        *blocks = 0;
+        return in->size_bytes > INODE_INLINE_MAX ? BAD_INLINE : BAD_NONE;
+    }
+    *nchain = 0;
+    if (in->reserved_0 & INODE_FL_EXTENTS) {
+        size_t count = in->reserved_1, got = 0;
+        if (!in->reserved_2) {
+            if (count > INODE_EXTENTS) return BAD_EXTENT_COUNT;
+            memcpy(ext, in->direct, count * sizeof(extent_t));
+            got = count;
+        }
+        if (count > EXTENT_MAP_MAX) return BAD_EXTENT_COUNT;
+        for (uint32_t blkno = in->reserved_2; blkno; ) {
+            if (blkno < lo || blkno >= hi) return BAD_RANGE;
+            if (*nchain == EXTENT_CHAIN_MAX) return BAD_EXTENT_BLOCK;
+            extent_block_t eb;
+            if (pread_full(c->fd, &eb, BS, (uint64_t)blkno * BS) != 0) {
+                atomic_store(&c->failed, 1);
+                return BAD_EXTENT_BLOCK;
+            }
+            size_t k = from_le32(eb.count);
+            if (from_le32(eb.magic) != EXTENT_MAGIC || k > EXTENT_BLOCK_MAX || k > count - got ||
+                eb.crc != crc32(eb.ext, k * sizeof(extent_t)))
+                return BAD_EXTENT_BLOCK;
+            for (size_t i = 0; i < k; i++) {
+                ext[got + i].start = from_le32(eb.ext[i].start);
+                ext[got + i].len = from_le32(eb.ext[i].len);
+            }
+            got += k;
+            chain[(*nchain)++] = blkno;
+            blkno = from_le32(eb.next);
+        }
+        if (got != count) return BAD_EXTENT_BLOCK;
+        *n = count;
+    } else if (direct_extents(in, ext, n) != 0) {
+        return BAD_HOLE;
+    }
+
+    *blocks = 0;
+    for (size_t i = 0; i < *n; i++) {
+        if (ext[i].len == 0 || ext[i].start < lo || (uint64_t)ext[i].start + ext[i].len > hi) return BAD_RANGE;
+        *blocks += ext[i].len;
+    }
+    return BAD_NONE;
+}
+
+// Checksum chain of an INODE_FL_CSUM inode, read straight from the image.
+// Stores the chain's block numbers (caller frees) and, with crcs, the
+// `count` CRCs it must hold. Returns 1 for a chain that is not exactly
+// that, -1 when the image cannot be read.
+static int read_chain(fsck_t *c, const inode_t *in, uint64_t count, uint32_t **chain, size_t *nchain,
+                      uint32_t *crcs) {
+    const superblock_t *sb = &c->fs.sb;
+    uint64_t lo = sb->data_region_start, hi = lo + sb->data_region_blocks;
+    size_t max = (size_t)((count + CSUM_BLOCK_MAX - 1) / CSUM_BLOCK_MAX);
+    uint32_t *blks = malloc((max ? max : 1) * sizeof(*blks));
+    if (!blks) return -1;
+
+    size_t n = 0;
+    uint64_t got = 0;
+    csum_block_t cb;
+    for (uint64_t blkno = in->xattr_ptr; blkno; blkno = from_le32(cb.next)) {
+        if (n == max || blkno < lo || blkno >= hi) goto bad;
+        if (pread_full(c->fd, &cb, BS, blkno * BS) != 0) {
+            free(blks);
+            return -1;
+        }
+        uint32_t k = from_le32(cb.count);
+        if (from_le32(cb.magic) != CSUM_MAGIC || k > CSUM_BLOCK_MAX || k > count - got ||
+            cb.crc != crc32(cb.crcs, k * sizeof(uint32_t)))
+            goto bad;
+        if (crcs)
+            for (uint32_t i = 0; i < k; i++) crcs[got + i] = from_le32(cb.crcs[i]);
+        got += k;
+        blks[n++] = (uint32_t)blkno;
+    }
+    if (got != count) goto bad;
+    *chain = blks;
+    *nchain = n;
+    return 0;
+
+bad:
+    free(blks);
+    return 1;
+}
+
+// Read `count` data blocks of a file through buf (SCAN_CHUNK blocks) and
+// compare each with its CRC; 1 on the first mismatch
+static int data_mismatch(fsck_t *c, const extent_t *ext, size_t n, const uint32_t *crcs, uint64_t count,
+                         uint8_t *buf) {
+    uint64_t idx = 0;
+    for (size_t e = 0; e < n && idx < count; e++) {
+        for (uint64_t j = 0; j < ext[e].len && idx < count; ) {
+            uint64_t k = ext[e].len - j < SCAN_CHUNK ? ext[e].len - j : SCAN_CHUNK;
+            if (k > count - idx) k = count - idx;
+            if (pread_full(c->fd, buf, k * BS, (ext[e].start + j) * BS) != 0) return 1;
+            for (uint64_t b = 0; b < k; b++)
+                if (crc32(buf + b * BS, BS) != crcs[idx + b]) return 1;
+            j += k;
+            idx += k;
+        }
+    }
+    return 0;
+}
+
+// Set `len` bits of seen from `bit`, noting every bit that was already set.
+// Indexed blocks may be shared; their references are counted instead.
+static void mark_run(fsck_t *c, uint64_t bit, uint64_t len) {
+    while (len > 0) {
+        uint64_t off = bit % 64, n = 64 - off < len ? 64 - off : len;
+        uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << off;
+        uint64_t idx = c->indexed ? c->indexed[bit / 64] & mask : 0;
+        for (uint64_t m = idx; m; m &= m - 1) atomic_fetch_add(&c->refs[bit / 64 * 64 + (uint64_t)__builtin_ctzll(m)], 1);
+        uint64_t old = atomic_fetch_or(&c->seen[bit / 64], mask);
+        if (old & mask & ~idx) atomic_fetch_or(&c->dup[bit / 64], old & mask & ~idx);
+        bit += n;
+        len -= n;
+    }
+}
+
+static int run_shared(fsck_t *c, uint64_t bit, uint64_t len) {
+    while (len > 0) {
+        uint64_t off = bit % 64, n = 64 - off < len ? 64 - off : len;
+        uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << off;
+        if (atomic_load(&c->dup[bit / 64]) & mask) return 1;
+        bit += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Check one in-use or linked inode and mark the blocks it keeps. On the
+// second scan only flag kept inodes that reference a shared block. scratch
+// holds SCAN_CHUNK blocks for --verify-data.
+static void scan_inode(fsck_t *c, uint32_t slot, const uint8_t *raw, uint8_t *scratch) {
+    inode_t in, sealed;
+    memcpy(&in, raw, sizeof(in));
+    sealed = in;
+    inode_crc_finalize(&sealed);
+    uint16_t fl = c->flags[slot];
+    if (c->scan_dups && !(fl & IS_KEPT)) return;
+    if (sealed.inode_crc != in.inode_crc) fl |= IS_BAD_CRC;
+    inode_to_host(&in);
+
+    extent_t ext[EXTENT_MAP_MAX];
+    uint32_t xchain[EXTENT_CHAIN_MAX];
+    size_t n = 0, nx = 0;
+    uint64_t blocks = 0;
+    int why, dir = slot == 0 || (fl & IS_DIR);
+    if (in.mode == 0) why = BAD_EMPTY;
+    else if (fl & IS_BAD_DIR) why = BAD_DIR;
+    else if (!dir && (in.mode & 0170000) == 0040000) why = BAD_UNREACHED;
+    else if ((in.mode & 0170000) != (dir ? 0040000 : 0100000)) why = BAD_MODE;
+    else why = read_map(c, &in, ext, &n, &blocks, xchain, &nx);
+    if (why != BAD_NONE) {
+        c->bad[slot] = (uint8_t)why;
+        c->flags[slot] = fl;
+        return;
+    }
+
+    //Blocks past the end of the file are left unreferenced and come free.
+    //A compressed file needs just the blocks it has, and checksums them all.
+    //Directories are checked against their entries in pass 5.
+    int packed = !dir && (in.reserved_0 & INODE_FL_COMPRESSED);
+    uint64_t keep = blocks, need = packed ? blocks : (in.size_bytes + BS - 1) / BS;
+    if (in.reserved_0 & INODE_FL_INLINE) need = 0;
+    if (packed && !c->scan_dups) {
+        int ok = compressed_ok(c, &in, ext, n, blocks);
+        if (ok < 0) atomic_store(&c->failed, 1);
+        else if (!ok) fl |= IS_BAD_CZ;
+    }
+    if (!dir) {
+        if (blocks < need) fl |= IS_SHORT;
+        if (blocks > need) {
+            fl |= IS_EXCESS;
+            keep = need;
+        }
+        if (in.links != c->ilinks[slot]) fl |= IS_LINKS;
+    }
+
+    uint64_t base = c->fs.sb.data_region_start;
+    int shared = 0;
+    for (size_t i = 0; i < nx; i++) {
+        if (c->scan_dups) shared |= run_shared(c, xchain[i] - base, 1);
+        else mark_run(c, xchain[i] - base, 1);
+    }
+    for (size_t i = 0; i < n && keep > 0; i++) {
+        uint64_t len = ext[i].len < keep ? ext[i].len : keep;
+        if (c->scan_dups) shared |= run_shared(c, ext[i].start - base, len);
+        else mark_run(c, ext[i].start - base, len);
+        keep -= len;
+    }
+
+    //Checksum chain blocks are referenced too; an unreadable chain is not
+    if (!dir && (in.reserved_0 & INODE_FL_CSUM) && !(fl & IS_BAD_CSUM)) {
+        int verify = c->verify_data && !c->scan_dups;
+        uint32_t *chain = NULL, *crcs = NULL;
+        size_t nchain = 0;
+        int rc = verify && need && !(crcs = malloc(need * sizeof(*crcs))) ? -1
+                 : read_chain(c, &in, need, &chain, &nchain, crcs);
+        if (rc < 0) {
+            atomic_store(&c->failed, 1);
+        } else if (rc > 0) {
+            fl |= IS_BAD_CSUM;
+        } else {
+            for (size_t i = 0; i < nchain; i++) {
+                if (c->scan_dups) shared |= run_shared(c, chain[i] - base, 1);
+                else mark_run(c, chain[i] - base, 1);
+            }
+            if (verify && data_mismatch(c, ext, n, crcs, need < blocks ? need : blocks, scratch)) fl |= IS_BAD_DATA;
+        }
+        free(chain);
+        free(crcs);
+    }
+    if (c->scan_dups) {
+        if (shared) c->flags[slot] |= IS_SHARED;
+        return;
+    }
+    c->flags[slot] = fl | IS_KEPT;
+}
+
+// Worker: claim inode table chunks, read each one with a single pread and
+// check every slot that is marked in use or named by a directory entry
+static void *scan_worker(void *arg) {
+    fsck_t *c = arg;
+    const superblock_t *sb = &c->fs.sb;
+    uint8_t *buf = malloc((size_t)SCAN_CHUNK * BS);
+    uint8_t *scratch = c->verify_data ? malloc((size_t)SCAN_CHUNK * BS) : NULL;
+    if (!buf || (c->verify_data && !scratch)) {
+        free(buf);
+        free(scratch);
+        atomic_store(&c->failed, 1);
+        return NULL;
+    }
+    for (;;) {
+        uint64_t first = atomic_fetch_add(&c->next, 1) * SCAN_CHUNK;
+        if (first >= sb->inode_table_blocks || atomic_load(&c->failed)) break;
+        uint64_t nblk = sb->inode_table_blocks - first < SCAN_CHUNK ? sb->inode_table_blocks - first : SCAN_CHUNK;
+        uint64_t lo = first * (BS / INODE_SIZE), hi = (first + nblk) * (BS / INODE_SIZE);
+        if (hi > sb->inode_count) hi = sb->inode_count;
+
+        //Unused stretches of the table are never read
+        int wanted = 0;
+        for (uint64_t s = lo; s < hi && !wanted; s++)
+            wanted = is_bit_set(c->fs.inode_bm.bits, s) || c->ilinks[s];
+        if (!wanted) continue;
+
+        if (pread_full(c->fd, buf, nblk * BS, (sb->inode_table_start + first) * BS) != 0) {
+            perror("Failed to read inode table");
+            atomic_store(&c->failed, 1);
+            break;
+        }
+        for (uint64_t s = lo; s < hi; s++) {
+            if (is_bit_set(c->fs.inode_bm.bits, s)) c->flags[s] |= IS_USED;
+            else if (!c->ilinks[s]) continue;
+            scan_inode(c, (uint32_t)s, buf + (s - lo) * INODE_SIZE, scratch);
+        }
+    }
+    free(buf);
+    free(scratch);
+    return NULL;
+}
+
+static int scan_inodes(fsck_t *c, int jobs) {
+    atomic_store(&c->next, 0);
+    pthread_t *threads = malloc((size_t)jobs * sizeof(*threads));
+    if (!threads) {
+        perror("Failed to allocate worker threads");
+        return 1;
+    }
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, scan_worker, c) != 0) break;
+    }
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    if (started == 0) {
+        fprintf(stderr, "Failed to start worker thread\n");
+        return 1;
+    }
+    return atomic_load(&c->failed) ? 1 : 0;
+}
+
+// Superblock checksum, free totals and every group descriptor against the
+// bitmaps as they are on disk
+static void check_super(fsck_t *c) {
+    fs_image_t *fs = &c->fs;
+    superblock_t raw, sealed;
+    if (pread_full(c->fd, &raw, sizeof(raw), 0) == 0) {
+        sealed = raw;
+        superblock_crc_finalize(&sealed);
+        if (sealed.checksum != raw.checksum) problem(P_SUPER, "Superblock checksum mismatch");
+    }
+
+    uint64_t free_blocks = 0, free_inodes = 0;
+    for (uint64_t g = 0; g < fs->sb.group_count; g++) {
+        const group_t *grp = &fs->groups[g];
+        uint64_t fb = bitmap_count_free(&fs->data_bm, grp->data_start, grp->data_end);
+        uint64_t fi = bitmap_count_free(&fs->inode_bm, grp->ino_start, grp->ino_end);
+        free_blocks += fb;
+        free_inodes += fi;
+        if (!fs->gdt) continue;
+        group_desc_t *gd = (group_desc_t *)fs->gdt + g;
+        if (gd->checksum != crc32(gd, offsetof(group_desc_t, checksum)))
+            problem(P_GROUP, "Group %" PRIu64 ": descriptor checksum mismatch", g);
+        else if (from_le32(gd->free_blocks) != fb || from_le32(gd->free_inodes) != fi)
+            problem(P_GROUP, "Group %" PRIu64 ": descriptor counts %u blocks, %u inodes free, bitmaps %" PRIu64 ", %" PRIu64,
+                    g, from_le32(gd->free_blocks), from_le32(gd->free_inodes), fb, fi);
+    }
+    if ((fs->sb.flags & SB_FEAT_FREE_COUNTS) &&
+        (fs->sb.free_blocks != free_blocks || fs->sb.free_inodes != free_inodes))
+        problem(P_SUPER, "Superblock free counts %" PRIu64 " blocks, %" PRIu64 " inodes, bitmaps %" PRIu64 ", %" PRIu64,
+                fs->sb.free_blocks, fs->sb.free_inodes, free_blocks, free_inodes);
+}
+
+// Read the dedup index chain straight from the image and set up reference
+// counting for the blocks it lists. An unreadable index is reported and
+// left out, so blocks it shared show up as shared. -1 on a read error.
+static int load_dedup(fsck_t *c) {
+    const superblock_t *sb = &c->fs.sb;
+    uint64_t total = sb->dedup_entries, lo = sb->data_region_start, hi = lo + sb->data_region_blocks;
+    if (!(sb->flags & SB_FEAT_DEDUP) || total == 0) return 0;
+    uint64_t max_chain = (total + DEDUP_BLOCK_MAX - 1) / DEDUP_BLOCK_MAX;
+    uint32_t *chain = malloc(max_chain * sizeof(*chain));
+    c->dedup = malloc(total * sizeof(*c->dedup));
+    c->indexed = calloc(c->words, sizeof(*c->indexed));
+    c->refs = calloc(sb->data_region_blocks, sizeof(*c->refs));
+    if (!chain || !c->dedup || !c->indexed || !c->refs) {
+        perror("Failed to allocate dedup index");
+        free(chain);
+        return -1;
+    }
+
+    const char *why = NULL;
+    size_t nchain = 0;
+    uint32_t blkno = (uint32_t)sb->dedup_index;
+    while (blkno && !why) {
+        dedup_block_t db;
+        if (blkno < lo || blkno >= hi || nchain == max_chain) {
+            why = "chain leaves the data region or runs too long";
+            break;
+        }
+        if (pread_full(c->fd, &db, BS, (uint64_t)blkno * BS) != 0) {
+            free(chain);
+            return -1;
+        }
+        uint32_t count = from_le32(db.count);
+        if (from_le32(db.magic) != DEDUP_MAGIC || count > DEDUP_BLOCK_MAX || count > total - c->ndedup ||
+            db.crc != crc32(db.ent, count * sizeof(dedup_entry_t))) {
+            why = "corrupt index block";
+            break;
+        }
+        for (uint32_t i = 0; i < count && !why; i++) {
+            dedup_entry_t *e = &c->dedup[c->ndedup++];
+            e->hash = from_le64(db.ent[i].hash);
+            e->blkno = from_le32(db.ent[i].blkno);
+            e->refs = from_le32(db.ent[i].refs);
+            uint64_t bit = e->blkno - lo;
+            if (e->blkno < lo || e->blkno >= hi || (c->indexed[bit / 64] >> (bit % 64)) & 1)
+                why = "entry outside the data region or listed twice";
+            else
+                c->indexed[bit / 64] |= 1ull << (bit % 64);
+        }
+        chain[nchain++] = blkno;
+        blkno = from_le32(db.next);
+    }
+    if (!why && c->ndedup != total) why = "fewer entries than the superblock records";
+
+    if (why) {
+        problem(P_DEDUP, "Dedup index is unreadable: %s", why);
+        c->dedup_bad = 1;
+        c->ndedup = 0;
+        free(c->indexed);
+        free((void *)c->refs);
+        c->indexed = NULL;
+        c->refs = NULL;
+    } else {
+        for (size_t i = 0; i < nchain; i++) mark_run(c, chain[i] - lo, 1);
+    }
+    free(chain);
+    return 0;
+}
+
+// Each indexed block's recorded reference count against the references found
+static void check_refs(fsck_t *c) {
+    uint64_t base = c->fs.sb.data_region_start;
+    for (size_t i = 0; i < c->ndedup; i++) {
+        const dedup_entry_t *e = &c->dedup[i];
+        uint32_t found_refs = atomic_load(&c->refs[e->blkno - base]);
+        if (found_refs != e->refs)
+            problem(P_DEDUP, "Block %u: %u references, index records %u", e->blkno, found_refs, e->refs);
+    }
+}
+
+// Queue a directory for pass 2
+static int add_dir(fsck_t *c, fs_dir_t *d, uint32_t parent) {
+    if (c->ndirs == c->dirs_cap) {
+        size_t cap = c->dirs_cap ? c->dirs_cap * 2 : 16;
+        dir_check_t *grown = realloc(c->dirs, cap * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to grow directory list");
+            return 1;
+        }
+        c->dirs = grown;
+        c->dirs_cap = cap;
+    }
+    uint8_t *de_act = calloc((size_t)d->nblocks * DIRENTS_PER_BLOCK, 1);
+    if (!de_act) {
+        perror("Failed to allocate directory state");
+        return 1;
+    }
+    c->dirs[c->ndirs++] = (dir_check_t){ d, parent, de_act };
+    return 0;
+}
+
+// Follow an entry naming a directory inode: a directory reached for the
+// first time is loaded and queued, one reached again is a second parent
+static int reach_dir(fsck_t *c, uint32_t ino, uint32_t parent, const inode_t *in) {
+    uint32_t slot = ino - 1;
+    extent_t ext[EXTENT_MAP_MAX];
+    uint32_t xchain[EXTENT_CHAIN_MAX];
+    size_t n, nx;
+    uint64_t blocks;
+    fs_dir_t *d = NULL;
+    if (c->flags[slot] & (IS_DIR | IS_BAD_DIR)) return 1;
+    //The map is checked as the scan will check it before the library reads it
+    if (read_map(c, in, ext, &n, &blocks, xchain, &nx) != BAD_NONE || blocks == 0 || !(d = fs_dir(&c->fs, ino))) {
+        c->flags[slot] |= IS_BAD_DIR;
+        return 0;
+    }
+    c->flags[slot] |= IS_DIR;
+    return add_dir(c, d, parent) != 0 ? -1 : 0;
+}
+
+// Checksums, names, types and placement of the entries of directory k;
+// counts the entries that will survive for each inode and queues the
+// directories they lead to. -1 when the checker runs out of memory.
+static int check_dir(fsck_t *c, size_t k) {
+    fs_image_t *fs = &c->fs;
+    fs_dir_t *d = c->dirs[k].d;
+    uint8_t *de_act = c->dirs[k].de_act;
+    uint32_t parent = c->dirs[k].parent;
+    dirent64_t *entries = (dirent64_t *)d->ents;
+    size_t slots = (size_t)d->nblocks * DIRENTS_PER_BLOCK;
+
+    for (size_t i = 0; i < slots; i++) {
+        dirent64_t *e = &entries[i];
+        int named = e->name[0] && memchr(e->name, '\0', sizeof(e->name));
+        int sum_ok = 1;
+        if (e->ino != 0) {
+            dirent64_t sealed = *e;
+            dirent_to_disk(&sealed);
+            dirent_checksum_finalize(&sealed);
+            sum_ok = sealed.checksum == e->checksum;
+        }
+
+        if (i < 2) {
+            const char *want = i == 0 ? "." : "..";
+            if (e->ino != (i == 0 ? d->ino : parent) || e->type != DIRENT_DIR || !named ||
+                strcmp(e->name, want) != 0 || !sum_ok) {
+                if (d->ino == ROOT_INO) problem(P_DIRENT, "Root directory entry '%s' is damaged", want);
+                else problem(P_DIRENT, "Directory %u: entry '%s' is damaged", d->ino, want);
+                de_act[i] = DE_DOTS;
+            }
+            continue;
+        }
+        if (e->ino == 0) continue;
+
+        int64_t at;
+        inode_t in = {0};
+        if (named && e->ino <= fs->sb.inode_count && fs_read_inode(fs, e->ino - 1, &in) != 0) return -1;
+        uint8_t type = (in.mode & 0170000) == 0040000 ? DIRENT_DIR : DIRENT_FILE;
+        if (!named) {
+            problem(P_DIRENT, "Entry %zu of directory %u: empty or unterminated name", i, d->ino);
+            de_act[i] = DE_DROP;
+        } else if (e->ino > fs->sb.inode_count) {
+            problem(P_DIRENT, "Entry '%s': inode %u is outside the inode table", e->name, e->ino);
+            de_act[i] = DE_DROP;
+        } else if (e->ino == ROOT_INO) {
+            problem(P_DIRENT, "Entry '%s' links the root directory", e->name);
+            de_act[i] = DE_DROP;
+        } else if ((at = fs_dir_slot(d, e->name)) != (int64_t)i) {
+            if (at >= 0) {
+                problem(P_DIRENT, "Entry '%s' (inode %u) duplicates entry %" PRId64, e->name, e->ino, at);
+                de_act[i] = DE_DROP;
+            } else {
+                problem(P_DIRENT, "Entry '%s' is not where a lookup finds it", e->name);
+                de_act[i] = DE_RELINK;
+            }
+        } else if (!sum_ok) {
+            problem(P_DIRENT, "Entry '%s': checksum mismatch", e->name);
+            de_act[i] = DE_REWRITE;
+        } else if (e->type != type) {
+            problem(P_DIRENT, "Entry '%s': type %u, expected a %s", e->name, e->type,
+                    type == DIRENT_DIR ? "directory" : "file");
+            de_act[i] = DE_REWRITE;
+        }
+        if (de_act[i] != DE_DROP && type == DIRENT_DIR) {
+            int rc = reach_dir(c, e->ino, d->ino, &in);
+            if (rc < 0) return -1;
+            if (rc > 0) {
+                problem(P_DIRENT, "Entry '%s': directory %u already has a parent", e->name, e->ino);
+                de_act[i] = DE_DROP;
+            }
+        }
+        if (de_act[i] != DE_DROP) c->ilinks[e->ino - 1]++;
+    }
+    return 0;
+}
+
+// Walk the tree from the root, directory by directory
+static int check_dirs(fsck_t *c) {
+    c->flags[0] |= IS_DIR;
+    if (add_dir(c, &c->fs.root, ROOT_INO) != 0) return 1;
+    for (size_t k = 0; k < c->ndirs; k++)
+        if (check_dir(c, k) != 0) return 1;
+    return 0;
+}
+
+// Report the scan results. Entries naming an inode that gets cleared are
+// dropped here as well.
+static void check_inodes(fsck_t *c) {
+    fs_image_t *fs = &c->fs;
+    if (!(c->flags[0] & IS_KEPT)) {
+        problem(P_ROOT, "Root inode: %s", bad_names[c->bad[0]]);
+        c->unfixed++;
+    } else if (c->flags[0] & IS_BAD_CRC) {
+        problem(P_ROOT, "Root inode: checksum mismatch");
+    }
+
+    for (uint64_t s = 1; s < fs->sb.inode_count; s++) {
+        uint16_t fl = c->flags[s];
+        uint32_t ino = (uint32_t)s + 1;
+        if (!(fl & (IS_USED | IS_KEPT)) && !c->ilinks[s]) continue;
+        if (!(fl & IS_KEPT)) {
+            if (c->bad[s] == BAD_EMPTY && !c->ilinks[s])
+                problem(P_IBITMAP, "Inode %u is marked in use but holds no file", ino);
+            else
+                problem(P_INODE, "Inode %u: %s", ino, bad_names[c->bad[s]]);
+            continue;
+        }
+        if (fl & IS_BAD_CRC) problem(P_INODE, "Inode %u: checksum mismatch", ino);
+        if (fl & IS_SHORT) problem(P_INODE, "Inode %u: size needs more blocks than are mapped", ino);
+        if (fl & IS_EXCESS) problem(P_INODE, "Inode %u: blocks mapped past the end of the file", ino);
+        if (fl & IS_BAD_CSUM) problem(P_INODE, "Inode %u: data checksums are unreadable", ino);
+        if (fl & IS_BAD_DATA) problem(P_DATA, "Inode %u: data blocks fail their checksums", ino);
+        if (fl & IS_BAD_CZ) problem(P_DATA, "Inode %u: compressed data has no valid trailer", ino);
+        if (!(fl & IS_USED)) problem(P_IBITMAP, "Inode %u is in use but not marked in the bitmap", ino);
+        if (!c->ilinks[s]) problem(P_ORPHAN, "Inode %u is not in any directory", ino);
+        else if (fl & IS_LINKS) problem(P_LINKS, "Inode %u: link count differs from its %u entries", ino, c->ilinks[s]);
+    }
+
+    for (size_t k = 0; k < c->ndirs; k++) {
+        dirent64_t *entries = (dirent64_t *)c->dirs[k].d->ents;
+        uint8_t *de_act = c->dirs[k].de_act;
+        for (size_t i = 2; i < (size_t)c->dirs[k].d->nblocks * DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].ino == 0 || de_act[i] == DE_DROP) continue;
+            if (!(c->flags[entries[i].ino - 1] & IS_KEPT)) {
+                problem(P_DIRENT, "Entry '%s' names cleared inode %u", entries[i].name, entries[i].ino);
+                de_act[i] = DE_DROP;
+            }
+        }
+    }
+}
+
+// Data bitmap against the blocks kept inodes reference
+static void check_data_bitmap(fsck_t *c) {
+    const bitmap_t *bm = &c->fs.data_bm;
+    uint64_t base = c->fs.sb.data_region_start, leaked = 0, unmarked = 0;
+    for (uint64_t w = 0; w < c->words; w++) {
+        uint64_t used = 0, seen = atomic_load(&c->seen[w]);
+        for (uint64_t b = w * 64; b < bm->nbits && b < (w + 1) * 64; b++)
+            if (is_bit_set(bm->bits, b)) used |= 1ull << (b % 64);
+        for (uint64_t diff = used ^ seen; diff; diff &= diff - 1) {
+            uint64_t blkno = base + w * 64 + (uint64_t)__builtin_ctzll(diff);
+            if (used & diff & -diff) {
+                leaked++;
+                problem(P_DBITMAP, "Block %" PRIu64 " is marked in use but not referenced", blkno);
+            } else {
+                unmarked++;
+                problem(P_DBITMAP, "Block %" PRIu64 " is referenced but marked free", blkno);
+            }
+        }
+    }
+    if (leaked || unmarked)
+        printf("  %" PRIu64 " leaked and %" PRIu64 " unmarked data blocks\n", leaked, unmarked);
+}
+
+// A block referenced twice belongs to the lowest inode that claims it;
+// returns 1 when `bit` is shared and already claimed
+static int claim(fsck_t *c, uint64_t *owned, uint64_t bit) {
+    if (!((atomic_load(&c->dup[bit / 64]) >> (bit % 64)) & 1)) return 0;
+    if ((owned[bit / 64] >> (bit % 64)) & 1) return 1;
+    owned[bit / 64] |= 1ull << (bit % 64);
+    return 0;
+}
+
+static int copy_block(fsck_t *c, uint32_t from, uint32_t to) {
+    uint8_t buf[BS];
+    if (pread_full(c->fd, buf, BS, (uint64_t)from * BS) != 0 ||
+        pwrite(c->fd, buf, BS, (off_t)to * BS) != (ssize_t)BS) {
+        perror("Failed to copy shared block");
+        return 1;
+    }
+    return 0;
+}
+
+// Walk an inode's kept blocks in claim order. Counts the blocks it shares
+// with an inode that claimed them first; with apply, gives it private
+// copies of them, drops blocks past its size and rewrites the map.
+// Directories claim first and are never rewritten here.
+static int resolve_inode(fsck_t *c, uint32_t slot, uint64_t *owned, int apply, uint64_t *shared) {
+    fs_image_t *fs = &c->fs;
+    int dir = slot == 0 || (c->flags[slot] & IS_DIR);
+    if (dir) apply = 0;
+    inode_t in = slot == 0 ? fs->root.inode : (inode_t){0};
+    extent_t *ext = NULL, *out = NULL;
+    size_t n = 0, nout = 0, cap = 0;
+    if ((slot != 0 && fs_read_inode(fs, slot, &in) != 0) || fs_inode_map(fs, &in, &ext, &n) != 0) return 1;
+
+    uint64_t base = fs->sb.data_region_start, goal = fs_inode_group(fs, slot);
+    uint64_t keep = (c->flags[slot] & IS_EXCESS) ? (in.size_bytes + BS - 1) / BS : UINT64_MAX;
+    int changed = (c->flags[slot] & IS_EXCESS) != 0, status = 1;
+    *shared = 0;
+
+    //An extent block itself may be a shared one; the map then gets a new
+    //chain, and the blocks of the old one nobody else keeps are released
+    uint32_t xchain[EXTENT_CHAIN_MAX];
+    size_t nx;
+    if (fs_extent_chain(fs, &in, xchain, &nx) != 0) goto out;
+    int xlost = 0;
+    for (size_t i = 0; i < nx; i++) {
+        if (!claim(c, owned, xchain[i] - base)) continue;
+        (*shared)++;
+        xchain[i] = 0;
+        xlost = 1;
+    }
+    if (xlost) {
+        in.reserved_2 = 0;
+        changed = 1;
+        for (size_t i = 0; i < nx && apply; i++)
+            if (xchain[i] && fs_defer_free(fs, xchain[i], 1) != 0) goto out;
+    }
+    //So may a checksum block; the file then loses its checksums, and the
+    //chain blocks nobody else keeps are released
+    if (!dir && (in.reserved_0 & INODE_FL_CSUM) && !(c->flags[slot] & IS_BAD_CSUM)) {
+        uint32_t *chain;
+        size_t nchain;
+        uint64_t count = 0;
+        if (in.reserved_0 & INODE_FL_COMPRESSED)
+            for (size_t e = 0; e < n; e++) count += ext[e].len;
+        else
+            count = (in.size_bytes + BS - 1) / BS;
+        if (read_chain(c, &in, count, &chain, &nchain, NULL) != 0) goto out;
+        int lost = 0;
+        for (size_t i = 0; i < nchain; i++) {
+            if (!claim(c, owned, chain[i] - base)) continue;
+            (*shared)++;
+            chain[i] = 0;
+            lost = 1;
+        }
+        if (lost) {
+            changed = 1;
+            in.reserved_0 &= ~INODE_FL_CSUM;
+            in.xattr_ptr = 0;
+            for (size_t i = 0; i < nchain && apply; i++)
+                if (chain[i] && fs_defer_free(fs, chain[i], 1) != 0) {
+                    free(chain);
+                    goto out;
+                }
+        }
+        free(chain);
+    }
+    uint64_t kept = 0;
+    for (size_t e = 0; e < n && kept < keep; e++) {
+        for (uint32_t j = 0; j < ext[e].len && kept < keep; j++, kept++) {
+            uint32_t b = ext[e].start + j;
+            if (claim(c, owned, b - base)) {
+                (*shared)++;
+                changed = 1;
+                if (apply) {
+                    extent_t *one = NULL;
+                    size_t none = 0;
+                    if (fs_alloc_blocks(fs, goal, 1, &one, &none) != 0) goto out;
+                    uint32_t copy = one[0].start;
+                    free(one);
+                    if (copy_block(c, b, copy) != 0) goto out;
+                    b = copy;
+                }
+            }
+            if (!apply) continue;
+            if (nout && out[nout - 1].start + out[nout - 1].len == b) {
+                out[nout - 1].len++;
+                continue;
+            }
+            if (nout == cap) {
+                cap = cap ? cap * 2 : n + 4;
+                extent_t *grown = realloc(out, cap * sizeof(*grown));
+                if (!grown) {
+                    perror("Failed to grow extent list");
+                    goto out;
+                }
+                out = grown;
+            }
+            out[nout++] = (extent_t){ b, 1 };
+        }
+    }
+
+    if (apply && changed) {
+        if (fs_set_extents(fs, &in, out, nout, goal) != 0 || fs_write_inode(fs, slot, &in) != 0) goto out;
+    }
+    status = 0;
+
+out:
+    free(ext);
+    free(out);
+    return status;
+}
+
+// Report (or with apply, resolve) every inode that shares blocks:
+// directories first, as their blocks are held in memory, then files
+// lowest first. A directory left sharing a block cannot be fixed.
+static int resolve_shared(fsck_t *c, int apply) {
+    uint64_t *owned = calloc(c->words ? c->words : 1, sizeof(*owned));
+    if (!owned) {
+        perror("Failed to allocate block owners");
+        return 1;
+    }
+    for (int files = 0; files < 2; files++) {
+        for (uint64_t s = 0; s < c->fs.sb.inode_count; s++) {
+            uint16_t fl = c->flags[s];
+            if (!(fl & (IS_SHARED | (apply ? IS_EXCESS : 0))) || !(fl & IS_KEPT)) continue;
+            if ((s == 0 || (fl & IS_DIR)) == files) continue;
+            uint64_t shared;
+            if (resolve_inode(c, (uint32_t)s, owned, apply, &shared) != 0) {
+                if (!apply) {
+                    free(owned);
+                    return 1;
+                }
+                c->unfixed++;
+                continue;
+            }
+            if (!apply && shared)
+                problem(P_SHARED, "Inode %" PRIu64 ": %" PRIu64 " blocks also belong to another inode", s + 1, shared);
+            else if (apply && shared && !files)
+                c->unfixed++;
+        }
+    }
+    free(owned);
+    return 0;
+}
+
+static void repair_dir(fsck_t *c, const dir_check_t *dc) {
+    fs_dir_t *d = dc->d;
+    dirent64_t *entries = (dirent64_t *)d->ents;
+    for (size_t i = 0; i < (size_t)d->nblocks * DIRENTS_PER_BLOCK; i++) {
+        dirent64_t *e = &entries[i];
+        switch (dc->de_act[i]) {
+        case DE_DOTS:
+            if (e->ino == 0) d->live++;
+            memset(e, 0, sizeof(*e));
+            e->ino = i == 0 ? d->ino : dc->parent;
+            e->type = DIRENT_DIR;
+            strcpy(e->name, i == 0 ? "." : "..");
+            break;
+        case DE_DROP:
+        case DE_RELINK:
+            //Unlinked names stay as tombstones; keep them non-empty
+            e->name[sizeof(e->name) - 1] = '\0';
+            if (!e->name[0]) e->name[0] = '?';
+            fs_unlink_slot(d, i);
+            break;
+        case DE_REWRITE:
+            e->type = (c->flags[e->ino - 1] & IS_DIR) ? DIRENT_DIR : DIRENT_FILE;
+            break;
+        default:
+            continue;
+        }
+        d->dirty[i / DIRENTS_PER_BLOCK] = 1;
+    }
+}
+
+// Forget a file's checksums when its size changes, releasing the chain
+// blocks that no other inode references as well
+static int drop_chain(fsck_t *c, inode_t *in) {
+    uint32_t *chain;
+    size_t nchain;
+    uint64_t base = c->fs.sb.data_region_start;
+    if (read_chain(c, in, (in->size_bytes + BS - 1) / BS, &chain, &nchain, NULL) != 0) return 1;
+    for (size_t i = 0; i < nchain; i++) {
+        uint64_t bit = chain[i] - base;
+        if ((atomic_load(&c->dup[bit / 64]) >> (bit % 64)) & 1) continue;
+        if (fs_defer_free(&c->fs, chain[i], 1) != 0) {
+            free(chain);
+            return 1;
+        }
+    }
+    free(chain);
+    in->reserved_0 &= ~INODE_FL_CSUM;
+    in->xattr_ptr = 0;
+    return 0;
+}
+
+static int repair_inodes(fsck_t *c) {
+    fs_image_t *fs = &c->fs;
+    for (uint64_t s = 1; s < fs->sb.inode_count; s++) {
+        uint16_t fl = c->flags[s];
+        if (!(fl & IS_KEPT)) {
+            if (!(fl & IS_USED) && !c->ilinks[s]) continue;
+            inode_t zero = {0};
+            if (fs_write_inode(fs, (uint32_t)s, &zero) != 0) return 1;
+            fs_set_inode_used(fs, (uint32_t)s, 0);
+            continue;
+        }
+        if (!(fl & IS_USED)) fs_set_inode_used(fs, (uint32_t)s, 1);
+        //A directory's inode is rewritten from its entries at the end
+        if (fl & IS_DIR) continue;
+        //Damaged data is reported; there is nothing to rebuild it from
+        if (fl & (IS_BAD_DATA | IS_BAD_CZ)) c->unfixed++;
+        if (!(fl & (IS_BAD_CRC | IS_SHORT | IS_LINKS | IS_BAD_CSUM)) && c->ilinks[s]) continue;
+
+        inode_t in;
+        if (fs_read_inode(fs, (uint32_t)s, &in) != 0) return 1;
+        in.links = c->ilinks[s] ? (uint16_t)c->ilinks[s] : 1;
+        if (fl & IS_BAD_CSUM) {
+            in.reserved_0 &= ~INODE_FL_CSUM;
+            in.xattr_ptr = 0;
+        }
+        if (fl & IS_SHORT) {
+            if ((in.reserved_0 & INODE_FL_CSUM) && drop_chain(c, &in) != 0) return 1;
+            extent_t *ext;
+            size_t n;
+            uint64_t blocks = 0;
+            if (fs_inode_map(fs, &in, &ext, &n) != 0) return 1;
+            for (size_t e = 0; e < n; e++) blocks += ext[e].len;
+            free(ext);
+            in.size_bytes = blocks * BS;
+        }
+        if (fs_write_inode(fs, (uint32_t)s, &in) != 0) return 1;
+    }
+    return 0;
+}
+
+// Drop an unreadable dedup index, or correct the counts in a readable
+// one; a block left with no references is freed with the other leaks
+static void repair_refs(fsck_t *c) {
+    fs_image_t *fs = &c->fs;
+    if (c->dedup_bad) {
+        fs->sb.flags &= ~SB_FEAT_DEDUP;
+        fs->sb.dedup_index = 0;
+        fs->sb.dedup_entries = 0;
+        return;
+    }
+    uint64_t base = fs->sb.data_region_start;
+    for (size_t i = 0; i < c->ndedup; i++) {
+        uint32_t found_refs = atomic_load(&c->refs[c->dedup[i].blkno - base]);
+        if (found_refs != c->dedup[i].refs && fs_dedup_set_refs(fs, c->dedup[i].blkno, found_refs) != 0)
+            c->unfixed++;
+    }
+}
+
+static void repair_data_bitmap(fsck_t *c) {
+    fs_image_t *fs = &c->fs;
+    uint64_t base = fs->sb.data_region_start;
+    for (uint64_t b = 0; b < fs->data_bm.nbits; b++) {
+        int seen = (atomic_load(&c->seen[b / 64]) >> (b % 64)) & 1;
+        if (seen != is_bit_set(fs->data_bm.bits, b)) fs_set_block_used(fs, (uint32_t)(base + b), seen);
+    }
+}
+
+// Size and link count agree with the entries present (Pass 5)
+static int dir_counts_ok(const fs_dir_t *d) {
+    return d->inode.size_bytes == d->live * sizeof(dirent64_t) && d->inode.links == dir_links(d->live);
+}
+
+// A misplaced entry and the directory it is re-added to
+typedef struct {
+    fs_dir_t *d;
+    dirent64_t e;
+} relink_t;
+
+// Re-add misplaced entries and give unlinked inodes a name in the root
+static int repair_links(fsck_t *c, const relink_t *relink, size_t nrelink) {
+    fs_image_t *fs = &c->fs;
+    for (size_t i = 0; i < nrelink; i++) {
+        const dirent64_t *e = &relink[i].e;
+        uint8_t type = (c->flags[e->ino - 1] & IS_DIR) ? DIRENT_DIR : DIRENT_FILE;
+        if (fs_link(fs, relink[i].d, e->name, e->ino, type) != 0) c->unfixed++;
+    }
+    for (uint64_t s = 1; s < fs->sb.inode_count; s++) {
+        if (!(c->flags[s] & IS_KEPT) || c->ilinks[s]) continue;
+        char name[NAME_MAX_LEN + 1];
+        snprintf(name, sizeof(name), "#%" PRIu64, s + 1);
+        if (fs_link(fs, &fs->root, name, (uint32_t)s + 1, DIRENT_FILE) != 0) c->unfixed++;
+        else printf("  Inode %" PRIu64 " reconnected as '%s'\n", s + 1, name);
+    }
+    return 0;
+}
+
+// Group counters and free totals straight from the repaired bitmaps
+static void recount_groups(fs_image_t *fs) {
+    fs->data_bm.nfree = fs->inode_bm.nfree = 0;
+    for (uint64_t g = 0; g < fs->sb.group_count; g++) {
+        group_t *grp = &fs->groups[g];
+        uint64_t fb = bitmap_count_free(&fs->data_bm, grp->data_start, grp->data_end);
+        uint64_t fi = bitmap_count_free(&fs->inode_bm, grp->ino_start, grp->ino_end);
+        if (fb != grp->free_blocks || fi != grp->free_inodes) fs->group_dirty[g] = 1;
+        if (fs->gdt) {
+            const group_desc_t *gd = (const group_desc_t *)fs->gdt + g;
+            if (from_le32(gd->free_blocks) != fb || from_le32(gd->free_inodes) != fi) fs->group_dirty[g] = 1;
+        }
+        grp->free_blocks = fb;
+        grp->free_inodes = fi;
+        fs->data_bm.nfree += fb;
+        fs->inode_bm.nfree += fi;
+    }
+}
+
+static int repair(fsck_t *c, const char *journal_name) {
+    fs_image_t *fs = &c->fs;
+    size_t slots = 0, nrelink = 0;
+    for (size_t k = 0; k < c->ndirs; k++) slots += (size_t)c->dirs[k].d->nblocks * DIRENTS_PER_BLOCK;
+    relink_t *relink = malloc(slots * sizeof(*relink));
+    if (!relink) {
+        perror("Failed to allocate relink list");
+        return 1;
+    }
+    for (size_t k = 0; k < c->ndirs; k++) {
+        fs_dir_t *d = c->dirs[k].d;
+        for (size_t i = 0; i < (size_t)d->nblocks * DIRENTS_PER_BLOCK; i++)
+            if (c->dirs[k].de_act[i] == DE_RELINK) relink[nrelink++] = (relink_t){ d, ((dirent64_t *)d->ents)[i] };
+    }
+
+    int status = 1;
+    for (size_t k = 0; k < c->ndirs; k++) repair_dir(c, &c->dirs[k]);
+    if (repair_inodes(c) != 0) goto out;
+    repair_refs(c);
+    //Shared blocks are copied into fresh ones, so the bitmap must be right first
+    repair_data_bitmap(c);
+    if (resolve_shared(c, 1) != 0) goto out;
+    if (repair_links(c, relink, nrelink) != 0) goto out;
+
+    for (size_t k = 0; k < c->ndirs; k++) {
+        fs_dir_t *d = c->dirs[k].d;
+        if (dir_counts_ok(d) && !(c->flags[d->ino - 1] & IS_BAD_CRC)) continue;
+        d->inode.size_bytes = d->live * sizeof(dirent64_t);
+        d->inode.links = dir_links(d->live);
+        d->inode_dirty = 1;
+        //Only a repair Pass 5 would accept is counted as one
+        if (!dir_counts_ok(d)) c->unfixed++;
+    }
+    recount_groups(fs);
+    if (fs_commit(fs, journal_name) != 0) goto out;
+    status = 0;
+
+out:
+    free(relink);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    const char *image_name = NULL;
+    unsigned open_flags = 0;
+    int do_repair = 0;
+    int verify_data = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repair") == 0) {
+            do_repair = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--verify-data") == 0) {
+            verify_data = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return FSCK_ERROR;
+        }
+        if (strcmp(argv[i], "--image") == 0) image_name = argv[++i];
+        else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = atol(argv[++i]);
+            if (jobs < 1) {
+                fprintf(stderr, "Error: --jobs must be at least 1\n");
+                return FSCK_ERROR;
+            }
+        }
+        else if (strcmp(argv[i], "--io") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "psync") == 0) open_flags |= FS_OPEN_PSYNC;
+            else if (strcmp(name, "uring") != 0) {
+                fprintf(stderr, "Error: Unknown I/O backend '%s'\n", name);
+                return FSCK_ERROR;
+            }
+        }
+    }
+    if (!image_name) {
+        fprintf(stderr, "Usage: %s --image <image.img> [--repair] [--verify-data] [--jobs <n>] [--io <uring|psync>]\n", argv[0]);
+        return FSCK_ERROR;
+    }
+
+    //A repair commits through the same journal as mkfs_adder --in-place
+    char journal_name[4096];
+    snprintf(journal_name, sizeof(journal_name), "%s.journal", image_name);
+    if (do_repair && fs_journal_replay(image_name, journal_name) != 0) return FSCK_ERROR;
+
+    //Without --repair a committed journal stays unreplayed, and the image
+    //it has not finished updating would only report as corrupt
+    int journal = do_repair ? FS_JOURNAL_NONE : fs_journal_pending(journal_name);
+    if (journal < 0) return FSCK_ERROR;
+    if (journal == FS_JOURNAL_COMMITTED) {
+        printf("%s: needs journal recovery from '%s', run with --repair to replay it\n", image_name, journal_name);
+        return FSCK_UNCORRECTED;
+    }
+    if (journal == FS_JOURNAL_INCOMPLETE)
+        printf("%s: incomplete journal '%s' left behind, --repair will discard it\n", image_name, journal_name);
+
+    fsck_t *c = calloc(1, sizeof(*c));
+    if (!c) {
+        perror("Failed to allocate checker state");
+        return FSCK_ERROR;
+    }
+    int status = FSCK_ERROR;
+    c->repair = do_repair;
+    c->verify_data = verify_data;
+    if (fs_open(&c->fs, image_name, open_flags | (do_repair ? 0 : FS_OPEN_RDONLY)) != 0) goto out;
+    fs_image_t *fs = &c->fs;
+    c->fd = fileno(fs->img);
+
+    c->words = (fs->sb.data_region_blocks + 63) / 64;
+    c->ilinks = calloc(fs->sb.inode_count, sizeof(*c->ilinks));
+    c->flags = calloc(fs->sb.inode_count, sizeof(*c->flags));
+    c->bad = calloc(fs->sb.inode_count, 1);
+    c->seen = calloc(c->words ? c->words : 1, sizeof(*c->seen));
+    c->dup = calloc(c->words ? c->words : 1, sizeof(*c->dup));
+    if (!c->ilinks || !c->flags || !c->bad || !c->seen || !c->dup) {
+        perror("Failed to allocate checker state");
+        goto out;
+    }
+    atomic_init(&c->failed, 0);
+
+    printf("Pass 1: Checking superblock and block groups\n");
+    check_super(c);
+    if (load_dedup(c) != 0) goto out;
+    printf("Pass 2: Checking directory entries\n");
+    if (check_dirs(c) != 0) goto out;
+    printf("Pass 3: Checking inodes and block maps (%ld threads, %s)\n", jobs, blkio_backend_name(&fs->io));
+    if (scan_inodes(c, (int)jobs) != 0) goto out;
+    check_inodes(c);
+    if (c->unfixed) {
+        printf("Root inode is unusable, not checking further\n");
+        status = FSCK_UNCORRECTED;
+        goto out;
+    }
+
+    printf("Pass 4: Checking shared blocks and bitmaps\n");
+    int any_dup = 0;
+    for (uint64_t w = 0; w < c->words && !any_dup; w++) any_dup = atomic_load(&c->dup[w]) != 0;
+    if (any_dup) {
+        c->scan_dups = 1;
+        if (scan_inodes(c, (int)jobs) != 0 || resolve_shared(c, 0) != 0) goto out;
+    }
+    check_refs(c);
+    check_data_bitmap(c);
+
+    printf("Pass 5: Checking directory counts\n");
+    for (size_t k = 0; k < c->ndirs; k++) {
+        const fs_dir_t *d = c->dirs[k].d;
+        if (dir_counts_ok(d)) continue;
+        if (d->ino == ROOT_INO)
+            problem(P_ROOT, "Root directory size %" PRIu64 " and %u links, %" PRIu64 " entries present",
+                    d->inode.size_bytes, d->inode.links, d->live);
+        else
+            problem(P_LINKS, "Directory %u: size %" PRIu64 " and %u links, %" PRIu64 " entries present",
+                    d->ino, d->inode.size_bytes, d->inode.links, d->live);
+    }
+
+    uint64_t total = 0;
+    for (int k = 0; k < P_KINDS; k++) {
+        total += found[k];
+        if (found[k] > REPORT_LIMIT)
+            printf("  ... %" PRIu64 " more %s problems\n", found[k] - REPORT_LIMIT, kind_names[k]);
+    }
+
+    if (total && c->repair) {
+        printf("Repairing\n");
+        if (repair(c, journal_name) != 0) goto out;
+    }
+
+    printf("%s: %" PRIu64 "/%" PRIu64 " inodes, %" PRIu64 "/%" PRIu64 " data blocks in use\n", image_name,
+           fs->sb.inode_count - fs->inode_bm.nfree, fs->sb.inode_count,
+           fs->sb.data_region_blocks - fs->data_bm.nfree, fs->sb.data_region_blocks);
+    if (!total) {
+        printf("%s: clean\n", image_name);
+        status = FSCK_OK;
+    } else if (!c->repair) {
+        printf("%s: %" PRIu64 " problems found, run with --repair to fix them\n", image_name, total);
+        status = FSCK_UNCORRECTED;
+    } else if (c->unfixed) {
+        printf("%s: %" PRIu64 " problems found, %" PRIu64 " could not be fixed\n", image_name, total, c->unfixed);
+        status = FSCK_UNCORRECTED;
+    } else {
+        printf("%s: %" PRIu64 " problems found and fixed\n", image_name, total);
+        status = FSCK_CORRECTED;
+    }
+
+out:
+    fs_close(&c->fs);
+    free(c->ilinks);
+    free(c->flags);
+    free(c->bad);
+    for (size_t k = 0; k < c->ndirs; k++) free(c->dirs[k].de_act);
+    free(c->dirs);
+    free((void *)c->seen);
+    free((void *)c->dup);
+    free(c->dedup);
+    free(c->indexed);
+    free((void *)c->refs);
+    free(c);
+    return status;
+}